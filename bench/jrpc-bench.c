@@ -0,0 +1,700 @@
+/**
+ * This file is part of libjrpc library code.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See LICENCE.txt file for more details.
+ */
+
+/*
+ * End to end load generator. Drives an in-process jrpc_server() (or an
+ * external one, -a) from a number of client threads, either closed loop
+ * (next call as soon as the previous one returns, -P calls in flight for
+ * the async client) or open loop at a fixed total rate with Poisson
+ * arrivals (-r).
+ *
+ * Latencies go into log-linear histograms (HdrHistogram style, under 1%
+ * error). Open loop latency is taken from the time a call was due, not
+ * from when it actually went out, so a stalled server shows up in the
+ * tail instead of silently lowering the rate. Closed loop can't do that,
+ * there the histogram is also reported corrected for coordinated
+ * omission: every call that took n expected intervals accounts for the
+ * n - 1 calls that should have been issued meanwhile.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <jansson.h>
+
+#include "ipsc.h"
+#include "jrpc.h"
+#include "trace.h"
+
+#define BENCH_PORT		0xbe0d
+#define BENCH_MAX_METHODS	16
+#define BENCH_MAX_INFLIGHT	4096	/* async calls per client, open loop */
+#define BENCH_DRAIN_NS		(5 * 1000000000ull)
+
+/* histogram: exact below 2^(SUB_BITS+1), then SUB buckets per power of 2 */
+#define HIST_SUB_BITS		7
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_SIZE		((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum {
+	MODE_REQUEST,	/* jrpc_request(), connection per call */
+	MODE_POOL,	/* jrpc_request() with JRPC_CONN_FLAG_POOL */
+	MODE_CLIENT,	/* jrpc_client_call() on a persistent connection */
+	MODE_ASYNC	/* jrpc_async_call(), pipelined */
+};
+
+static const char *mode_names[] = { "request", "pool", "client", "async" };
+
+typedef struct hist_t {
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t c[HIST_SIZE];
+} hist_t;
+
+typedef struct client_t {
+	int id;
+	pthread_t th;
+	uint64_t rng;
+	uint64_t errors;
+	hist_t hist;		/* ns */
+} client_t;
+
+/* async call in flight */
+typedef struct call_t {
+	jrpc_req_t req;
+	uint64_t t0;
+	client_t *c;
+	struct call_t *next;
+} call_t;
+
+static struct {
+	const char *addr;
+	int port;
+	int loops;
+	int mode;
+	int clients;
+	int depth;
+	double duration;
+	double warmup;
+	double rate;		/* calls/s, all clients, 0 - closed loop */
+	size_t size;
+	double interval;	/* expected interval for the correction, us */
+	jrpc_conn_t conn;
+	jrpc_runtime_t rt;
+	int nmethods;
+	char *methods[BENCH_MAX_METHODS];
+	unsigned int weights[BENCH_MAX_METHODS];	/* cumulative */
+} opt;
+
+static json_t *payload;
+static uint64_t t_warm;		/* calls due before this are not recorded */
+static uint64_t t_end;		/* no calls are due after this */
+
+static uint64_t now_ns( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until( uint64_t t )
+{
+	struct timespec ts;
+
+	ts.tv_sec  = t / 1000000000ull;
+	ts.tv_nsec = t % 1000000000ull;
+	while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) ==
+		EINTR )
+		;
+}
+
+static inline int hist_idx( uint64_t v )
+{
+	int e;
+
+	if ( v < 2 * HIST_SUB )
+		return v;
+	e = 63 - __builtin_clzll( v ) - HIST_SUB_BITS;
+	return e * HIST_SUB + (v >> e);
+}
+
+/* highest value falling into bucket idx */
+static uint64_t hist_value( int idx )
+{
+	int e;
+
+	if ( idx < 2 * HIST_SUB )
+		return idx;
+	e = idx / HIST_SUB - 1;
+	return ((uint64_t)(idx - e * HIST_SUB + 1) << e) - 1;
+}
+
+static void hist_add( hist_t *h, uint64_t v, uint64_t n )
+{
+	if ( !n )
+		return;
+	if ( !h->count || v < h->min )
+		h->min = v;
+	if ( v > h->max )
+		h->max = v;
+	h->count += n;
+	h->c[hist_idx( v )] += n;
+}
+
+static void hist_merge( hist_t *dst, const hist_t *src )
+{
+	int i;
+
+	if ( !src->count )
+		return;
+	if ( !dst->count || src->min < dst->min )
+		dst->min = src->min;
+	if ( src->max > dst->max )
+		dst->max = src->max;
+	dst->count += src->count;
+	for ( i = 0; i < HIST_SIZE; i++ )
+		dst->c[i] += src->c[i];
+}
+
+static uint64_t hist_percentile( const hist_t *h, double p )
+{
+	int i;
+	uint64_t seen = 0;
+	uint64_t want = ceil( p / 100.0 * h->count );
+
+	if ( !want )
+		want = 1;
+	for ( i = 0; i < HIST_SIZE; i++ ) {
+		seen += h->c[i];
+		if ( seen >= want )
+			break;
+	}
+
+	return i < HIST_SIZE && hist_value( i ) < h->max ? hist_value( i ) :
+							   h->max;
+}
+
+/* add the samples a closed loop never took while it waited */
+static void hist_correct( hist_t *dst, const hist_t *src, uint64_t interval )
+{
+	int i;
+	uint64_t v;
+
+	*dst = *src;
+	if ( !interval )
+		return;
+	for ( i = 0; i < HIST_SIZE; i++ ) {
+		if ( !src->c[i] )
+			continue;
+		v = hist_value( i );
+		if ( v > src->max )
+			v = src->max;
+		for ( v -= interval; v >= interval && v < src->max;
+		      v -= interval )
+			hist_add( dst, v, src->c[i] );
+	}
+}
+
+static uint64_t rng_next( uint64_t *s )
+{
+	uint64_t x = *s;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*s = x;
+	return x * 0x2545f4914f6cdd1dull;
+}
+
+/* time till the next arrival, exponentially distributed */
+static uint64_t rng_exp_ns( uint64_t *s, double rate )
+{
+	double u = (rng_next( s ) >> 11) * (1.0 / 9007199254740992.0);
+
+	return -log( 1.0 - u ) / rate * 1e9;
+}
+
+static char *method_pick( client_t *c )
+{
+	int i;
+	unsigned int w;
+
+	if ( opt.nmethods == 1 )
+		return opt.methods[0];
+	w = rng_next( &c->rng ) % opt.weights[opt.nmethods - 1];
+	for ( i = 0; w >= opt.weights[i]; i++ )
+		;
+	return opt.methods[i];
+}
+
+/* when the next call is due, closed loop - now */
+static uint64_t client_next( client_t *c, uint64_t *next )
+{
+	uint64_t now = now_ns();
+
+	if ( !opt.rate )
+		return now;
+	*next += rng_exp_ns( &c->rng, opt.rate / opt.clients );
+	if ( *next > now && *next < t_end )
+		sleep_until( *next );
+	return *next;
+}
+
+static void client_record( client_t *c, uint64_t t0, uint64_t t1,
+			   ssize_t status )
+{
+	if ( t0 < t_warm )
+		return;
+	if ( status != JRPC_SUCCESS )
+		c->errors++;
+	else
+		hist_add( &c->hist, t1 - t0, 1 );
+}
+
+static void *client_sync( void *arg )
+{
+	client_t *c = (client_t *)arg;
+	jrpc_client_t *cli = NULL;
+	jrpc_req_t req = JRPC_CLIENT_DEFAULT;
+	uint64_t next = now_ns();
+	uint64_t t0;
+	ssize_t sb;
+
+	req.conn = opt.conn;
+	req.rt = opt.rt;
+	if ( opt.mode == MODE_POOL )
+		req.conn.flags |= JRPC_CONN_FLAG_POOL;
+	if ( opt.mode == MODE_CLIENT ) {
+		cli = jrpc_client_open( &req.conn );
+		if ( !cli ) {
+			fprintf( stderr, "client %i: can't connect\n", c->id );
+			c->errors++;
+			return NULL;
+		}
+	}
+	req.jid = json_integer( c->id );
+
+	while ( (t0 = client_next( c, &next )) < t_end ) {
+		req.method = method_pick( c );
+		req.jparams = json_incref( payload );
+		if ( cli )
+			sb = jrpc_client_call( cli, &req );
+		else
+			sb = jrpc_request( &req );
+		client_record( c, t0, now_ns(), sb );
+		json_decref( req.jres );
+		req.jres = NULL;
+	}
+
+	json_decref( req.jid );
+	if ( cli )
+		jrpc_client_close( cli );
+	return NULL;
+}
+
+static __thread call_t *call_list;	/* free calls of this client */
+
+static void call_done( jrpc_req_t *req, void *arg )
+{
+	call_t *k = (call_t *)arg;
+
+	client_record( k->c, k->t0, now_ns(), req->status );
+	json_decref( req->jres );
+	req->jres = NULL;
+	k->next = call_list;
+	call_list = k;
+}
+
+static int call_start( jrpc_async_t *as, client_t *c, uint64_t t0 )
+{
+	call_t *k = call_list;
+
+	call_list = k->next;
+	k->c = c;
+	k->t0 = t0;
+	k->req.method = method_pick( c );
+	k->req.jparams = json_incref( payload );
+	k->req.rt = opt.rt;
+	if ( jrpc_async_call( as, &k->req, call_done, k ) ) {
+		client_record( c, t0, now_ns(), JRPC_ERR_SEND );
+		k->next = call_list;
+		call_list = k;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *client_async( void *arg )
+{
+	int i;
+	client_t *c = (client_t *)arg;
+	int max = opt.rate ? BENCH_MAX_INFLIGHT : opt.depth;
+	call_t *calls = (call_t *)calloc( max, sizeof *calls );
+	jrpc_async_t *as = NULL;
+	uint64_t next = now_ns();
+	uint64_t now;
+	uint64_t wait;
+	struct pollfd pfd;
+	struct timespec ts;
+
+	if ( !calls )
+		return NULL;
+	for ( i = 0; i < max; i++ ) {
+		calls[i].next = call_list;
+		call_list = &calls[i];
+	}
+	if ( opt.rate )
+		next += rng_exp_ns( &c->rng, opt.rate / opt.clients );
+
+	while ( 1 ) {
+		now = now_ns();
+		if ( now >= t_end && (!as || !jrpc_async_pending( as ) ||
+				      now >= t_end + BENCH_DRAIN_NS) )
+			break;
+
+		/* calls in flight fail through call_done() */
+		if ( as && jrpc_async_fd( as ) < 0 ) {
+			jrpc_async_close( as );
+			as = NULL;
+		}
+		if ( !as ) {
+			as = jrpc_async_open( &opt.conn );
+			if ( !as ) {
+				client_record( c, now, now, JRPC_ERR_GENERIC );
+				usleep( 10000 );
+				continue;
+			}
+		}
+
+		if ( !opt.rate ) {
+			while ( call_list && now < t_end &&
+				!call_start( as, c, now_ns() ) )
+				;
+			wait = 100 * 1000000ull;
+		} else {
+			/* late calls keep their due time, the wait is latency */
+			while ( call_list && next <= now && next < t_end ) {
+				call_start( as, c, next );
+				next += rng_exp_ns( &c->rng, opt.rate / opt.clients );
+			}
+			wait = next > now ? next - now : 100 * 1000000ull;
+			if ( wait > 100 * 1000000ull )
+				wait = 100 * 1000000ull;
+		}
+
+		pfd.fd = jrpc_async_fd( as );
+		pfd.events = POLLIN;
+		ts.tv_sec  = wait / 1000000000ull;
+		ts.tv_nsec = wait % 1000000000ull;
+		if ( pfd.fd >= 0 && ppoll( &pfd, 1, &ts, NULL ) > 0 )
+			jrpc_async_dispatch( as );
+	}
+
+	if ( as )
+		jrpc_async_close( as );
+	free( calls );
+	return NULL;
+}
+
+static ssize_t bench_echo( ipsc_t *ipsc, json_t *jparams, json_t *jid )
+{
+	ssize_t sb;
+	json_t *jres = jparams ? json_incref( jparams ) : json_null();
+
+	sb = jrpc_send_reply( ipsc, jres, jid, JRPC_REPLY_TYPE_RESULT );
+	json_decref( jres );
+	return sb;
+}
+
+static ssize_t bench_null( ipsc_t *ipsc, json_t *jparams, json_t *jid )
+{
+	ssize_t sb;
+	json_t *jres = json_true();
+
+	sb = jrpc_send_reply( ipsc, jres, jid, JRPC_REPLY_TYPE_RESULT );
+	json_decref( jres );
+	return sb;
+}
+
+static jrpc_method_t bench_methods[] = {
+	{ "echo", JRPC_CB_OPT_PARAMS, JRPC_CBS{ bench_echo, NULL }, 0, 0,
+	  NULL, NULL },
+	{ "null", JRPC_CB_OPT_PARAMS, JRPC_CBS{ bench_null, NULL }, 0, 0,
+	  NULL, NULL },
+	JRPC_METHODS_END
+};
+
+/* "name[:weight],..." */
+static int mix_parse( char *mix )
+{
+	char *tok;
+	char *save = NULL;
+	char *w;
+	unsigned int sum = 0;
+
+	for ( tok = strtok_r( mix, ",", &save ); tok;
+	      tok = strtok_r( NULL, ",", &save ) ) {
+		if ( opt.nmethods == BENCH_MAX_METHODS )
+			return -1;
+		w = strchr( tok, ':' );
+		if ( w )
+			*w++ = '\0';
+		sum += w ? strtoul( w, NULL, 10 ) : 1;
+		opt.methods[opt.nmethods] = tok;
+		opt.weights[opt.nmethods++] = sum;
+	}
+
+	return opt.nmethods && sum ? 0 : -1;
+}
+
+static json_t *payload_new( size_t size )
+{
+	json_t *jp;
+	char *data;
+
+	if ( !size )
+		return NULL;
+	data = (char *)malloc( size + 1 );
+	if ( !data )
+		return NULL;
+	memset( data, 'x', size );
+	data[size] = '\0';
+	jp = json_object();
+	json_object_set_new( jp, "data", json_string( data ) );
+	free( data );
+
+	return jp;
+}
+
+static void report_line( const char *what, const hist_t *h )
+{
+	printf( "%-10s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", what,
+		h->min / 1e3, hist_percentile( h, 50 ) / 1e3,
+		hist_percentile( h, 90 ) / 1e3, hist_percentile( h, 99 ) / 1e3,
+		hist_percentile( h, 99.9 ) / 1e3,
+		hist_percentile( h, 99.99 ) / 1e3, h->max / 1e3 );
+}
+
+static void report( client_t *clients )
+{
+	int i;
+	uint64_t errors = 0;
+	uint64_t interval;
+	hist_t *all = (hist_t *)calloc( 1, sizeof *all );
+	hist_t *fixed = (hist_t *)calloc( 1, sizeof *fixed );
+
+	if ( !all || !fixed )
+		goto exit;
+	for ( i = 0; i < opt.clients; i++ ) {
+		hist_merge( all, &clients[i].hist );
+		errors += clients[i].errors;
+	}
+
+	printf( "# %s, %i clients, ", mode_names[opt.mode], opt.clients );
+	if ( opt.mode == MODE_ASYNC && !opt.rate )
+		printf( "%i in flight each, ", opt.depth );
+	if ( opt.rate )
+		printf( "open loop %.0f calls/s, ", opt.rate );
+	else
+		printf( "closed loop, " );
+	printf( "%zu byte payload, %.1f s\n", opt.size, opt.duration );
+	printf( "calls      %9llu\nerrors     %9llu\n",
+		(unsigned long long)all->count, (unsigned long long)errors );
+	printf( "throughput %9.1f calls/s\n", all->count / opt.duration );
+	if ( !all->count )
+		goto exit;
+
+	printf( "%-10s %9s %9s %9s %9s %9s %9s %9s\n", "# us", "min", "p50",
+		"p90", "p99", "p99.9", "p99.99", "max" );
+	report_line( "latency", all );
+	if ( !opt.rate ) {
+		interval = opt.interval ? opt.interval * 1e3 :
+					  hist_percentile( all, 50 );
+		hist_correct( fixed, all, interval );
+		report_line( "corrected", fixed );
+		printf( "# corrected for an expected interval of %.1f us\n",
+			interval / 1e3 );
+	}
+
+exit:
+	free( fixed );
+	free( all );
+}
+
+static void usage( const char *name )
+{
+	fprintf( stderr,
+"usage: %s [options]\n"
+"  -a addr       external server, \"unix:N\", \"tcp:host:port\"...\n"
+"                (default: one in process, methods echo and null)\n"
+"  -p port       Unix port of the in process server (%i)\n"
+"  -l loops      event loops of the in process server (1)\n"
+"  -m mode       request, pool, client or async (client)\n"
+"  -c clients    client threads (1)\n"
+"  -P depth      async calls in flight per client, closed loop (16)\n"
+"  -r rate       open loop, total calls/s with Poisson arrivals\n"
+"  -d secs       measured duration (10)\n"
+"  -w secs       warmup, not measured (1)\n"
+"  -s bytes      payload size (64)\n"
+"  -M mix        methods and weights, \"echo:9,null:1\" (echo)\n"
+"  -t transport  stream, seqpacket or shm (stream)\n"
+"  -U            unframed (legacy) messages\n"
+"  -e            CBOR encoding\n"
+"  -i usecs      expected interval for the closed loop correction\n"
+"                (default: median latency)\n",
+		name, BENCH_PORT );
+}
+
+int main( int argc, char **argv )
+{
+	int i;
+	int ch;
+	int ret = 1;
+	char mix[] = "echo";
+	char *mixarg = mix;
+	jrpc_t srv = JRPC_SERVER_DEFAULT;
+	pthread_t server;
+	client_t *clients = NULL;
+	uint64_t t_start;
+
+	opt.port = BENCH_PORT;
+	opt.loops = 1;
+	opt.mode = MODE_CLIENT;
+	opt.clients = 1;
+	opt.depth = 16;
+	opt.duration = 10;
+	opt.warmup = 1;
+	opt.size = 64;
+	opt.conn = srv.conn;
+	opt.conn.flags |= JRPC_CONN_FLAG_FRAMED;
+
+	while ( (ch = getopt( argc, argv, "a:p:l:m:c:P:r:d:w:s:M:t:Uei:h" )) !=
+		-1 ) {
+		switch ( ch ) {
+		case 'a': opt.addr = optarg; break;
+		case 'p': opt.port = atoi( optarg ); break;
+		case 'l': opt.loops = atoi( optarg ); break;
+		case 'm':
+			for ( i = 0; i <= MODE_ASYNC; i++ ) {
+				if ( !strcmp( optarg, mode_names[i] ) )
+					break;
+			}
+			if ( i > MODE_ASYNC )
+				goto usage;
+			opt.mode = i;
+			break;
+		case 'c': opt.clients = atoi( optarg ); break;
+		case 'P': opt.depth = atoi( optarg ); break;
+		case 'r': opt.rate = atof( optarg ); break;
+		case 'd': opt.duration = atof( optarg ); break;
+		case 'w': opt.warmup = atof( optarg ); break;
+		case 's': opt.size = strtoul( optarg, NULL, 10 ); break;
+		case 'M': mixarg = optarg; break;
+		case 't':
+			if ( !strcmp( optarg, "stream" ) )
+				opt.conn.transport = JRPC_TRANSPORT_STREAM;
+			else if ( !strcmp( optarg, "seqpacket" ) )
+				opt.conn.transport = JRPC_TRANSPORT_SEQPACKET;
+			else if ( !strcmp( optarg, "shm" ) )
+				opt.conn.transport = JRPC_TRANSPORT_SHM;
+			else
+				goto usage;
+			break;
+		case 'U': opt.conn.flags &= ~JRPC_CONN_FLAG_FRAMED; break;
+		case 'e': opt.rt.bin_ctx = (void *)&jrpc_codec_cbor; break;
+		case 'i': opt.interval = atof( optarg ); break;
+		default:
+			goto usage;
+		}
+	}
+	if ( opt.clients < 1 || opt.depth < 1 || opt.duration <= 0 ||
+	     opt.rate < 0 || mix_parse( mixarg ) )
+		goto usage;
+
+	signal( SIGPIPE, SIG_IGN );
+	jrpc_trace_set_level( JRPC_TRACE_OFF );
+
+	opt.conn.port = opt.port;
+	opt.conn.addr = opt.addr;
+	payload = payload_new( opt.size );
+
+	if ( !opt.addr ) {
+		srv.conn.port = opt.port;
+		/* shm is negotiated over a stream connection */
+		srv.conn.transport = opt.conn.transport == JRPC_TRANSPORT_SHM ?
+				     JRPC_TRANSPORT_STREAM : opt.conn.transport;
+		srv.methods = bench_methods;
+		srv.loops = opt.loops;
+		srv.rt = opt.rt;
+		if ( pthread_create( &server, NULL, jrpc_server, &srv ) ) {
+			perror( "pthread_create" );
+			goto exit;
+		}
+		while ( jrpc_server_wake( &srv ) )
+			usleep( 1000 );
+	}
+
+	clients = (client_t *)calloc( opt.clients, sizeof *clients );
+	if ( !clients )
+		goto stop;
+
+	t_start = now_ns();
+	t_warm = t_start + opt.warmup * 1e9;
+	t_end = t_warm + opt.duration * 1e9;
+	for ( i = 0; i < opt.clients; i++ ) {
+		clients[i].id = i + 1;
+		clients[i].rng = (t_start ^ (0x9e3779b97f4a7c15ull * (i + 1))) | 1;
+		if ( pthread_create( &clients[i].th, NULL,
+				     opt.mode == MODE_ASYNC ? client_async :
+							      client_sync,
+				     &clients[i] ) ) {
+			perror( "pthread_create" );
+			opt.clients = i;
+			break;
+		}
+	}
+	for ( i = 0; i < opt.clients; i++ )
+		pthread_join( clients[i].th, NULL );
+
+	report( clients );
+	ret = 0;
+
+stop:
+	if ( !opt.addr ) {
+		jrpc_server_stop( &srv );
+		pthread_join( server, NULL );
+	}
+exit:
+	jrpc_pool_flush();
+	free( clients );
+	json_decref( payload );
+	return ret;
+
+usage:
+	usage( argv[0] );
+	return 2;
+}
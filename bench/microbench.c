@@ -0,0 +1,442 @@
+/**
+ * This file is part of libjrpc library code.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See LICENCE.txt file for more details.
+ */
+
+/*
+ * Hot path stages timed one by one over a socketpair, no server loop in
+ * between. One line per benchmark, benchstat compatible:
+ *
+ *   name  iterations  ns/op  allocs/op
+ *
+ * allocs are jansson allocations made inside the timed part. Only the
+ * stage itself is timed, feeding and draining the other end is not.
+ *
+ * usage: microbench [-t msecs per benchmark] [name filter ...]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <jansson.h>
+
+#include "ipsc.h"
+#include "jrpc.h"
+#include "trace.h"
+
+#define BENCH_PORT	0xbe0c
+#define BENCH_BATCH	32	/* messages queued in the socket at once */
+
+typedef struct bench_t {
+	const char *name;
+	void (*fn)( struct bench_t *b, size_t n );
+	int arg;
+} bench_t;
+
+static uint64_t bench_ns;
+static uint64_t bench_t0;
+static size_t bench_allocs;
+static int bench_on;
+
+static ipsc_t *cli;		/* client end, framed */
+static ipsc_t *srv;		/* server end, what jrpc_process() sees */
+static jrpc_t jrpc = JRPC_SERVER_DEFAULT;
+static jrpc_req_t creq = JRPC_CLIENT_DEFAULT;
+
+static uint64_t now_ns( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *count_malloc( size_t size )
+{
+	if ( bench_on )
+		bench_allocs++;
+	return malloc( size );
+}
+
+static void count_free( void *p )
+{
+	free( p );
+}
+
+static inline void bench_start( void )
+{
+	bench_on = 1;
+	bench_t0 = now_ns();
+}
+
+static inline void bench_stop( void )
+{
+	bench_ns += now_ns() - bench_t0;
+	bench_on = 0;
+}
+
+/* throw away whatever the other end has written so far */
+static void drain( ipsc_t *ipsc )
+{
+	char buf[65536];
+
+	while ( recv( ipsc->sd, buf, sizeof buf, MSG_DONTWAIT ) > 0 )
+		;
+}
+
+static json_t *params_new( int large )
+{
+	int i;
+	json_t *jp = json_object();
+	json_t *ja;
+	json_t *jo;
+
+	json_object_set_new( jp, "name", json_string( "sensor-0042" ) );
+	json_object_set_new( jp, "value", json_real( 21.5 ) );
+	json_object_set_new( jp, "enabled", json_true() );
+	if ( !large )
+		return jp;
+
+	ja = json_array();
+	for ( i = 0; i < 100; i++ ) {
+		jo = json_object();
+		json_object_set_new( jo, "id", json_integer( i ) );
+		json_object_set_new( jo, "label", json_string( "some label" ) );
+		json_object_set_new( jo, "ratio", json_real( i / 7.0 ) );
+		json_array_append_new( ja, jo );
+	}
+	json_object_set_new( jp, "items", ja );
+
+	return jp;
+}
+
+static json_t *request_new( const char *method, int large )
+{
+	json_t *jroot = json_object();
+
+	json_object_set_new( jroot, "jsonrpc", json_string( "2.0" ) );
+	json_object_set_new( jroot, "method", json_string( method ) );
+	json_object_set_new( jroot, "params", params_new( large ) );
+	json_object_set_new( jroot, "id", json_integer( 1 ) );
+
+	return jroot;
+}
+
+static void bench_ipsc( bench_t *b, size_t n )
+{
+	size_t i;
+	char *buf = calloc( 1, b->arg );
+
+	for ( i = 0; i < n; i++ ) {
+		bench_start();
+		ipsc_send( cli, buf, b->arg );
+		ipsc_recvn( srv, buf, b->arg, 0 );
+		bench_stop();
+	}
+
+	free( buf );
+}
+
+static void bench_send_json( bench_t *b, size_t n )
+{
+	size_t i;
+	json_t *jroot = request_new( "echo", b->arg );
+
+	for ( i = 0; i < n; i++ ) {
+		bench_start();
+		jrpc_send_json( cli, jroot );
+		bench_stop();
+		if ( i % BENCH_BATCH == BENCH_BATCH - 1 )
+			drain( srv );
+	}
+	drain( srv );
+
+	json_decref( jroot );
+}
+
+static void bench_recv_json( bench_t *b, size_t n )
+{
+	size_t i;
+	size_t k;
+	json_t *jroot = request_new( "echo", b->arg );
+	json_t *jp;
+
+	for ( i = 0; i < n; i += k ) {
+		for ( k = 0; k < BENCH_BATCH && i + k < n; k++ )
+			jrpc_send_json( cli, jroot );
+		bench_start();
+		for ( k = 0; k < BENCH_BATCH && i + k < n; k++ ) {
+			jrpc_recv_json( srv, &jp );
+			json_decref( jp );
+		}
+		bench_stop();
+	}
+
+	json_decref( jroot );
+}
+
+static void bench_send_reply( bench_t *b, size_t n )
+{
+	size_t i;
+	json_t *jres = params_new( b->arg );
+	json_t *jid = json_integer( 1 );
+
+	for ( i = 0; i < n; i++ ) {
+		bench_start();
+		jrpc_send_reply( srv, jres, jid, JRPC_REPLY_TYPE_RESULT );
+		bench_stop();
+		if ( i % BENCH_BATCH == BENCH_BATCH - 1 )
+			drain( cli );
+	}
+	drain( cli );
+
+	json_decref( jid );
+	json_decref( jres );
+}
+
+static ssize_t echo( ipsc_t *ipsc, json_t *jparams, json_t *jid )
+{
+	return jrpc_send_reply( ipsc, jparams, jid, JRPC_REPLY_TYPE_RESULT );
+}
+
+/* a pure read with a sizeable answer, what the result cache is for */
+static ssize_t status( ipsc_t *ipsc, json_t *jparams, json_t *jid )
+{
+	ssize_t sb;
+	json_t *jres = params_new( 1 );
+
+	sb = jrpc_send_reply( ipsc, jres, jid, JRPC_REPLY_TYPE_RESULT );
+	json_decref( jres );
+	return sb;
+}
+
+static jrpc_cb_t handlers[] = { echo, NULL };
+static jrpc_cb_t status_handlers[] = { status, NULL };
+static jrpc_method_t *methods;
+static pthread_t server;
+
+/*
+ * method table of the given size, indexed by a server that runs idle;
+ * "status" and "status.cached" come on top
+ */
+static int methods_start( int size )
+{
+	int i;
+	char name[32];
+
+	methods = (jrpc_method_t *)calloc( size + 3, sizeof *methods );
+	for ( i = 0; i < size; i++ ) {
+		snprintf( name, sizeof name, "method.%i", i );
+		methods[i].name = strdup( name );
+		methods[i].params = JRPC_CB_HAS_PARAMS;
+		methods[i].handlers = handlers;
+	}
+	for ( i = size; i < size + 2; i++ ) {
+		methods[i].name = strdup( i == size ? "status" : "status.cached" );
+		methods[i].params = JRPC_CB_NO_PARAMS;
+		methods[i].handlers = status_handlers;
+		methods[i].cache_ms = i == size ? 0 : 60000;
+	}
+
+	jrpc.conn.port = BENCH_PORT;
+	jrpc.methods = methods;
+	if ( pthread_create( &server, NULL, jrpc_server, &jrpc ) )
+		return -1;
+	while ( jrpc_server_wake( &jrpc ) )
+		usleep( 1000 );
+
+	return 0;
+}
+
+static void methods_stop( void )
+{
+	int i;
+
+	jrpc_server_stop( &jrpc );
+	pthread_join( server, NULL );
+	for ( i = 0; methods[i].name; i++ )
+		free( methods[i].name );
+	free( methods );
+	methods = NULL;
+	jrpc.methods = NULL;
+}
+
+static void bench_method_find( bench_t *b, size_t n )
+{
+	size_t i;
+	char name[32];
+	size_t len;
+	jrpc_method_t m;
+
+	len = snprintf( name, sizeof name, "method.%i", b->arg - 1 );
+	bench_start();
+	for ( i = 0; i < n; i++ )
+		jrpc_method_find( &jrpc, name, len, &m );
+	bench_stop();
+}
+
+/* whole request: parse, look the method up, reply */
+static void process( const char *name, size_t n )
+{
+	size_t i;
+	size_t k;
+	json_t *jroot = request_new( name, 0 );
+
+	for ( i = 0; i < n; i += k ) {
+		for ( k = 0; k < BENCH_BATCH && i + k < n; k++ )
+			jrpc_send_json( cli, jroot );
+		/* serves everything queued in one go, as the loop does */
+		bench_start();
+		jrpc_process( srv );
+		bench_stop();
+		drain( cli );
+	}
+
+	json_decref( jroot );
+}
+
+static void bench_process( bench_t *b, size_t n )
+{
+	char name[32];
+
+	snprintf( name, sizeof name, "method.%i", b->arg - 1 );
+	process( name, n );
+}
+
+/* the same read with and without the result cache */
+static void bench_status( bench_t *b, size_t n )
+{
+	process( b->arg ? "status.cached" : "status", n );
+}
+
+static bench_t benches[] = {
+	{ "ipsc_roundtrip/64",		bench_ipsc,		64 },
+	{ "ipsc_roundtrip/4096",	bench_ipsc,		4096 },
+	{ "send_json/small",		bench_send_json,	0 },
+	{ "send_json/large",		bench_send_json,	1 },
+	{ "recv_json/small",		bench_recv_json,	0 },
+	{ "recv_json/large",		bench_recv_json,	1 },
+	{ "send_reply/small",		bench_send_reply,	0 },
+	{ "send_reply/large",		bench_send_reply,	1 },
+	{ "method_find/8",		bench_method_find,	8 },
+	{ "method_find/64",		bench_method_find,	64 },
+	{ "method_find/512",		bench_method_find,	512 },
+	{ "method_find/4096",		bench_method_find,	4096 },
+	{ "process/8",			bench_process,		8 },
+	{ "process/64",			bench_process,		64 },
+	{ "process/512",		bench_process,		512 },
+	{ "process/4096",		bench_process,		4096 },
+	{ "status/nocache",		bench_status,		0 },
+	{ "status/cached",		bench_status,		1 },
+	{ NULL, NULL, 0 }
+};
+
+static int wanted( const char *name, int argc, char **argv )
+{
+	int i;
+
+	if ( !argc )
+		return 1;
+	for ( i = 0; i < argc; i++ ) {
+		if ( strstr( name, argv[i] ) )
+			return 1;
+	}
+
+	return 0;
+}
+
+/* double the iterations until the timed part takes long enough */
+static void run( bench_t *b, uint64_t target_ns )
+{
+	size_t n = 16;
+
+	while ( 1 ) {
+		bench_ns = 0;
+		bench_allocs = 0;
+		b->fn( b, n );
+		if ( bench_ns >= target_ns || n >= ((size_t)1 << 30) )
+			break;
+		n *= 2;
+	}
+
+	printf( "%-24s %10zu %12.1f ns/op %8.2f allocs/op\n", b->name, n,
+		(double)bench_ns / n, (double)bench_allocs / n );
+	fflush( stdout );
+}
+
+int main( int argc, char **argv )
+{
+	int i;
+	int size = 0;
+	uint64_t target_ns = 200 * 1000000ull;
+	ipsc_t *pair[2];
+
+	if ( argc > 2 && !strcmp( argv[1], "-t" ) ) {
+		target_ns = strtoull( argv[2], NULL, 10 ) * 1000000ull;
+		argc -= 2;
+		argv += 2;
+	}
+
+	json_set_alloc_funcs( count_malloc, count_free );
+	jrpc_trace_set_level( JRPC_TRACE_OFF );
+
+	if ( ipsc_pair( pair ) ) {
+		perror( "ipsc_pair" );
+		return 1;
+	}
+	cli = pair[0];
+	srv = pair[1];
+	cli->cb_args = &creq;
+	cli->flags |= JRPC_FLAG_FRAMED | JRPC_FLAG_PROBED;
+	srv->cb_args = &jrpc;
+	srv->flags |= IPSC_FLAG_SERVER;
+
+	printf( "# %s %s microbench\n", PACKAGE_NAME, PACKAGE_VERSION );
+	for ( i = 0; benches[i].name; i++ ) {
+		if ( !wanted( benches[i].name, argc - 1, argv + 1 ) )
+			continue;
+		/* lookups need the server's index for the table size */
+		if ( benches[i].fn == bench_status && !size ) {
+			/* any table does */
+			size = 8;
+			if ( methods_start( size ) ) {
+				perror( "jrpc_server" );
+				return 1;
+			}
+		}
+		if ( benches[i].fn == bench_method_find ||
+		     benches[i].fn == bench_process ) {
+			if ( benches[i].arg != size ) {
+				if ( size )
+					methods_stop();
+				size = benches[i].arg;
+				if ( methods_start( size ) ) {
+					perror( "jrpc_server" );
+					return 1;
+				}
+			}
+		}
+		run( &benches[i], target_ns );
+	}
+	if ( size )
+		methods_stop();
+
+	ipsc_close( cli );
+	ipsc_close( srv );
+	return 0;
+}
@@ -0,0 +1,428 @@
+/**
+ * This file is part of libjrpc library code.
+ *
+ * Copyright (C) 2014 Roman Yeryomin <roman@advem.lv>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See LICENCE.txt file for more details.
+ */
+
+/*
+ * CBOR (RFC 7049) encoding of the jansson value model. Only what JSON can
+ * express is produced or accepted: byte strings, indefinite length strings
+ * and non-text map keys are refused, tags are skipped.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "jrpc.h"
+
+#define CBOR_UINT		0
+#define CBOR_NEGINT		1
+#define CBOR_BYTES		2
+#define CBOR_TEXT		3
+#define CBOR_ARRAY		4
+#define CBOR_MAP		5
+#define CBOR_TAG		6
+#define CBOR_SIMPLE		7
+
+#define CBOR_FALSE		0xf4
+#define CBOR_TRUE		0xf5
+#define CBOR_NULL		0xf6
+#define CBOR_UNDEF		0xf7
+#define CBOR_FLOAT32		0xfa
+#define CBOR_FLOAT64		0xfb
+#define CBOR_BREAK		0xff
+#define CBOR_INDEF		31
+
+#define CBOR_MAX_DEPTH		512
+
+typedef struct cbor_out_t {
+	json_dump_callback_t write;
+	void *data;
+} cbor_out_t;
+
+typedef struct cbor_in_t {
+	const unsigned char *p;
+	const unsigned char *end;
+	int depth;
+} cbor_in_t;
+
+static int cbor_put_head (cbor_out_t *out, int major, uint64_t val)
+{
+	unsigned char b[9];
+	size_t n;
+	size_t i;
+
+	if (val < 24)
+	{
+		b[0] = (major << 5) | val;
+		return out->write ((const char *)b, 1, out->data);
+	}
+
+	if (val <= 0xff)
+	{
+		b[0] = (major << 5) | 24;
+		n = 1;
+	}
+	else if (val <= 0xffff)
+	{
+		b[0] = (major << 5) | 25;
+		n = 2;
+	}
+	else if (val <= 0xffffffffULL)
+	{
+		b[0] = (major << 5) | 26;
+		n = 4;
+	}
+	else
+	{
+		b[0] = (major << 5) | 27;
+		n = 8;
+	}
+
+	for (i = 0; i < n; i++)
+		b[n - i] = (val >> (8 * i)) & 0xff;
+
+	return out->write ((const char *)b, n + 1, out->data);
+}
+
+/* doubles that survive the trip through a float go out in half the size */
+static int cbor_put_real (cbor_out_t *out, double d)
+{
+	unsigned char b[9];
+	uint64_t u;
+	uint32_t u32;
+	float f = (float)d;
+	int i;
+
+	if ((double)f == d || isnan (d))
+	{
+		memcpy (&u32, &f, sizeof u32);
+		b[0] = CBOR_FLOAT32;
+		for (i = 0; i < 4; i++)
+			b[4 - i] = (u32 >> (8 * i)) & 0xff;
+		return out->write ((const char *)b, 5, out->data);
+	}
+
+	memcpy (&u, &d, sizeof u);
+	b[0] = CBOR_FLOAT64;
+	for (i = 0; i < 8; i++)
+		b[8 - i] = (u >> (8 * i)) & 0xff;
+	return out->write ((const char *)b, 9, out->data);
+}
+
+static int cbor_put (cbor_out_t *out, json_t *j, int depth)
+{
+	const char *key;
+	json_t *val;
+	json_int_t v;
+	size_t i;
+	size_t len;
+	unsigned char b;
+
+	if (depth > CBOR_MAX_DEPTH)
+		return -1;
+
+	switch (json_typeof (j))
+	{
+	case JSON_OBJECT:
+		if (cbor_put_head (out, CBOR_MAP, json_object_size (j)))
+			return -1;
+		json_object_foreach (j, key, val)
+		{
+			len = strlen (key);
+			if (cbor_put_head (out, CBOR_TEXT, len) ||
+			    out->write (key, len, out->data) ||
+			    cbor_put (out, val, depth + 1))
+				return -1;
+		}
+		return 0;
+
+	case JSON_ARRAY:
+		if (cbor_put_head (out, CBOR_ARRAY, json_array_size (j)))
+			return -1;
+		for (i = 0; i < json_array_size (j); i++)
+		{
+			if (cbor_put (out, json_array_get (j, i), depth + 1))
+				return -1;
+		}
+		return 0;
+
+	case JSON_STRING:
+		len = json_string_length (j);
+		if (cbor_put_head (out, CBOR_TEXT, len))
+			return -1;
+		return out->write (json_string_value (j), len, out->data);
+
+	case JSON_INTEGER:
+		v = json_integer_value (j);
+		if (v >= 0)
+			return cbor_put_head (out, CBOR_UINT, (uint64_t)v);
+		return cbor_put_head (out, CBOR_NEGINT, (uint64_t)(-(v + 1)));
+
+	case JSON_REAL:
+		return cbor_put_real (out, json_real_value (j));
+
+	case JSON_TRUE:
+		b = CBOR_TRUE;
+		break;
+	case JSON_FALSE:
+		b = CBOR_FALSE;
+		break;
+	default:
+		b = CBOR_NULL;
+		break;
+	}
+
+	return out->write ((const char *)&b, 1, out->data);
+}
+
+static int cbor_encode (json_t *jroot, json_dump_callback_t write, void *data)
+{
+	cbor_out_t out = { write, data };
+
+	if (!jroot)
+		return -1;
+
+	return cbor_put (&out, jroot, 0);
+}
+
+/* initial byte and argument of the next item; val is 0 for indefinite */
+static int cbor_get_head (cbor_in_t *in, int *major, int *info, uint64_t *val)
+{
+	size_t n;
+	size_t i;
+
+	if (in->p >= in->end)
+		return -1;
+
+	*major = *in->p >> 5;
+	*info  = *in->p & 0x1f;
+	in->p++;
+	*val = 0;
+
+	if (*info < 24)
+	{
+		*val = *info;
+		return 0;
+	}
+	if (*info == CBOR_INDEF)
+		return 0;
+	if (*info > 27)
+		return -1;
+
+	n = (size_t)1 << (*info - 24);
+	if ((size_t)(in->end - in->p) < n)
+		return -1;
+
+	for (i = 0; i < n; i++)
+		*val = (*val << 8) | in->p[i];
+	in->p += n;
+
+	return 0;
+}
+
+static double cbor_half (uint16_t h)
+{
+	int e = (h >> 10) & 0x1f;
+	int m = h & 0x3ff;
+	double d;
+
+	if (e == 0)
+		d = ldexp (m, -24);
+	else if (e != 31)
+		d = ldexp (m + 1024, e - 25);
+	else
+		d = m ? NAN : INFINITY;
+
+	return (h & 0x8000) ? -d : d;
+}
+
+static json_t *cbor_get (cbor_in_t *in);
+
+static json_t *cbor_get_simple (int info, uint64_t val)
+{
+	uint32_t u32;
+	float f;
+	double d;
+
+	switch (info)
+	{
+	case CBOR_FALSE & 0x1f:
+		return json_false ();
+	case CBOR_TRUE & 0x1f:
+		return json_true ();
+	case CBOR_NULL & 0x1f:
+	case CBOR_UNDEF & 0x1f:
+		return json_null ();
+	case 25:
+		return json_real (cbor_half ((uint16_t)val));
+	case CBOR_FLOAT32 & 0x1f:
+		u32 = (uint32_t)val;
+		memcpy (&f, &u32, sizeof f);
+		return json_real (f);
+	case CBOR_FLOAT64 & 0x1f:
+		memcpy (&d, &val, sizeof d);
+		return json_real (d);
+	}
+
+	return NULL;
+}
+
+static int cbor_at_break (cbor_in_t *in)
+{
+	if (in->p < in->end && *in->p == CBOR_BREAK)
+	{
+		in->p++;
+		return 1;
+	}
+	return 0;
+}
+
+static json_t *cbor_get_array (cbor_in_t *in, int info, uint64_t n)
+{
+	json_t *j = json_array ();
+	uint64_t i;
+
+	for (i = 0; j; i++)
+	{
+		if (info == CBOR_INDEF ? cbor_at_break (in) : i == n)
+			return j;
+		if (json_array_append_new (j, cbor_get (in)))
+			break;
+	}
+
+	json_decref (j);
+	return NULL;
+}
+
+static json_t *cbor_get_map (cbor_in_t *in, int info, uint64_t n)
+{
+	json_t *j = json_object ();
+	char kbuf[256];
+	char *key;
+	int major;
+	int kinfo;
+	int rc;
+	uint64_t len;
+	uint64_t i;
+
+	for (i = 0; j; i++)
+	{
+		if (info == CBOR_INDEF ? cbor_at_break (in) : i == n)
+			return j;
+
+		if (cbor_get_head (in, &major, &kinfo, &len) ||
+		    major != CBOR_TEXT || kinfo == CBOR_INDEF ||
+		    len > (uint64_t)(in->end - in->p) ||
+		    memchr (in->p, '\0', len))
+			break;
+
+		key = len < sizeof kbuf ? kbuf : (char *)malloc (len + 1);
+		if (!key)
+			break;
+		memcpy (key, in->p, len);
+		key[len] = '\0';
+		in->p += len;
+
+		rc = json_object_set_new (j, key, cbor_get (in));
+		if (key != kbuf)
+			free (key);
+		if (rc)
+			break;
+	}
+
+	json_decref (j);
+	return NULL;
+}
+
+static json_t *cbor_get (cbor_in_t *in)
+{
+	json_t *j = NULL;
+	int major;
+	int info;
+	uint64_t val;
+
+	if (cbor_get_head (in, &major, &info, &val))
+		return NULL;
+	/* only arrays and maps come in pieces here, a stray break is NULL too */
+	if (info == CBOR_INDEF && major != CBOR_ARRAY && major != CBOR_MAP)
+		return NULL;
+
+	if (++in->depth > CBOR_MAX_DEPTH)
+		return NULL;
+
+	switch (major)
+	{
+	case CBOR_UINT:
+		if (val <= INT64_MAX)
+			j = json_integer ((json_int_t)val);
+		break;
+	case CBOR_NEGINT:
+		if (val <= INT64_MAX)
+			j = json_integer (-(json_int_t)val - 1);
+		break;
+	case CBOR_TEXT:
+		if (info != CBOR_INDEF && val <= (uint64_t)(in->end - in->p))
+		{
+			/* NULL on invalid UTF-8 */
+			j = json_stringn ((const char *)in->p, val);
+			in->p += val;
+		}
+		break;
+	case CBOR_ARRAY:
+		/* every element takes at least a byte */
+		if (info == CBOR_INDEF || val <= (uint64_t)(in->end - in->p))
+			j = cbor_get_array (in, info, val);
+		break;
+	case CBOR_MAP:
+		if (info == CBOR_INDEF || val <= (uint64_t)(in->end - in->p) / 2)
+			j = cbor_get_map (in, info, val);
+		break;
+	case CBOR_TAG:
+		j = cbor_get (in);
+		break;
+	case CBOR_SIMPLE:
+		j = cbor_get_simple (info, val);
+		break;
+	}
+
+	in->depth--;
+	return j;
+}
+
+static json_t *cbor_decode (const char *buf, size_t len)
+{
+	cbor_in_t in;
+	json_t *j;
+
+	in.p     = (const unsigned char *)buf;
+	in.end   = in.p + len;
+	in.depth = 0;
+
+	j = cbor_get (&in);
+	/* one item per frame, anything after it is garbage */
+	if (j && in.p != in.end)
+	{
+		json_decref (j);
+		j = NULL;
+	}
+
+	return j;
+}
+
+const jrpc_codec_t jrpc_codec_cbor = {
+	.enc    = JRPC_ENC_CBOR,
+	.name   = "cbor",
+	.encode = cbor_encode,
+	.decode = cbor_decode,
+};
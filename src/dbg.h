@@ -1,7 +1,7 @@
 #ifndef _DBG_H_
 #define _DBG_H_
 
-#define DEBUG
+/* DEBUG comes from config.h, see ./configure --enable-debug */
 
 #if defined(DEBUG)
 #define _dbg(tag, fmt, args...) \
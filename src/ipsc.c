@@ -15,17 +15,34 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
 
 #include "ipsc.h"
 #include "dbg.h"
 
 
+static inline void ipsc_lock( ipsc_t *ipsc )
+{
+	while ( __atomic_test_and_set( &ipsc->lock, __ATOMIC_ACQUIRE ) )
+		;
+}
+
+static inline void ipsc_unlock( ipsc_t *ipsc )
+{
+	__atomic_clear( &ipsc->lock, __ATOMIC_RELEASE );
+}
+
 inline int ipsc_set_nonblock( ipsc_t *ipsc )
 {
 	int opts = fcntl( ipsc->sd, F_GETFL );
@@ -68,7 +85,27 @@ int ipsc_addr_un( ipsc_t **ipsc, uint16_t port )
 	return 0;
 }
 
-ipsc_t *ipsc_init(uint16_t port )
+static int ipsc_addr_path( ipsc_t *ipsc, const char *path )
+{
+	struct sockaddr_un *un;
+
+	ipsc->alen = sizeof(struct sockaddr_un);
+	ipsc->addr = (struct sockaddr *)malloc( ipsc->alen );
+	if ( !ipsc->addr )
+		return -1;
+
+	un = (struct sockaddr_un *)ipsc->addr;
+	un->sun_family = AF_LOCAL;
+	if ( snprintf( un->sun_path, sizeof un->sun_path, "%s", path ) >=
+	     (int)sizeof un->sun_path ) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+static ipsc_t *ipsc_new( int type )
 {
 	ipsc_t *ipsc = (ipsc_t *)malloc( sizeof(ipsc_t) );
 	if ( !ipsc )
@@ -80,11 +117,52 @@ ipsc_t *ipsc_init(uint16_t port )
 	ipsc->alen    = 0;
 	ipsc->addr    = NULL;
 	ipsc->cb_args = NULL;
+	ipsc->epset   = NULL;
+	ipsc->nepset  = 0;
+	ipsc->epnext  = 0;
+	ipsc->parent  = NULL;
+	ipsc->next    = NULL;
+	ipsc->prev    = NULL;
+	ipsc->nconn   = 0;
+	ipsc->naccept = 0;
+	ipsc->maxconn = 0;
+	ipsc->nrefused = 0;
+	ipsc->lock    = 0;
+	ipsc->rbuf    = NULL;
+	ipsc->rsize   = 0;
+	ipsc->rlen    = 0;
+	ipsc->rmax    = 0;
+	ipsc->rmem    = 0;
+	ipsc->rmemmax = 0;
+	ipsc->wbuf    = NULL;
+	ipsc->wsize   = 0;
+	ipsc->wlen    = 0;
+	ipsc->obuf    = NULL;
+	ipsc->osize   = 0;
+	ipsc->olen    = 0;
+	ipsc->ooff    = 0;
+	ipsc->ohigh   = 0;
+	ipsc->olow    = 0;
+	ipsc->type    = type;
+	ipsc->epfd    = -1;
+	ipsc->shm     = NULL;
+	ipsc->priv    = NULL;
+	ipsc->priv_free = NULL;
+	ipsc->refs    = 1;
+
+	return ipsc;
+}
+
+ipsc_t *ipsc_init( uint16_t port, int type )
+{
+	ipsc_t *ipsc = ipsc_new( type );
+	if ( !ipsc )
+		return NULL;
 
 	if ( ipsc_addr_un( &ipsc, port ) )
 		goto exit;
 
-	ipsc->sd = socket( PF_LOCAL, SOCK_STREAM, 0 );
+	ipsc->sd = socket( PF_LOCAL, type, 0 );
 	if ( ipsc->sd == -1 )
 		goto exit;
 
@@ -95,8 +173,169 @@ exit:
 	return NULL;
 }
 
+/* "unix:N", "unix:/path" or just "N" */
+static ipsc_t *ipsc_init_unix( const char *addr, int type )
+{
+	char *end;
+	unsigned long port;
+	ipsc_t *ipsc;
+
+	if ( !strncmp( addr, IPSC_ADDR_UNIX, strlen( IPSC_ADDR_UNIX ) ) )
+		addr += strlen( IPSC_ADDR_UNIX );
+
+	if ( *addr != '/' ) {
+		port = strtoul( addr, &end, 10 );
+		if ( end == addr || *end || port > UINT16_MAX ) {
+			errno = EINVAL;
+			return NULL;
+		}
+		return ipsc_init( (uint16_t)port, type );
+	}
+
+	ipsc = ipsc_new( type );
+	if ( !ipsc )
+		return NULL;
+
+	if ( ipsc_addr_path( ipsc, addr ) )
+		goto exit;
+
+	ipsc->sd = socket( PF_LOCAL, type, 0 );
+	if ( ipsc->sd == -1 )
+		goto exit;
+
+	return ipsc;
+
+exit:
+	ipsc_close( ipsc );
+	return NULL;
+}
+
+/* one of the addresses "tcp:host:port" resolved to */
+static ipsc_t *ipsc_init_ai( struct addrinfo *ai, int type )
+{
+	ipsc_t *ipsc = ipsc_new( type );
+	if ( !ipsc )
+		return NULL;
+
+	ipsc->alen = ai->ai_addrlen;
+	ipsc->addr = (struct sockaddr *)malloc( ipsc->alen );
+	if ( !ipsc->addr )
+		goto exit;
+	memcpy( ipsc->addr, ai->ai_addr, ipsc->alen );
+
+	ipsc->sd = socket( ai->ai_family, type, ai->ai_protocol );
+	if ( ipsc->sd == -1 )
+		goto exit;
+
+	return ipsc;
+
+exit:
+	ipsc_close( ipsc );
+	return NULL;
+}
+
+/*
+ * "host:port" or "[v6addr]:port", an empty host or "*" is any address
+ * when listening and loopback otherwise; free with freeaddrinfo()
+ */
+static struct addrinfo *ipsc_addr_tcp( const char *addr, int type,
+				       int passive )
+{
+	char host[NI_MAXHOST];
+	const char *port;
+	const char *end;
+	size_t hlen;
+	int rc;
+	struct addrinfo hints;
+	struct addrinfo *res = NULL;
+
+	if ( *addr == '[' ) {
+		end = strchr( addr, ']' );
+		if ( !end || end[1] != ':' )
+			goto inval;
+		addr++;
+		port = end + 2;
+	} else {
+		end = strrchr( addr, ':' );
+		if ( !end )
+			goto inval;
+		port = end + 1;
+	}
+
+	hlen = end - addr;
+	if ( hlen >= sizeof host || !*port )
+		goto inval;
+	memcpy( host, addr, hlen );
+	host[hlen] = '\0';
+
+	memset( &hints, 0, sizeof hints );
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = type;
+	hints.ai_flags    = AI_NUMERICSERV | (passive ? AI_PASSIVE : 0);
+
+	rc = getaddrinfo( hlen && strcmp( host, "*" ) ? host : NULL, port,
+			  &hints, &res );
+	if ( rc ) {
+		if ( rc != EAI_SYSTEM )
+			errno = EADDRNOTAVAIL;
+		return NULL;
+	}
+
+	return res;
+
+inval:
+	errno = EINVAL;
+	return NULL;
+}
+
+static int ipsc_is_inet( ipsc_t *ipsc )
+{
+	return ipsc->addr && ( ipsc->addr->sa_family == AF_INET ||
+			       ipsc->addr->sa_family == AF_INET6 );
+}
+
+/* no batching of small messages, and notice peers that vanished */
+static int ipsc_set_tcp( ipsc_t *ipsc )
+{
+	int on = 1;
+
+	if ( setsockopt( ipsc->sd, IPPROTO_TCP, TCP_NODELAY,
+			 &on, sizeof on ) ||
+	     setsockopt( ipsc->sd, SOL_SOCKET, SO_KEEPALIVE,
+			 &on, sizeof on ) )
+		return -1;
+
+	return 0;
+}
+
+/* socket buffer sizes, 0 keeps the system default */
+int ipsc_set_bufs( ipsc_t *ipsc, int sndbuf, int rcvbuf )
+{
+	if ( sndbuf > 0 &&
+	     setsockopt( ipsc->sd, SOL_SOCKET, SO_SNDBUF,
+			 &sndbuf, sizeof sndbuf ) )
+		return -1;
+
+	if ( rcvbuf > 0 &&
+	     setsockopt( ipsc->sd, SOL_SOCKET, SO_RCVBUF,
+			 &rcvbuf, sizeof rcvbuf ) )
+		return -1;
+
+	return 0;
+}
+
 int ipsc_bind( ipsc_t *ipsc )
 {
+	int on = 1;
+
+	/* nothing to clean up, just don't wait for TIME_WAIT to pass */
+	if ( ipsc_is_inet( ipsc ) ) {
+		if ( setsockopt( ipsc->sd, SOL_SOCKET, SO_REUSEADDR,
+				 &on, sizeof on ) )
+			return -1;
+		return bind( ipsc->sd, ipsc->addr, ipsc->alen );
+	}
+
 	if ( !bind( ipsc->sd, ipsc->addr, ipsc->alen ) )
 		return 0;
 
@@ -117,6 +356,48 @@ int ipsc_bind( ipsc_t *ipsc )
 	return 0;
 }
 
+/*
+ * Eventfd wrapped into ipsc_t, lets other threads wake up an epoll loop.
+ * ipsc_epoll_wait() resets it and passes it to the callback like any
+ * other connection, tell them apart by IPSC_FLAG_NOTIFY.
+ */
+ipsc_t *ipsc_notifier( void )
+{
+	ipsc_t *ipsc = (ipsc_t *)calloc( 1, sizeof(ipsc_t) );
+	if ( !ipsc )
+		return NULL;
+
+	ipsc->flags = IPSC_FLAG_NOTIFY;
+	ipsc->epfd  = -1;
+	ipsc->refs  = 1;
+	ipsc->sd    = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	if ( ipsc->sd == -1 ) {
+		free( ipsc );
+		return NULL;
+	}
+
+	return ipsc;
+}
+
+int ipsc_notify( ipsc_t *ipsc )
+{
+	uint64_t one = 1;
+
+	if ( write( ipsc->sd, &one, sizeof one ) != sizeof one &&
+	     errno != EAGAIN )
+		return -1;
+
+	return 0;
+}
+
+static void ipsc_notify_drain( ipsc_t *ipsc )
+{
+	uint64_t cnt;
+
+	while ( read( ipsc->sd, &cnt, sizeof cnt ) == -1 && errno == EINTR )
+		;
+}
+
 int ipsc_epoll_newfd( ipsc_t *ipsc, int epfd )
 {
 	struct epoll_event ev;
@@ -127,21 +408,38 @@ int ipsc_epoll_newfd( ipsc_t *ipsc, int epfd )
 	// TODO : check
 //	ev.events   = EPOLLIN | EPOLLPRI | EPOLLET | EPOLLRDHUP;
 	ev.events   = EPOLLIN | EPOLLPRI | EPOLLET;
+#ifdef EPOLLEXCLUSIVE
+	/* wake up only one of the loops sharing this listener */
+	if ( ipsc->flags & IPSC_FLAG_SHARED )
+		ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+#endif
+
+	/*
+	 * a listener may sit in several, connections in exactly one; set
+	 * before adding, another loop may get the first event right away
+	 */
+	if ( !(ipsc->flags & IPSC_FLAG_LISTEN) )
+		ipsc->epfd = epfd;
 
 	if ( epoll_ctl (epfd, EPOLL_CTL_ADD, ipsc->sd, &ev ))
 	{
+		ipsc->epfd = -1;
 		return -1;
 	}
 
 	return 0;
 }
 
-ipsc_t *ipsc_listen (uint16_t port, int maxq)
+static ipsc_t *ipsc_listen_start (ipsc_t *ipsc, int maxq,
+				  int sndbuf, int rcvbuf)
 {
-	ipsc_t *ipsc = ipsc_init (port);
 	if ( !ipsc )
 		return NULL;
 
+	/* accepted sockets inherit the buffer sizes */
+	if ( ipsc_set_bufs( ipsc, sndbuf, rcvbuf ) )
+		goto exit;
+
 	ipsc->maxq = maxq;
 	if ( maxq > IPSC_MAX_QUEUE )
 		ipsc->maxq = IPSC_MAX_QUEUE;
@@ -154,7 +452,7 @@ ipsc_t *ipsc_listen (uint16_t port, int maxq)
 	if ( listen( ipsc->sd, ipsc->maxq ) )
 		goto exit;
 
-	ipsc->flags |= IPSC_FLAG_SERVER;
+	ipsc->flags |= IPSC_FLAG_SERVER | IPSC_FLAG_LISTEN;
 
 	return ipsc;
 
@@ -163,6 +461,49 @@ exit:
 	return NULL;
 }
 
+/*
+ * type is SOCK_STREAM or SOCK_SEQPACKET, the latter keeps message
+ * boundaries so every recv returns exactly one message
+ */
+ipsc_t *ipsc_listen_type (uint16_t port, int maxq, int type)
+{
+	return ipsc_listen_start (ipsc_init (port, type), maxq, 0, 0);
+}
+
+ipsc_t *ipsc_listen (uint16_t port, int maxq)
+{
+	return ipsc_listen_type (port, maxq, SOCK_STREAM);
+}
+
+/*
+ * Listen on an endpoint string:
+ *   "unix:N" or "N"	IPSC_SOCKET_FILE for port N
+ *   "unix:/path"	any socket file
+ *   "tcp:host:port"	IPv4 or IPv6, "tcp:[::1]:port" for literals;
+ *			"tcp:*:port" listens on all addresses
+ * TCP takes SOCK_STREAM only. Buffer sizes of 0 keep system defaults.
+ */
+ipsc_t *ipsc_listen_addr (const char *addr, int maxq, int type,
+			  int sndbuf, int rcvbuf)
+{
+	ipsc_t *ipsc = NULL;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+
+	if ( strncmp( addr, IPSC_ADDR_TCP, strlen( IPSC_ADDR_TCP ) ) )
+		return ipsc_listen_start( ipsc_init_unix( addr, type ),
+					  maxq, sndbuf, rcvbuf );
+
+	res = ipsc_addr_tcp( addr + strlen( IPSC_ADDR_TCP ), type, 1 );
+	for ( ai = res; ai && !ipsc; ai = ai->ai_next )
+		ipsc = ipsc_listen_start( ipsc_init_ai( ai, type ),
+					  maxq, sndbuf, rcvbuf );
+	if ( res )
+		freeaddrinfo( res );
+
+	return ipsc;
+}
+
 ipsc_t *ipsc_accept( ipsc_t *ipsc )
 {
 	if ( !ipsc )
@@ -178,50 +519,375 @@ ipsc_t *ipsc_accept( ipsc_t *ipsc )
 	client->alen    = ipsc->alen;
 	client->addr    = (struct sockaddr *)malloc( client->alen );
 	client->cb_args = ipsc->cb_args;
+	client->epset   = NULL;
+	client->nepset  = 0;
+	client->epnext  = 0;
+	client->parent  = NULL;
+	client->next    = NULL;
+	client->prev    = NULL;
+	client->nconn   = 0;
+	client->naccept = 0;
+	client->maxconn = 0;
+	client->nrefused = 0;
+	client->lock    = 0;
+	client->rbuf    = NULL;
+	client->rsize   = 0;
+	client->rlen    = 0;
+	client->rmax    = ipsc->rmax;
+	client->rmem    = 0;
+	client->rmemmax = 0;
+	client->wbuf    = NULL;
+	client->wsize   = 0;
+	client->wlen    = 0;
+	client->obuf    = NULL;
+	client->osize   = 0;
+	client->olen    = 0;
+	client->ooff    = 0;
+	client->ohigh   = ipsc->ohigh;
+	client->olow    = ipsc->olow;
+	client->type    = ipsc->type;
+	client->epfd    = -1;
+	client->shm     = NULL;
+	client->priv    = NULL;
+	client->priv_free = NULL;
+	client->refs    = 1;
 
 	if ( !client->addr )
 		goto exit;
 
 	client->sd = accept( ipsc->sd, client->addr,
 			     (socklen_t *)&(client->alen) );
-	if ( client->sd > 0 )
+	if ( client->sd > 0 && ipsc_is_inet( ipsc ) && ipsc_set_tcp( client ) )
+		goto exit;
+	if ( client->sd > 0 ) {
+		/* keep track of it, closing the listener closes it too */
+		client->parent = ipsc;
+		ipsc_lock( ipsc );
+		client->next = ipsc->next;
+		if ( ipsc->next )
+			ipsc->next->prev = client;
+		ipsc->next = client;
+		ipsc->nconn++;
+		ipsc->naccept++;
+		ipsc_unlock( ipsc );
 		return client;
+	}
 exit:
 	ipsc_close( client );
 	return NULL;
 }
 
 
-ipsc_t *ipsc_connect( uint16_t port )
+static ipsc_t *ipsc_connect_start( ipsc_t *ipsc, int sndbuf, int rcvbuf )
 {
-	ipsc_t *ipsc = ipsc_init( port );
 	if ( !ipsc  )
 		return NULL;
 
+	if ( ipsc_set_bufs( ipsc, sndbuf, rcvbuf ) )
+		goto exit;
+
+	if ( ipsc_is_inet( ipsc ) && ipsc_set_tcp( ipsc ) )
+		goto exit;
+
 	if ( !connect( ipsc->sd, ipsc->addr, ipsc->alen ) )
 		return ipsc;
 
+exit:
 	ipsc_close( ipsc );
 	return NULL;
 }
 
+ipsc_t *ipsc_connect_type( uint16_t port, int type )
+{
+	return ipsc_connect_start( ipsc_init( port, type ), 0, 0 );
+}
+
+ipsc_t *ipsc_connect( uint16_t port )
+{
+	return ipsc_connect_type( port, SOCK_STREAM );
+}
+
+/* endpoint strings as for ipsc_listen_addr(), tries every address found */
+ipsc_t *ipsc_connect_addr( const char *addr, int type, int sndbuf, int rcvbuf )
+{
+	ipsc_t *ipsc = NULL;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+
+	if ( strncmp( addr, IPSC_ADDR_TCP, strlen( IPSC_ADDR_TCP ) ) )
+		return ipsc_connect_start( ipsc_init_unix( addr, type ),
+					   sndbuf, rcvbuf );
+
+	res = ipsc_addr_tcp( addr + strlen( IPSC_ADDR_TCP ), type, 0 );
+	for ( ai = res; ai && !ipsc; ai = ai->ai_next )
+		ipsc = ipsc_connect_start( ipsc_init_ai( ai, type ),
+					   sndbuf, rcvbuf );
+	if ( res )
+		freeaddrinfo( res );
+
+	return ipsc;
+}
+
+/* connected pair of stream sockets, for in-process plumbing and benches */
+int ipsc_pair( ipsc_t *pair[2] )
+{
+	int i;
+	int sv[2];
+
+	pair[0] = pair[1] = NULL;
+	if ( socketpair( AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, sv ) )
+		return -1;
+
+	for ( i = 0; i < 2; i++ ) {
+		pair[i] = ipsc_new( SOCK_STREAM );
+		if ( !pair[i] || ipsc_addr_path( pair[i], "" ) )
+			goto exit;
+		pair[i]->sd = sv[i];
+		sv[i] = -1;
+	}
+
+	return 0;
+
+exit:
+	for ( i = 0; i < 2; i++ ) {
+		if ( sv[i] >= 0 )
+			close( sv[i] );
+		ipsc_close( pair[i] );
+		pair[i] = NULL;
+	}
+	return -1;
+}
+
+/* events follow the queue: EPOLLOUT while there is one, no EPOLLIN if too big */
+static int ipsc_epoll_mod( ipsc_t *ipsc )
+{
+	struct epoll_event ev;
+	size_t queued = ipsc->olen - ipsc->ooff;
+	int flags = ipsc->flags & ~(IPSC_FLAG_POLLOUT | IPSC_FLAG_PAUSED);
+
+	if ( queued )
+		flags |= IPSC_FLAG_POLLOUT;
+	if ( ipsc->ohigh && (queued >= ipsc->ohigh ||
+			     ((ipsc->flags & IPSC_FLAG_PAUSED) &&
+			      queued > ipsc->olow)) )
+		flags |= IPSC_FLAG_PAUSED;
+	if ( flags == ipsc->flags )
+		return 0;
+	ipsc->flags = flags;
+
+	/* shm: the socket only reports a hang up, the bell says there's room */
+	if ( ipsc->shm )
+		return 0;
+
+	ev.data.u64 = 0;
+	ev.data.ptr = ipsc;
+	ev.events   = EPOLLPRI | EPOLLET;
+	if ( !(flags & IPSC_FLAG_PAUSED) )
+		ev.events |= EPOLLIN;
+	if ( flags & IPSC_FLAG_POLLOUT )
+		ev.events |= EPOLLOUT;
+
+	/* input that came meanwhile shows up again once EPOLLIN is back */
+	return epoll_ctl( ipsc->epfd, EPOLL_CTL_MOD, ipsc->sd, &ev );
+}
+
+/*
+ * queue what the socket didn't take, seqpacket messages keep their
+ * boundaries with a length in front
+ */
+static ssize_t ipsc_oqueue( ipsc_t *ipsc, const struct iovec *iov, int iovcnt,
+			    size_t total )
+{
+	int i;
+	size_t len = 0;
+	size_t need;
+	size_t size;
+	uint32_t rec;
+	char *tmp;
+
+	for ( i = 0; i < iovcnt; i++ )
+		len += iov[i].iov_len;
+	need = len + (ipsc->type == SOCK_SEQPACKET ? sizeof rec : 0);
+
+	/* what went out already makes room first */
+	if ( ipsc->ooff && ipsc->olen + need > ipsc->osize ) {
+		memmove( ipsc->obuf, ipsc->obuf + ipsc->ooff,
+			 ipsc->olen - ipsc->ooff );
+		ipsc->olen -= ipsc->ooff;
+		ipsc->ooff  = 0;
+	}
+	if ( ipsc->olen + need > ipsc->osize ) {
+		size = ipsc->osize ? ipsc->osize : IPSC_BUF_MIN;
+		while ( size < ipsc->olen + need )
+			size *= 2;
+		tmp = (char *)realloc( ipsc->obuf, size );
+		if ( !tmp )
+			return -1;
+		ipsc->obuf  = tmp;
+		ipsc->osize = size;
+	}
+
+	if ( ipsc->type == SOCK_SEQPACKET ) {
+		rec = len;
+		memcpy( ipsc->obuf + ipsc->olen, &rec, sizeof rec );
+		ipsc->olen += sizeof rec;
+	}
+	for ( i = 0; i < iovcnt; i++ ) {
+		memcpy( ipsc->obuf + ipsc->olen, iov[i].iov_base,
+			iov[i].iov_len );
+		ipsc->olen += iov[i].iov_len;
+	}
+
+	if ( ipsc_epoll_mod( ipsc ) )
+		return -1;
+
+	return total;
+}
+
+/* EPOLLOUT or the shm bell: push out as much of the queue as fits */
+static int ipsc_oflush( ipsc_t *ipsc )
+{
+	ssize_t sent;
+	uint32_t rec;
+
+	while ( ipsc->ooff < ipsc->olen ) {
+		if ( ipsc->shm ) {
+			sent = ipsc_shm_put( ipsc, ipsc->obuf + ipsc->ooff,
+					     ipsc->olen - ipsc->ooff );
+			/* ring full, goes on when the peer's read rings the bell */
+			if ( !sent && !ipsc_shm_want_room( ipsc ) )
+				break;
+		} else if ( ipsc->type == SOCK_SEQPACKET ) {
+			memcpy( &rec, ipsc->obuf + ipsc->ooff, sizeof rec );
+			sent = send( ipsc->sd, ipsc->obuf + ipsc->ooff + sizeof rec,
+				     rec, MSG_NOSIGNAL | MSG_DONTWAIT );
+			if ( sent >= 0 )
+				sent = sizeof rec + rec;
+		} else {
+			sent = send( ipsc->sd, ipsc->obuf + ipsc->ooff,
+				     ipsc->olen - ipsc->ooff,
+				     MSG_NOSIGNAL | MSG_DONTWAIT );
+		}
+
+		if ( sent == -1 ) {
+			if ( errno == EINTR )
+				continue;
+			if ( errno == EAGAIN || errno == EWOULDBLOCK )
+				break;
+			return -1;
+		}
+		ipsc->ooff += sent;
+	}
+
+	if ( ipsc->ooff == ipsc->olen ) {
+		ipsc->olen = ipsc->ooff = 0;
+		if ( ipsc->osize > IPSC_BUF_KEEP ) {
+			free( ipsc->obuf );
+			ipsc->obuf  = NULL;
+			ipsc->osize = 0;
+		}
+	}
+
+	return ipsc_epoll_mod( ipsc );
+}
+
 ssize_t ipsc_send( ipsc_t *ipsc, const void *buf, size_t buflen )
 {
+	struct iovec iov;
+
+	if ( ipsc->shm && ipsc->epfd < 0 )
+		return ipsc_shm_write( ipsc, buf, buflen );
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len  = buflen;
+	return ipsc_sendv( ipsc, &iov, 1 );
+}
+
+/*
+ * Connections in an epoll set never wait for a full socket, the rest goes
+ * to the output queue and out on EPOLLOUT; anything else waits in poll()
+ */
+ssize_t ipsc_sendv( ipsc_t *ipsc, struct iovec *iov, int iovcnt )
+{
+	int i;
 	ssize_t sent = 0;
 	size_t sent_sum = 0;
+	size_t total = 0;
+	struct msghdr msg;
+	struct pollfd pfd;
+
+	if ( ipsc->shm && ipsc->epfd < 0 ) {
+		for ( ; iovcnt > 0; iov++, iovcnt-- ) {
+			if ( ipsc_shm_write( ipsc, iov->iov_base,
+					     iov->iov_len ) < 0 )
+				return -1;
+			sent_sum += iov->iov_len;
+		}
+		return sent_sum;
+	}
+
+	for ( i = 0; i < iovcnt; i++ )
+		total += iov[i].iov_len;
+
+	/* behind what is queued already, the order has to be kept */
+	if ( ipsc->olen )
+		return ipsc_oqueue( ipsc, iov, iovcnt, total );
+
+	/* a shm peer that doesn't read won't hold up the loop either */
+	if ( ipsc->shm ) {
+		for ( ; iovcnt > 0; iov++, iovcnt-- ) {
+			sent = ipsc_shm_put( ipsc, iov->iov_base, iov->iov_len );
+			if ( sent < 0 )
+				return -1;
+			if ( (size_t)sent < iov->iov_len )
+				break;
+		}
+		if ( !iovcnt )
+			return total;
+
+		iov->iov_base = (char *)iov->iov_base + sent;
+		iov->iov_len -= sent;
+		if ( ipsc_oqueue( ipsc, iov, iovcnt, total ) < 0 )
+			return -1;
+		/* the peer may have read meanwhile, nobody rings for that */
+		if ( ipsc_shm_want_room( ipsc ) && ipsc_oflush( ipsc ) )
+			return -1;
+		return total;
+	}
+
+	memset( &msg, 0, sizeof msg );
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = iovcnt;
 
-	while ( sent_sum < buflen ) {
-		sent = send( ipsc->sd, (const char *)buf + sent_sum,
-				buflen - sent_sum, MSG_NOSIGNAL );
+	while ( msg.msg_iovlen ) {
+		sent = sendmsg( ipsc->sd, &msg, MSG_NOSIGNAL );
 
 		if ( sent == -1 ) {
-			if ( errno == EAGAIN ||
-			     errno == EWOULDBLOCK ||
-			     errno == EINTR )
+			if ( errno == EINTR )
 				continue;
-			return sent;
+			if ( errno != EAGAIN && errno != EWOULDBLOCK )
+				return sent;
+			if ( ipsc->epfd >= 0 )
+				return ipsc_oqueue( ipsc, msg.msg_iov,
+						    msg.msg_iovlen, total );
+			pfd.fd     = ipsc->sd;
+			pfd.events = POLLOUT;
+			if ( poll( &pfd, 1, -1 ) < 0 && errno != EINTR )
+				return -1;
+			continue;
 		}
 		sent_sum += sent;
+
+		/* skip what went out, possibly in the middle of a vector */
+		while ( msg.msg_iovlen && (size_t)sent >= msg.msg_iov->iov_len ) {
+			sent -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if ( msg.msg_iovlen ) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sent;
+			msg.msg_iov->iov_len -= sent;
+		}
 	}
 
 	return sent_sum;
@@ -233,6 +899,10 @@ ssize_t ipsc_recv( ipsc_t *ipsc, void *buf,
 	ssize_t rb = 0;
 	ssize_t recvd = 0;
 
+	if ( ipsc->shm )
+		return ipsc_shm_read( ipsc, buf, buflen, 1,
+				      timeout ? (int)timeout : -1, 0 );
+
 	if ( ipsc_set_recv_timeout( ipsc, timeout ) )
 		return -1;
 
@@ -253,6 +923,253 @@ ssize_t ipsc_recv( ipsc_t *ipsc, void *buf,
 	return recvd;
 }
 
+/*
+ * Read exactly buflen bytes, waiting up to timeout msecs (0 - forever) for
+ * each chunk. Works on both blocking and non-blocking sockets.
+ * Returns number of bytes read, which is short only if peer closed.
+ */
+ssize_t ipsc_recvn( ipsc_t *ipsc, void *buf,
+		    size_t buflen, unsigned int timeout )
+{
+	ssize_t rb = 0;
+	size_t recvd = 0;
+	struct pollfd pfd;
+
+	if ( ipsc->shm )
+		return ipsc_shm_read( ipsc, buf, buflen, buflen,
+				      timeout ? (int)timeout : -1, 0 );
+
+	pfd.fd     = ipsc->sd;
+	pfd.events = POLLIN;
+
+	while ( recvd < buflen ) {
+		rb = recv( ipsc->sd, (char *)buf + recvd,
+				buflen - recvd, MSG_DONTWAIT );
+
+		if ( rb > 0 ) {
+			recvd += rb;
+			continue;
+		}
+		if ( rb == 0 )
+			break;
+		if ( errno == EINTR )
+			continue;
+		if ( errno != EAGAIN && errno != EWOULDBLOCK )
+			return -1;
+
+		rb = poll( &pfd, 1, timeout ? (int)timeout : -1 );
+		if ( rb < 0 && errno != EINTR )
+			return -1;
+		if ( rb == 0 ) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+
+	return recvd;
+}
+
+/*
+ * Take one whole message off a SOCK_SEQPACKET socket, waits up to
+ * timeout msecs (0 - forever). The kernel drops whatever does not fit
+ * into buf, that is reported as EMSGSIZE. Returns 0 on end of stream.
+ */
+ssize_t ipsc_recv_pkt( ipsc_t *ipsc, void *buf,
+		       size_t buflen, unsigned int timeout )
+{
+	ssize_t rb;
+	struct pollfd pfd;
+
+	pfd.fd     = ipsc->sd;
+	pfd.events = POLLIN;
+
+	while ( 1 ) {
+		rb = recv( ipsc->sd, buf, buflen, MSG_DONTWAIT | MSG_TRUNC );
+
+		if ( rb >= 0 ) {
+			if ( (size_t)rb > buflen ) {
+				errno = EMSGSIZE;
+				return -1;
+			}
+			return rb;
+		}
+		if ( errno == EINTR )
+			continue;
+		if ( errno != EAGAIN && errno != EWOULDBLOCK )
+			return -1;
+
+		rb = poll( &pfd, 1, timeout ? (int)timeout : -1 );
+		if ( rb < 0 && errno != EINTR )
+			return -1;
+		if ( rb == 0 ) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+}
+
+/* look at pending data without consuming it, never blocks */
+ssize_t ipsc_peek( ipsc_t *ipsc, void *buf, size_t buflen )
+{
+	ssize_t rb;
+
+	if ( ipsc->shm )
+		return ipsc_shm_read( ipsc, buf, buflen, 0, 0, 1 );
+
+	do {
+		rb = recv( ipsc->sd, buf, buflen, MSG_PEEK | MSG_DONTWAIT );
+	} while ( rb == -1 && errno == EINTR );
+
+	return rb;
+}
+
+/* accepted clients take rmax over, rmemmax bounds them all together */
+void ipsc_set_rlimit( ipsc_t *ipsc, size_t rmax, size_t rmemmax )
+{
+	ipsc->rmax    = rmax;
+	ipsc->rmemmax = rmemmax;
+}
+
+/* accepted clients take both over, see IPSC_FLAG_PAUSED */
+void ipsc_set_wlimit( ipsc_t *ipsc, size_t high, size_t low )
+{
+	ipsc->ohigh = high;
+	ipsc->olow  = low < high ? low : high;
+}
+
+/* clients past maxconn are accepted and closed, the backlog still drains */
+void ipsc_set_maxconn( ipsc_t *ipsc, int maxconn )
+{
+	ipsc->maxconn = maxconn;
+}
+
+/* receive buffers are charged to the listener they came from */
+static ipsc_t *ipsc_raccount( ipsc_t *ipsc )
+{
+	return ipsc->parent ? ipsc->parent : ipsc;
+}
+
+/*
+ * make rbuf hold at least len bytes, keeping its contents;
+ * EMSGSIZE - over the connection limit, ENOBUFS - over the global one
+ */
+void *ipsc_rbuf_reserve( ipsc_t *ipsc, size_t len )
+{
+	ipsc_t *acct = ipsc_raccount( ipsc );
+	size_t size = ipsc->rsize ? ipsc->rsize : IPSC_BUF_MIN;
+	size_t total;
+	char *tmp;
+
+	if ( len <= ipsc->rsize )
+		return ipsc->rbuf;
+
+	if ( ipsc->rmax && len > ipsc->rmax ) {
+		errno = EMSGSIZE;
+		return NULL;
+	}
+
+	while ( size < len )
+		size *= 2;
+	if ( ipsc->rmax && size > ipsc->rmax )
+		size = ipsc->rmax;
+
+	/* charge first, so connections growing at once can't overshoot */
+	total = __atomic_add_fetch( &acct->rmem, size - ipsc->rsize,
+				    __ATOMIC_RELAXED );
+	if ( acct->rmemmax && total > acct->rmemmax ) {
+		__atomic_sub_fetch( &acct->rmem, size - ipsc->rsize,
+				    __ATOMIC_RELAXED );
+		errno = ENOBUFS;
+		return NULL;
+	}
+
+	tmp = (char *)realloc( ipsc->rbuf, size );
+	if ( !tmp ) {
+		__atomic_sub_fetch( &acct->rmem, size - ipsc->rsize,
+				    __ATOMIC_RELAXED );
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ipsc->rbuf  = tmp;
+	ipsc->rsize = size;
+	return tmp;
+}
+
+/* give memory back once a small message follows a large one */
+void ipsc_rbuf_trim( ipsc_t *ipsc, size_t used )
+{
+	char *tmp;
+
+	if ( ipsc->rsize <= IPSC_BUF_KEEP || used > IPSC_BUF_KEEP ||
+	     ipsc->rlen > IPSC_BUF_KEEP )
+		return;
+
+	tmp = (char *)realloc( ipsc->rbuf, IPSC_BUF_KEEP );
+	if ( !tmp )
+		return;
+
+	__atomic_sub_fetch( &ipsc_raccount( ipsc )->rmem,
+			    ipsc->rsize - IPSC_BUF_KEEP, __ATOMIC_RELAXED );
+	ipsc->rbuf  = tmp;
+	ipsc->rsize = IPSC_BUF_KEEP;
+}
+
+/* make wbuf hold at least len bytes, keeping its contents */
+void *ipsc_wbuf_reserve( ipsc_t *ipsc, size_t len )
+{
+	size_t size = ipsc->wsize ? ipsc->wsize : IPSC_BUF_MIN;
+	char *tmp;
+
+	if ( len <= ipsc->wsize )
+		return ipsc->wbuf;
+
+	while ( size < len )
+		size *= 2;
+
+	tmp = (char *)realloc( ipsc->wbuf, size );
+	if ( !tmp )
+		return NULL;
+
+	ipsc->wbuf  = tmp;
+	ipsc->wsize = size;
+	return tmp;
+}
+
+void ipsc_wbuf_trim( ipsc_t *ipsc, size_t used )
+{
+	char *tmp;
+
+	if ( ipsc->wsize <= IPSC_BUF_KEEP || used > IPSC_BUF_KEEP ||
+	     ipsc->wlen > IPSC_BUF_KEEP )
+		return;
+
+	tmp = (char *)realloc( ipsc->wbuf, IPSC_BUF_KEEP );
+	if ( !tmp )
+		return;
+
+	ipsc->wbuf  = tmp;
+	ipsc->wsize = IPSC_BUF_KEEP;
+}
+
+/* hand accepted clients to the given epoll sets round-robin */
+void ipsc_epoll_spread( ipsc_t *ipsc, int *epfds, int n )
+{
+	ipsc->epset  = epfds;
+	ipsc->nepset = n;
+}
+
+static int ipsc_epoll_pick( ipsc_t *ipsc, int epfd )
+{
+	unsigned int i;
+
+	if ( ipsc->nepset < 2 )
+		return epfd;
+
+	i = __atomic_fetch_add( &ipsc->epnext, 1, __ATOMIC_RELAXED );
+	return ipsc->epset[i % ipsc->nepset];
+}
+
 int ipsc_epoll_init( ipsc_t *ipsc )
 {
 	int epfd;
@@ -273,60 +1190,80 @@ int ipsc_epoll_init( ipsc_t *ipsc )
 	return epfd;
 }
 
-int ipsc_epoll_wait (ipsc_t *ipsc, int epfd, ssize_t (*cb)(ipsc_t *))
+/*
+ * A client asking for shared memory says so with its first byte, anybody
+ * else is left alone
+ */
+static int ipsc_probe (ipsc_t *ipsc)
 {
-	int i;
-	int pool = 0;
-	ipsc_t *client = NULL;
-	struct epoll_event events[ipsc->maxq];
+	unsigned char c;
 
-	pool = epoll_wait (epfd, events, ipsc->maxq, -1);
-	if ( pool < 0 )
-		return -1;
+	if (ipsc->addr->sa_family != AF_LOCAL || ipsc->type != SOCK_STREAM)
+	{
+		ipsc->flags |= IPSC_FLAG_PROBED;
+		return 0;
+	}
 
-	for ( i = 0; i < pool; i++ ) {
-		/* new client connected */
-		if ( events[i].data.ptr == ipsc ) {
-			/* accept clients, create new fd and add to the pool */
-			while ( (client = ipsc_accept(ipsc)) ) {
-				if ( ipsc_set_nonblock( client ) ) {
-					ipsc_close( client );
-					continue;
-				}
-				if (ipsc_epoll_newfd (client, epfd))
-				{
-					ipsc_close( client );
-					continue;
-				}
-			}
-			continue;
-		}
+	if (ipsc_peek (ipsc, &c, 1) != 1)
+		return 0;
 
-		/* explicitly close connection, SCTP fails without this */
-		// TODO : check
-		// if ( events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR) ) {
-		if (events[i].events & (EPOLLHUP | EPOLLERR)) {
-			ipsc_close (events[i].data.ptr);
-			continue;
-		}
+	ipsc->flags |= IPSC_FLAG_PROBED;
+	if (c == IPSC_SHM_MAGIC)
+		return ipsc_shm_accept (ipsc);
 
-		/* incoming event on previously accepted connection */
-		if ( events[i].events & EPOLLIN ) {
-			if ( !events[i].data.ptr )
-				continue;
-			if ( (*cb)( events[i].data.ptr ) < 0 )
-				ipsc_close( events[i].data.ptr );
+	return 0;
+}
+
+/* drain the rings, then ask for the bell before going back to epoll */
+static int ipsc_shm_serve (ipsc_t *ipsc, ssize_t (*cb)(ipsc_t *))
+{
+	int rc = 0;
+
+	do {
+		while (!(ipsc->flags & IPSC_FLAG_PAUSED) &&
+		       (rc = ipsc_shm_pending (ipsc)) > 0)
+		{
+			if ((*cb) (ipsc) < 0)
+				return -1;
 		}
-	}
+		if (rc < 0 && !(ipsc->flags & IPSC_FLAG_PAUSED))
+			return -1;
+
+		/*
+		 * the bell is shared with waiting for input, ask for it again
+		 * for the queue; paused, input waits until that has gone out
+		 */
+		if (ipsc->olen && ipsc_oflush (ipsc))
+			return -1;
+		if (ipsc->flags & IPSC_FLAG_PAUSED)
+			return 0;
+	} while (ipsc_shm_sleep (ipsc));
 
 	return 0;
 }
 
+/* close, and forget whatever else this round has queued for it */
+static void ipsc_epoll_close (ipsc_t *ipsc, struct epoll_event *events,
+			      int from, int n)
+{
+	int i;
+
+	for (i = from; i < n; i++)
+	{
+		if ((events[i].data.u64 & ~(uint64_t)IPSC_EV_SHM) ==
+		    (uintptr_t)ipsc)
+			events[i].data.ptr = NULL;
+	}
+
+	ipsc_close (ipsc);
+}
+
 int ipsc_epoll_wait_timeout (ipsc_t *ipsc, int epfd,
 		ssize_t (*cb)(ipsc_t *), int timeout)
 {
 	int i;
 	int pool = 0;
+	int hello;
 	ipsc_t *client = NULL;
 	struct epoll_event events[ipsc->maxq];
 
@@ -339,11 +1276,22 @@ int ipsc_epoll_wait_timeout (ipsc_t *ipsc, int epfd,
 		if ( events[i].data.ptr == ipsc ) {
 			/* accept clients, create new fd and add to the pool */
 			while ( (client = ipsc_accept(ipsc)) ) {
+				/* full, turned away before it costs anything */
+				if ( ipsc->maxconn > 0 &&
+				     __atomic_load_n( &ipsc->nconn,
+						      __ATOMIC_RELAXED ) >
+				     ipsc->maxconn ) {
+					__atomic_fetch_add( &ipsc->nrefused, 1,
+							    __ATOMIC_RELAXED );
+					ipsc_close( client );
+					continue;
+				}
 				if ( ipsc_set_nonblock( client ) ) {
 					ipsc_close( client );
 					continue;
 				}
-				if (ipsc_epoll_newfd (client, epfd))
+				if (ipsc_epoll_newfd (client,
+						ipsc_epoll_pick (ipsc, epfd)))
 				{
 					ipsc_close( client );
 					continue;
@@ -352,40 +1300,136 @@ int ipsc_epoll_wait_timeout (ipsc_t *ipsc, int epfd,
 			continue;
 		}
 
-		/* explicitly close connection, SCTP fails without this */
-		// TODO : check
-		// if ( events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR) ) {
-		if (events[i].events & (EPOLLHUP | EPOLLERR)) {
-			ipsc_close (events[i].data.ptr);
+		client = (ipsc_t *)(uintptr_t)(events[i].data.u64 &
+					       ~(uint64_t)IPSC_EV_SHM);
+		if ( !client )
+			continue;
+
+		/* socket has room again, push the queued output */
+		if ( (events[i].events & EPOLLOUT) &&
+		     !(events[i].data.u64 & IPSC_EV_SHM) &&
+		     ipsc_oflush( client ) ) {
+			ipsc_epoll_close( client, events, i, pool );
+			continue;
+		}
+		/* a shm peer rang, it may have made room for the queue */
+		if ( (events[i].data.u64 & IPSC_EV_SHM) && client->olen &&
+		     ipsc_oflush( client ) ) {
+			ipsc_epoll_close( client, events, i, pool );
 			continue;
 		}
 
 		/* incoming event on previously accepted connection */
-		if ( events[i].events & EPOLLIN ) {
-			if ( !events[i].data.ptr )
+		if ( (events[i].events & EPOLLIN) &&
+		     !(client->flags & IPSC_FLAG_PAUSED) ) {
+			hello = 0;
+			if ( client->flags & IPSC_FLAG_NOTIFY ) {
+				ipsc_notify_drain( client );
+			} else if ( !(client->flags & IPSC_FLAG_PROBED) ) {
+				hello = 1;
+				if ( ipsc_probe( client ) ) {
+					ipsc_epoll_close( client, events, i, pool );
+					continue;
+				}
+			}
+			/* past the hello the socket only reports a hang up */
+			if ( client->shm ) {
+				if ( ipsc_shm_serve( client, cb ) ||
+				     (!hello && !(events[i].data.u64 & IPSC_EV_SHM)) )
+					ipsc_epoll_close( client, events, i, pool );
+				continue;
+			}
+			if ( (*cb)( client ) < 0 ) {
+				ipsc_epoll_close( client, events, i, pool );
 				continue;
-			if ( (*cb)( events[i].data.ptr ) < 0 )
-				ipsc_close( events[i].data.ptr );
+			}
+		}
+
+		/*
+		 * explicitly close connection, SCTP fails without this;
+		 * whatever the peer sent before hanging up was served above
+		 */
+		// TODO : check
+		// if ( events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR) ) {
+		if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+			ipsc_epoll_close (client, events, i, pool);
+			continue;
 		}
 	}
 
 	return 0;
 }
 
+int ipsc_epoll_wait (ipsc_t *ipsc, int epfd, ssize_t (*cb)(ipsc_t *))
+{
+	return ipsc_epoll_wait_timeout( ipsc, epfd, cb, -1 );
+}
+
 void ipsc_close( ipsc_t *ipsc )
 {
+	ipsc_t *parent;
+
 	if ( !ipsc )
 		return;
 
+	ipsc_shm_close( ipsc );
+
 	if ( ipsc->sd > 0 ) {
-		shutdown( ipsc->sd, SHUT_RDWR );
+		if ( !(ipsc->flags & IPSC_FLAG_NOTIFY) )
+			shutdown( ipsc->sd, SHUT_RDWR );
 		close( ipsc->sd );
+		ipsc->sd = -1;
 	}
 
-	if ( ipsc->flags & IPSC_FLAG_SERVER )
-		unlink( ((struct sockaddr_un *)ipsc->addr)->sun_path );
+	/* a listener takes down everything it accepted */
+	if ( ipsc->flags & IPSC_FLAG_LISTEN ) {
+		while ( ipsc->next )
+			ipsc_close( ipsc->next );
+		if ( ipsc->addr->sa_family == AF_LOCAL )
+			unlink( ((struct sockaddr_un *)ipsc->addr)->sun_path );
+	}
+
+	if ( ipsc->rbuf ) {
+		__atomic_sub_fetch( &ipsc_raccount( ipsc )->rmem, ipsc->rsize,
+				    __ATOMIC_RELAXED );
+		free( ipsc->rbuf );
+	}
+	free( ipsc->wbuf );
+	free( ipsc->obuf );
+	if ( ipsc->priv && ipsc->priv_free )
+		ipsc->priv_free( ipsc->priv );
+	ipsc->rbuf = ipsc->wbuf = ipsc->obuf = NULL;
+	ipsc->rsize = ipsc->rlen = ipsc->wsize = ipsc->wlen = 0;
+	ipsc->osize = ipsc->olen = ipsc->ooff = 0;
+	ipsc->priv = NULL;
+
+	if ( (parent = ipsc->parent) ) {
+		ipsc_lock( parent );
+		if ( ipsc->prev )
+			ipsc->prev->next = ipsc->next;
+		else
+			parent->next = ipsc->next;
+		if ( ipsc->next )
+			ipsc->next->prev = ipsc->prev;
+		parent->nconn--;
+		ipsc_unlock( parent );
+		ipsc->parent = NULL;
+	}
+
+	ipsc->flags |= IPSC_FLAG_CLOSED;
+	ipsc_unref( ipsc );
+}
+
+void ipsc_ref( ipsc_t *ipsc )
+{
+	__atomic_add_fetch( &ipsc->refs, 1, __ATOMIC_RELAXED );
+}
+
+void ipsc_unref( ipsc_t *ipsc )
+{
+	if ( __atomic_sub_fetch( &ipsc->refs, 1, __ATOMIC_ACQ_REL ) )
+		return;
 
 	free( ipsc->addr );
 	free( ipsc );
-	ipsc = NULL;
 }
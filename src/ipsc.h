@@ -23,10 +23,34 @@
 #include <sys/epoll.h>
 
 #define IPSC_SOCKET_FILE	"/tmp/ipsc-%i.sock"
+/* endpoint string prefixes, see ipsc_listen_addr() */
+#define IPSC_ADDR_UNIX		"unix:"
+#define IPSC_ADDR_TCP		"tcp:"
 #define IPSC_MAX_QUEUE		65535
 #define IPSC_MAX_QUEUE_DEFAULT	16
 /* ipsc connection flags */
 #define IPSC_FLAG_SERVER	0x01
+#define IPSC_FLAG_SHARED	0x02	/* listener polled by several epoll sets */
+#define IPSC_FLAG_LISTEN	0x04	/* owns the socket file */
+#define IPSC_FLAG_NOTIFY	0x08	/* eventfd, see ipsc_notifier() */
+#define IPSC_FLAG_PROBED	0x10	/* accepted: first byte looked at */
+#define IPSC_FLAG_POLLOUT	0x20	/* output queued, waiting for EPOLLOUT */
+#define IPSC_FLAG_PAUSED	0x40	/* output over the high mark, reads wait */
+#define IPSC_FLAG_CLOSED	0x80	/* ipsc_close() done, references remain */
+/* bits from here on are left to upper layers (see jrpc.h) */
+#define IPSC_FLAG_USER		0x100
+
+#define IPSC_BUF_MIN		4096
+#define IPSC_BUF_KEEP		(64 << 10)	/* kept between small messages */
+
+/* shared memory rings, see ipsc_shm_open() */
+#define IPSC_SHM_MAGIC		0xfb	/* hello byte, carries the fds */
+#define IPSC_SHM_RING		(256 << 10)	/* default bytes per direction */
+#define IPSC_SHM_RING_MAX	(64 << 20)	/* largest a server maps */
+#define IPSC_SHM_SPIN_NS	(50 * 1000)	/* busy wait before sleeping */
+#define IPSC_EV_SHM		0x1	/* epoll data tag: ring bell, not socket */
+
+typedef struct ipsc_shm_t ipsc_shm_t;
 
 typedef struct ipsc_t {
 	int sd;			/* socket descriptor */
@@ -35,18 +59,92 @@ typedef struct ipsc_t {
 	int alen;		/* size of address structure pointed by addr */
 	struct sockaddr *addr;	/* address */
 	void *cb_args;		/* ipsc_epoll_wait() callback args */
+	int *epset;		/* listener: epoll sets to spread clients over */
+	int nepset;
+	unsigned int epnext;
+	struct ipsc_t *parent;	/* accepted: listener it came from */
+	struct ipsc_t *next;	/* listener: accepted clients still open */
+	struct ipsc_t *prev;
+	int nconn;		/* listener: number of accepted clients */
+	unsigned long naccept;	/* listener: clients accepted so far */
+	int maxconn;		/* listener: clients at once, 0 - no limit */
+	unsigned long nrefused;	/* listener: closed right away, over maxconn */
+	int lock;		/* listener: guards the client list */
+	char *rbuf;		/* receive buffer, lives as long as the connection */
+	size_t rsize;
+	size_t rlen;		/* bytes of rbuf in use */
+	size_t rmax;		/* rbuf limit, 0 - none; inherited on accept */
+	size_t rmem;		/* listener: rbuf bytes of all its clients */
+	size_t rmemmax;		/* listener: limit for rmem, 0 - none */
+	char *wbuf;		/* send buffer, reused for every message */
+	size_t wsize;
+	size_t wlen;		/* bytes of wbuf in use */
+	char *obuf;		/* output the socket didn't take yet (epoll only) */
+	size_t osize;
+	size_t olen;		/* end of the queued bytes ... */
+	size_t ooff;		/* ... and where sending resumes */
+	size_t ohigh;		/* reads pause with this much queued, 0 - never */
+	size_t olow;		/* and resume once it's down to this */
+	int type;		/* SOCK_STREAM or SOCK_SEQPACKET */
+	int epfd;		/* epoll set the connection is in, -1 - none */
+	ipsc_shm_t *shm;	/* traffic goes through shared memory rings */
+	void *priv;		/* protocol state of the user, kept across events */
+	void (*priv_free)( void *priv );	/* called on it by ipsc_close() */
+	int refs;		/* ipsc_ref(), the memory outlives ipsc_close() */
 } ipsc_t;
 
 ipsc_t *ipsc_listen( uint16_t port, int maxq );
+ipsc_t *ipsc_listen_type( uint16_t port, int maxq, int type );
+ipsc_t *ipsc_listen_addr( const char *addr, int maxq, int type,
+			  int sndbuf, int rcvbuf );
 ipsc_t *ipsc_accept( ipsc_t *ipsc );
 ipsc_t *ipsc_connect( uint16_t port );
+ipsc_t *ipsc_connect_type( uint16_t port, int type );
+ipsc_t *ipsc_connect_addr( const char *addr, int type,
+			   int sndbuf, int rcvbuf );
+int ipsc_pair( ipsc_t *pair[2] );
+int ipsc_set_bufs( ipsc_t *ipsc, int sndbuf, int rcvbuf );
 ssize_t ipsc_send( ipsc_t *ipsc, const void *buf, size_t buflen );
+ssize_t ipsc_sendv( ipsc_t *ipsc, struct iovec *iov, int iovcnt );
 ssize_t ipsc_recv( ipsc_t *ipsc, void *buf,
 		   size_t buflen, unsigned int timeout );
+ssize_t ipsc_recvn( ipsc_t *ipsc, void *buf,
+		    size_t buflen, unsigned int timeout );
+ssize_t ipsc_recv_pkt( ipsc_t *ipsc, void *buf,
+		       size_t buflen, unsigned int timeout );
+ssize_t ipsc_peek( ipsc_t *ipsc, void *buf, size_t buflen );
+void ipsc_set_rlimit( ipsc_t *ipsc, size_t rmax, size_t rmemmax );
+void ipsc_set_wlimit( ipsc_t *ipsc, size_t high, size_t low );
+void ipsc_set_maxconn( ipsc_t *ipsc, int maxconn );
+void *ipsc_rbuf_reserve( ipsc_t *ipsc, size_t len );
+void ipsc_rbuf_trim( ipsc_t *ipsc, size_t used );
+void *ipsc_wbuf_reserve( ipsc_t *ipsc, size_t len );
+void ipsc_wbuf_trim( ipsc_t *ipsc, size_t used );
+ipsc_t *ipsc_notifier( void );
+int ipsc_notify( ipsc_t *ipsc );
 int ipsc_epoll_init( ipsc_t *ipsc );
+int ipsc_epoll_newfd( ipsc_t *ipsc, int epfd );
+void ipsc_epoll_spread( ipsc_t *ipsc, int *epfds, int n );
 int ipsc_epoll_wait( ipsc_t *ipsc, int epfd, ssize_t (*cb)(ipsc_t *ipsc) );
 int ipsc_epoll_wait_timeout (ipsc_t *ipsc, int epfd, ssize_t (*cb)(ipsc_t *),
 		int timeout);
 void ipsc_close( ipsc_t *ipsc );
+/*
+ * Keep the structure of a connection another thread still refers to. Once
+ * closed it only carries IPSC_FLAG_CLOSED, the last ipsc_unref() frees it.
+ */
+void ipsc_ref( ipsc_t *ipsc );
+void ipsc_unref( ipsc_t *ipsc );
+
+int ipsc_shm_open( ipsc_t *ipsc, size_t size, unsigned int timeout );
+int ipsc_shm_accept( ipsc_t *ipsc );
+ssize_t ipsc_shm_read( ipsc_t *ipsc, void *buf, size_t len, size_t min,
+		       int timeout, int peek );
+ssize_t ipsc_shm_write( ipsc_t *ipsc, const void *buf, size_t len );
+ssize_t ipsc_shm_put( ipsc_t *ipsc, const void *buf, size_t len );
+int ipsc_shm_want_room( ipsc_t *ipsc );
+int ipsc_shm_pending( ipsc_t *ipsc );
+int ipsc_shm_sleep( ipsc_t *ipsc );
+void ipsc_shm_close( ipsc_t *ipsc );
 
 #endif /* _LIBIPSC_H_ */
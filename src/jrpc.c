@@ -13,9 +13,312 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
  * See LICENCE.txt file for more details.
  */
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
 #include "jrpc.h"
+#include "trace.h"
 #include "dbg.h"
 
+/* one loop's share of a method's counters, only that loop writes it */
+typedef struct jrpc_mshard_t {
+	jrpc_method_stats_t s;
+} __attribute__((aligned(64))) jrpc_mshard_t;
+
+/* method counters, a shard per loop and a last one for other threads */
+typedef struct jrpc_mstats_t {
+	struct jrpc_mstats_t *next;	/* removed methods, freed with the index */
+	jrpc_mshard_t shard[];
+} jrpc_mstats_t;
+
+/* server counters, sharded the same way */
+typedef struct jrpc_sshard_t {
+	uint64_t wakeups;
+	uint64_t requests;
+	uint64_t parse_errors;
+	uint64_t unknown;
+	uint64_t busy;
+	uint64_t expired;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+} __attribute__((aligned(64))) jrpc_sshard_t;
+
+/* one parameter of a compiled spec, bounds in the type they apply to */
+typedef struct jrpc_pstep_t {
+	const char *name;
+	int type;
+	int optional;
+	int bounded;
+	json_int_t imin;	/* JRPC_PARAM_INT */
+	json_int_t imax;
+	double dmin;		/* JRPC_PARAM_REAL */
+	double dmax;
+	size_t lmin;		/* lengths */
+	size_t lmax;
+} jrpc_pstep_t;
+
+/* jrpc_method_t.spec checked and turned into what a call walks */
+typedef struct jrpc_plan_t {
+	struct jrpc_plan_t *next;	/* replaced ones, freed with the index */
+	int n;
+	jrpc_pstep_t step[];
+} jrpc_plan_t;
+
+/* dispatch index slot, open addressing with linear probing */
+typedef struct jrpc_mslot_t {
+	char *name;		/* NULL - free, JRPC_SLOT_DEAD - removed */
+	size_t len;
+	uint32_t hash;
+	jrpc_method_t m;
+	jrpc_plan_t *plan;	/* NULL - no spec */
+	jrpc_mstats_t *stats;	/* NULL - statistics are off */
+} jrpc_mslot_t;
+
+#if JSON_INTEGER_IS_LONG_LONG
+#define JRPC_INT_MIN		LLONG_MIN
+#define JRPC_INT_MAX		LLONG_MAX
+#else
+#define JRPC_INT_MIN		LONG_MIN
+#define JRPC_INT_MAX		LONG_MAX
+#endif
+
+/*
+ * replies put together from pieces, the parts that never change;
+ * jansson's JSON_COMPACT output of jrpc_send_reply()'s would be the same
+ */
+#ifndef JRPC_LITE
+#define JRPC_REPLY_HEAD		"{\"" JRPC_KEY_JSONRPC "\":\"" \
+				JRPC_KEY_VERSION "\",\"" JRPC_KEY_ID "\":"
+#define JRPC_REPLY_RESULT	",\"" JRPC_KEY_RESULT "\":"
+#define JRPC_REPLY_ERROR	",\"" JRPC_KEY_ERROR "\":"
+#else
+#define JRPC_REPLY_HEAD		"{"
+#define JRPC_REPLY_RESULT	"\"" JRPC_KEY_RESULT "\":"
+#define JRPC_REPLY_ERROR	"\"" JRPC_KEY_ERROR "\":"
+#endif
+#define JRPC_STR(x)		JRPC_STR_(x)
+#define JRPC_STR_(x)		#x
+#define JRPC_REPLY_BUSY		JRPC_REPLY_ERROR "{\"" JRPC_KEY_ERROR_CODE \
+				"\":" JRPC_STR (JRPC_CODE_BUSY) ",\"" \
+				JRPC_KEY_ERROR_TEXT "\":\"" JRPC_ERR_BUSY "\"}}"
+
+#define JRPC_SLOT_DEAD		((char *)-1)
+#define JRPC_INDEX_MINSIZE	64
+
+/* method dispatch index, built once when the server starts */
+typedef struct jrpc_index_t {
+	pthread_rwlock_t lock;
+	size_t size;		/* power of two */
+	size_t used;		/* live entries */
+	size_t dead;		/* removed entries still taking slots */
+	jrpc_mslot_t *slots;
+	int nshards;		/* per method counters, 0 - none */
+	jrpc_mstats_t *retired;	/* counters of removed methods */
+	jrpc_plan_t *plans;	/* and plans of replaced ones */
+} jrpc_index_t;
+
+/* work item posted to a loop */
+typedef struct jrpc_post_t {
+	struct jrpc_post_t *next;
+	jrpc_work_t fn;
+	void *arg;
+} jrpc_post_t;
+
+/* one event loop: own epoll set, connections stay on the loop that accepted them */
+typedef struct jrpc_loop_t {
+	pthread_t tid;
+	int epfd;
+	ipsc_t *ev;		/* wakes the loop up */
+	pthread_mutex_t lock;	/* guards posted work */
+	jrpc_post_t *head;
+	jrpc_post_t *tail;
+	struct jrpc_srv_t *srv;
+} jrpc_loop_t;
+
+/* request being served by the current thread, see jrpc_send_reply() */
+typedef struct jrpc_ctx_t {
+	ipsc_t *ipsc;		/* connection the request came in on */
+	json_t *batch;		/* replies are collected here, not sent */
+	int discard;		/* notification, nothing goes back */
+	int error;		/* answered with an error ... */
+	int code;		/* ... carrying this code */
+	int loop;		/* index of the loop serving ipsc, -1 - none */
+	struct jrpc_job_t *job;	/* on a worker, batch collects its replies */
+	struct jrpc_ckey_t *ckey;	/* cacheable, the result goes in under it */
+	int hit;		/* answered from the cache */
+	uint64_t deadline;	/* ns, the caller stops waiting, 0 - never */
+} jrpc_ctx_t;
+
+/*
+ * server side reader of one connection, ipsc->priv; a message that came
+ * in pieces is picked up where the last epoll event left it
+ */
+typedef struct jrpc_rstate_t {
+	size_t off;		/* rbuf: next message starts here */
+	size_t scan;		/* legacy: bytes of it looked at so far */
+	int depth;		/* legacy: brackets still open */
+	int str;		/* legacy: 1 - in a string, 2 - after a backslash */
+	int drop;		/* legacy: refused, throw it away up to its end */
+	size_t skip;		/* framed: bytes of a refused one still to come */
+	uint64_t credit;	/* jrpc_t.rate: ns worth of requests left */
+	uint64_t last;		/* ns, when it was topped up */
+	uint64_t stamp;		/* ns, when the last bytes came in */
+	ipsc_t *ipsc;
+	struct jrpc_srv_t *srv;	/* serving it, NULL - not a loop */
+} jrpc_rstate_t;
+
+static __thread jrpc_ctx_t *jrpc_ctx;
+/* loop run by this thread, picks its statistics shard */
+static __thread jrpc_loop_t *jrpc_loop_cur;
+/* ns, when the request jrpc_recv_json() got came in, 0 - just now */
+static __thread uint64_t jrpc_arrived;
+/* bytes jrpc_send_json() sent from this thread */
+static __thread uint64_t jrpc_sent;
+
+/* keeps jrpc_t.srv alive while other threads poke at it */
+static pthread_rwlock_t jrpc_srv_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+typedef struct jrpc_srv_t {
+	jrpc_t *jrpc;
+	ipsc_t *ipsc;		/* shared listener */
+	int nloops;
+	int stop;
+	jrpc_loop_t *loops;
+	int *epfds;		/* all loops' epoll sets, for ipsc_epoll_spread() */
+	jrpc_index_t *index;	/* method dispatch table */
+	jrpc_sshard_t *stats;	/* nloops + 1 shards, NULL - off */
+	int inflight;		/* calls on the workers or deferred */
+	pthread_mutex_t dlock;
+	struct jrpc_reply_handle_t *deferred;	/* not completed, under dlock */
+	uint64_t started;	/* ns, CLOCK_MONOTONIC */
+	struct jrpc_wpool_t *wpool;	/* started by the first worker method */
+	struct jrpc_cache_t *cache;	/* NULL - jrpc_t.cache_max is 0 */
+} jrpc_srv_t;
+
+struct jrpc_reply_handle_t {
+	jrpc_t *jrpc;
+	jrpc_srv_t *srv;	/* counts it in flight until it's sent, NULL -
+				   detached by jrpc_srv_free() */
+	ipsc_t *ipsc;		/* referenced until the handle is freed */
+	int loop;
+	int discard;
+	json_t *jid;
+	json_t *jobj;
+	int type;
+	int held;		/* on srv->deferred, holding its in-flight slot */
+	struct jrpc_reply_handle_t *prev;
+	struct jrpc_reply_handle_t *next;
+};
+
+static uint64_t jrpc_now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* shard of the calling thread, threads that aren't loops share the last */
+static int jrpc_stats_shard (jrpc_srv_t *srv)
+{
+	jrpc_loop_t *loop = jrpc_loop_cur;
+
+	return loop && loop->srv == srv ? (int)(loop - srv->loops) :
+					  srv->nloops;
+}
+
+/* loop the calling thread runs, -1 - not one of the server's */
+static int jrpc_loop_index (void)
+{
+	jrpc_loop_t *loop = jrpc_loop_cur;
+
+	return loop ? (int)(loop - loop->srv->loops) : -1;
+}
+
+/* a loop is the only writer of its shard, readers just load */
+static inline void jrpc_stats_add (uint64_t *c, uint64_t n, int shared)
+{
+	if (shared)
+		__atomic_fetch_add (c, n, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n (c, *c + n, __ATOMIC_RELAXED);
+}
+
+static jrpc_sshard_t *jrpc_stats_srv (jrpc_t *jrpc, int *shared)
+{
+	int i;
+	jrpc_srv_t *srv = jrpc->srv;
+
+	if (!srv || !srv->stats)
+		return NULL;
+
+	i = jrpc_stats_shard (srv);
+	*shared = i == srv->nloops;
+	return &srv->stats[i];
+}
+
+static int jrpc_stats_bucket (uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int b = us ? 64 - __builtin_clzll (us) : 0;
+
+	return b < JRPC_STATS_BUCKETS ? b : JRPC_STATS_BUCKETS - 1;
+}
+
+/* codes take the first free slot, the last one gets whatever is left */
+static jrpc_stats_code_t *jrpc_stats_code (jrpc_method_stats_t *s, int code)
+{
+	int i;
+	int c;
+
+	for (i = 0; code && i < JRPC_STATS_CODES - 1; i++)
+	{
+		c = __atomic_load_n (&s->codes[i].code, __ATOMIC_ACQUIRE);
+		if (!c && __atomic_compare_exchange_n (&s->codes[i].code, &c,
+						       code, 0,
+						       __ATOMIC_RELEASE,
+						       __ATOMIC_ACQUIRE))
+			break;
+		if (c == code)
+			break;
+	}
+	if (!code)
+		i = JRPC_STATS_CODES - 1;
+
+	return &s->codes[i];
+}
+
+static void jrpc_stats_call (jrpc_srv_t *srv, jrpc_mstats_t *ms,
+			     jrpc_ctx_t *ctx, size_t in, uint64_t out,
+			     uint64_t ns)
+{
+	int i = jrpc_stats_shard (srv);
+	int shared = i == srv->nloops;
+	jrpc_method_stats_t *s = &ms->shard[i].s;
+
+	jrpc_stats_add (&s->calls, 1, shared);
+	if (ctx->hit)
+		jrpc_stats_add (&s->hits, 1, shared);
+	jrpc_stats_add (&s->bytes_in, in, shared);
+	jrpc_stats_add (&s->bytes_out, out, shared);
+	jrpc_stats_add (&s->time_ns, ns, shared);
+	jrpc_stats_add (&s->hist[jrpc_stats_bucket (ns)], 1, shared);
+	if (ctx->error)
+	{
+		jrpc_stats_add (&s->errors, 1, shared);
+		jrpc_stats_add (&jrpc_stats_code (s, ctx->code)->count, 1,
+				shared);
+	}
+}
+
 static ssize_t jrpc_parse_error (ipsc_t *ipsc, json_t *jid)
 {
 	return jrpc_error (ipsc, jid,
@@ -85,323 +388,4393 @@ void jrpc_add_version (json_t *jroot, json_t *jid)
 		json_object_set_new (jroot, JRPC_KEY_ID, json_null());
 }
 
-ssize_t jrpc_send_json( ipsc_t *ipsc, json_t *jroot )
+static void jrpc_frame_pack (unsigned char *hdr, size_t len, int flags)
 {
-	char *buf = NULL;
-	ssize_t sb = 0;
-	jrpc_runtime_t rt;
+	hdr[0] = JRPC_FRAME_MAGIC;
+	hdr[1] = flags;
+	hdr[2] = 0;
+	hdr[3] = 0;
+	hdr[4] = (len >> 24) & 0xff;
+	hdr[5] = (len >> 16) & 0xff;
+	hdr[6] = (len >> 8) & 0xff;
+	hdr[7] = len & 0xff;
+}
 
-	if ( ipsc->flags & IPSC_FLAG_SERVER ) {
-		rt = ((jrpc_t *)ipsc->cb_args)->rt;
-	} else {
-		rt = ((jrpc_req_t *)ipsc->cb_args)->rt;
+static ssize_t jrpc_frame_unpack (const unsigned char *hdr)
+{
+	size_t len;
+
+	if (hdr[0] != JRPC_FRAME_MAGIC)
+	{
+		errno = EPROTO;
+		return -1;
 	}
 
-	if ((buf = json_dumps (jroot, JSON_COMPACT)) == NULL)
-//	if ((buf = json_dumps (jroot, JSON_INDENT(2))) == NULL)
+	len = ((size_t)hdr[4] << 24) | ((size_t)hdr[5] << 16) |
+	      ((size_t)hdr[6] << 8) | (size_t)hdr[7];
+	if (len > JRPC_FRAME_MAXLEN)
 	{
-		sb = JRPC_ERR_GENERIC;
-		return sb;
+		errno = EMSGSIZE;
+		return -1;
 	}
 
-	//////////////////////////////////////
-	_dbg ("JRPC", ">> \n%s\n", buf);
-	//////////////////////////////////////
+	return len;
+}
 
-	sb = ipsc_send (ipsc, buf, strlen(buf));
+static int jrpc_sock_type( jrpc_conn_t *conn )
+{
+	if ( conn->transport == JRPC_TRANSPORT_SEQPACKET )
+		return SOCK_SEQPACKET;
 
-	free (buf);
-	return sb;
+	return SOCK_STREAM;
 }
 
-ssize_t jrpc_recv_json (ipsc_t *ipsc, json_t **jp)
+/* endpoint string for ipsc, plain port numbers are Unix sockets */
+static const char *jrpc_conn_addr( jrpc_conn_t *conn, char *buf, size_t len )
 {
-	char *buf = NULL;
-	size_t buflen = 0;
-	ssize_t rb = 0;
-	ssize_t trb = 0;
-	json_t *jobj; 
-	int timeout;
-	jrpc_runtime_t rt;
+	if ( conn->addr )
+		return conn->addr;
 
-	json_error_t error;
+	snprintf( buf, len, IPSC_ADDR_UNIX "%i", conn->port );
+	return buf;
+}
 
-	if ( ipsc->flags & IPSC_FLAG_SERVER ) {
-		timeout = ((jrpc_t *)ipsc->cb_args)->conn.timeout;
-		rt = ((jrpc_t *)ipsc->cb_args)->rt;
-	} else {
-		timeout = ((jrpc_req_t *)ipsc->cb_args)->conn.timeout;
-		rt = ((jrpc_req_t *)ipsc->cb_args)->rt;
-	}
+/* encodings we read, whether or not rt asks to send them */
+static const jrpc_codec_t *jrpc_codec_find (int enc)
+{
+	if (enc == JRPC_ENC_CBOR)
+		return &jrpc_codec_cbor;
 
-	buflen = JRPC_DEFAULT_RCVBUF_STREAM;
+	return NULL;
+}
 
-	/* TODO: add hard memory limit */
-	buf = (char *)malloc (buflen);
+/* the binary encoding goes out only once the peer showed it reads it */
+static void jrpc_codec_seen (ipsc_t *ipsc, jrpc_runtime_t *rt, int flags)
+{
+	const jrpc_codec_t *codec = (const jrpc_codec_t *)rt->bin_ctx;
 
-	if (buf == NULL)
-	{
-		return -1;
-	}
+	if (codec && ((flags & JRPC_FRAME_ENC_MASK) == codec->enc ||
+		      (flags & JRPC_FRAME_ACCEPT (codec->enc))))
+		ipsc->flags |= JRPC_FLAG_BINARY;
+}
 
-	/* TODO: add hard memory limit */
-	while ( (trb = ipsc_recv( ipsc, buf + rb,
-					buflen - rb - 1, timeout )) > 0 )
-	{
-		/* lower the timeout after first data received */
-		if ( timeout > 0 )
-			timeout = 10;
-		rb += trb;
-		if ( rb > buflen - 2 ) {
-			buflen += buflen;
-			buf = (char *)realloc( buf, buflen );
-		}
-	}
+/* json_dump_callback() sink, appends to the connection send buffer */
+static int jrpc_wbuf_write (const char *buf, size_t size, void *data)
+{
+	ipsc_t *ipsc = (ipsc_t *)data;
 
-	if ( rb < 2 )
-		rb = 0;
+	if (!ipsc_wbuf_reserve (ipsc, ipsc->wlen + size))
+		return -1;
 
-	// TODO : ????
-	// jobj = json_loadb (buf, (size_t)rb, JSON_DISABLE_EOF_CHECK, &error);
-	jobj = json_loads (buf, JSON_DISABLE_EOF_CHECK, &error);
-	if (!jobj)
+	memcpy (ipsc->wbuf + ipsc->wlen, buf, size);
+	ipsc->wlen += size;
+	return 0;
+}
+
+/* the receiving end would only get it truncated */
+static int jrpc_wbuf_fits (ipsc_t *ipsc, size_t len)
+{
+	if (ipsc->type == SOCK_SEQPACKET &&
+	    ((ipsc->flags & JRPC_FLAG_FRAMED) ? ipsc->wlen : len) >
+	    JRPC_DEFAULT_RCVBUF_DGRAM)
 	{
-		rb = -1;
+		ipsc->wlen = 0;
+		ipsc_wbuf_trim (ipsc, len);
+		errno = EMSGSIZE;
+		return -1;
 	}
 
-	//////////////////////////////////////
+	return 0;
+}
 
-	char *tmp;
-	tmp = json_dumps (jobj, JSON_INDENT(2));
-	if (tmp == NULL) 
+/* send the len bytes of payload jrpc_wbuf_dump() left, with the header */
+static ssize_t jrpc_wbuf_send (ipsc_t *ipsc, size_t len)
+{
+	ssize_t sb;
+
+	/* header and payload in one go */
+	if (ipsc->flags & JRPC_FLAG_FRAMED)
 	{
+		sb = ipsc_send (ipsc, ipsc->wbuf, ipsc->wlen);
+		if (sb > 0)
+			sb -= JRPC_FRAME_HDRLEN;
 	}
-	else 
+	else
 	{
-		_dbg ("JRPC", "<< \n%s\n", tmp);
-		free (tmp);
+		sb = ipsc_send (ipsc, ipsc->wbuf + JRPC_FRAME_HDRLEN, len);
 	}
 
-	//////////////////////////////////////
-
-	free (buf);
+	if (sb > 0)
+		jrpc_sent += sb;
 
-	*jp = jobj;
-	return rb;
+	ipsc->wlen = 0;
+	ipsc_wbuf_trim (ipsc, len);
+	return sb;
 }
 
-ssize_t jrpc_process( ipsc_t *ipsc )
+/*
+ * serialize jroot into the send buffer behind room for the frame header,
+ * returns the payload length
+ */
+static ssize_t jrpc_wbuf_dump (ipsc_t *ipsc, json_t *jroot,
+			       jrpc_runtime_t *rt)
 {
-	int i, idx;
-	size_t rb;
-	size_t sb = 0;
-	json_t *jp = NULL;
-	json_t *jparams = NULL;
-	json_t *jid = NULL;
-	jrpc_cb_t cb;
-	jrpc_t *jrpc = (jrpc_t *)ipsc->cb_args;
-	char *method = NULL;
+	size_t len;
+	int rc;
+	int flags = 0;
+	const jrpc_codec_t *codec = (const jrpc_codec_t *)rt->bin_ctx;
 
-	ipsc->flags |= IPSC_FLAG_SERVER;
+	/* unframed peers only know JSON */
+	if (codec && (ipsc->flags & JRPC_FLAG_FRAMED))
+		flags |= JRPC_FRAME_ACCEPT (codec->enc);
+	if (!(ipsc->flags & JRPC_FLAG_BINARY) || !flags)
+		codec = NULL;
 
-	rb = jrpc_recv_json (ipsc, &jp);
-	if ( rb < 2 )
+	ipsc->wlen = JRPC_FRAME_HDRLEN;
+	if (!ipsc_wbuf_reserve (ipsc, JRPC_FRAME_HDRLEN))
+		rc = -1;
+	else if (codec)
+		rc = codec->encode (jroot, jrpc_wbuf_write, ipsc);
+	else
+		rc = json_dump_callback (jroot, jrpc_wbuf_write, ipsc,
+					 JSON_COMPACT);
+	if (rc)
 	{
-		syslog( LOG_WARNING, "jrpc_process(recv): %m (%li)", rb );
-		sb = jrpc_parse_error( ipsc, NULL );
-		goto ret;
+		ipsc->wlen = 0;
+		return -1;
 	}
 
-	json_unpack (jp, "{s?:o}", JRPC_KEY_ID, &jid);
+	len = ipsc->wlen - JRPC_FRAME_HDRLEN;
+	if (jrpc_wbuf_fits (ipsc, len))
+		return -1;
 
-#ifndef JRPC_LITE
-	/* check version string if we use standart fields */
-	if (jrpc_check_version (jp))
-	{
-		sb = jrpc_invalid_request (ipsc, jid);
-		goto ret;
-	}
+	if (codec)
+		flags |= codec->enc;
+	jrpc_frame_pack ((unsigned char *)ipsc->wbuf, len, flags);
+
+	if (codec)
+		jrpc_trace (JRPC_TRACE_MSG, ">> [%s, %zu bytes]",
+			    codec->name, len);
+	else
+		jrpc_trace (JRPC_TRACE_MSG, ">> %.*s", (int)len,
+			    ipsc->wbuf + JRPC_FRAME_HDRLEN);
+#ifdef DEBUG
+	_dbg ("JRPC", ">> \n%.*s\n", (int)len, ipsc->wbuf + JRPC_FRAME_HDRLEN);
 #endif
 
-	/* send error back if 'method' key is not found */
-	if (json_unpack (jp, "{s:s}", JRPC_KEY_METHOD, &method))
-	{
-		sb = jrpc_invalid_request (ipsc, jid);
-		goto ret;
+	return len;
+}
+
+ssize_t jrpc_send_json( ipsc_t *ipsc, json_t *jroot )
+{
+	ssize_t sb = 0;
+	ssize_t len;
+	jrpc_runtime_t rt;
+
+	if ( ipsc->flags & IPSC_FLAG_SERVER ) {
+		rt = ((jrpc_t *)ipsc->cb_args)->rt;
+	} else {
+		rt = ((jrpc_req_t *)ipsc->cb_args)->rt;
 	}
 
-	for ( i = 0; jrpc->methods[i].name; i++ )
+	if ((len = jrpc_wbuf_dump (ipsc, jroot, &rt)) < 0)
 	{
-		if ( strncmp (method, jrpc->methods[i].name,
-			      strlen(jrpc->methods[i].name) + 1 ) )
-			continue;
+		sb = JRPC_ERR_GENERIC;
+		return sb;
+	}
 
-		switch ( jrpc->methods[i].params )
-		{
-		case JRPC_CB_HAS_PARAMS:
-			if (json_unpack (jp, "{s:o}", JRPC_KEY_PARAMS, &jparams))
-			{
-				sb = jrpc_invalid_params (ipsc, jid);
-				goto ret;
-			}
-			break;
-		case JRPC_CB_OPT_PARAMS:
-			if (json_unpack (jp, "{s?:o}", JRPC_KEY_PARAMS, &jparams))
-			{
-				sb = jrpc_invalid_params (ipsc, jid);
-				goto ret;
-			}
-			break;
-		case JRPC_CB_NO_PARAMS:
-		default:
+	return jrpc_wbuf_send (ipsc, len);
+}
+
+/*
+ * throw away a refused message so the peer can finish sending and read the
+ * error; len < 0 - legacy stream, up to where it goes quiet
+ */
+static void jrpc_recv_skip (ipsc_t *ipsc, ssize_t len, int timeout)
+{
+	char tmp[JRPC_DEFAULT_RCVBUF_STREAM];
+	ssize_t rb;
+	int err = errno;
+
+	while (len != 0)
+	{
+		if (len < 0)
+			rb = ipsc_recv (ipsc, tmp, sizeof tmp, timeout);
+		else
+			rb = ipsc_recvn (ipsc, tmp, (size_t)len < sizeof tmp ?
+					 (size_t)len : sizeof tmp, timeout);
+		if (rb <= 0)
 			break;
-		}
+		if (len > 0)
+			len -= rb;
+		if (timeout > 0)
+			timeout = 10;
+	}
 
-		if (!jrpc->methods[i].handlers)
-		{
-			sb = jrpc_not_implemented (ipsc, jid);
-			goto ret;
-		}
+	/* connection broke meanwhile, that is what the caller should see */
+	errno = len > 0 ? ECONNRESET : err;
+}
 
-		if (!jrpc->methods[i].handlers[0])
-		{
-			sb = jrpc_not_implemented (ipsc, jid);
-			goto ret;
-		}
+/*
+ * read one length-prefixed message into the connection buffer, returns as
+ * soon as the last byte is in; oversized ones are refused from the header
+ */
+static ssize_t jrpc_recv_frame (ipsc_t *ipsc, char **p, int timeout,
+				int *flags)
+{
+	char *buf = NULL;
+	ssize_t len;
+	unsigned char hdr[JRPC_FRAME_HDRLEN];
 
-		for (idx = 0; jrpc->methods[i].handlers[idx]; idx++)
-		{
-			cb = jrpc->methods[i].handlers[idx];
-			sb = cb (ipsc, jparams, jid);
-			if ( sb == 0 )
-				break;
-			if ( sb < 0 ) {
-				sb = jrpc_internal_error (ipsc, jid);
-				break;
-			}
-		}
+	if (ipsc_recvn (ipsc, hdr, sizeof hdr, timeout) != sizeof hdr)
+		return -1;
 
-		goto ret;
+	/* refused from the header alone, nothing reserved for it */
+	len = jrpc_frame_unpack (hdr);
+	if (len < 0 && errno != EMSGSIZE)
+		return -1;
+	if (len < 0)
+	{
+		len = ((size_t)hdr[4] << 24) | ((size_t)hdr[5] << 16) |
+		      ((size_t)hdr[6] << 8) | (size_t)hdr[7];
+		errno = EMSGSIZE;
+		jrpc_recv_skip (ipsc, len, timeout);
+		return -1;
 	}
 
-	/* no method defined, send standard error */
-	sb = jrpc_method_not_found (ipsc, jid);
-
-ret:
-	if (sb < 0)
-		syslog (LOG_WARNING, "jrpc_process(recv|send): %m (%li)", sb);
+	/* over rcvbuf_max or rcvmem_max, errno says which */
+	buf = (char *)ipsc_rbuf_reserve (ipsc, len + 1);
+	if (buf == NULL)
+	{
+		if (errno == EMSGSIZE || errno == ENOBUFS)
+			jrpc_recv_skip (ipsc, len, timeout);
+		return -1;
+	}
 
-	json_decref (jp);
+	if (ipsc_recvn (ipsc, buf, len, timeout) != len)
+		return -1;
 
-	return sb;
+	buf[len] = '\0';
+	ipsc->rlen = len;
+	*flags = hdr[1];
+	*p = buf;
+	return len;
 }
 
-void *jrpc_server( void *args )
+/*
+ * seqpacket: the kernel hands over exactly one message, framed or legacy
+ * JSON as the first byte says; anything that did not fit is already gone.
+ * timeout < 0 - only what is there, EAGAIN if nothing
+ */
+static ssize_t jrpc_recv_packet (ipsc_t *ipsc, char **p, int timeout,
+				 int *flags)
 {
-	if ( !args )
-		return NULL;
-
-	int epfd = -1;
-	jrpc_t *jrpc = (jrpc_t *)args;
-	ipsc_t *ipsc = ipsc_listen( jrpc->conn.port, jrpc->maxqueue );
+	char *buf;
+	char c;
+	ssize_t rb;
+	ssize_t len;
+	int err;
 
-	if ( !ipsc ) {
+	if (timeout < 0 && (ipsc->flags & IPSC_FLAG_PAUSED))
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	buf = (char *)ipsc_rbuf_reserve (ipsc, JRPC_DEFAULT_RCVBUF_DGRAM + 1);
+	if (buf == NULL && timeout < 0)
+	{
+		/* refused, it has to go or the next read would find it again */
+		err = errno;
+		do {
+			rb = recv (ipsc->sd, &c, 1, MSG_DONTWAIT | MSG_TRUNC);
+		} while (rb < 0 && errno == EINTR);
+		if (rb == 0)
+			errno = ECONNRESET;
+		else if (rb > 0)
+			errno = err;
+		return -1;
+	}
+	if (buf == NULL)
+		return -1;
+
+	if (timeout >= 0)
+		rb = ipsc_recv_pkt (ipsc, buf, ipsc->rsize - 1, timeout);
+	else
+	{
+		do {
+			rb = recv (ipsc->sd, buf, ipsc->rsize - 1,
+				   MSG_DONTWAIT | MSG_TRUNC);
+		} while (rb < 0 && errno == EINTR);
+		if (rb >= (ssize_t)ipsc->rsize)
+		{
+			errno = EMSGSIZE;
+			return -1;
+		}
+		if (rb == 0)
+			errno = ECONNRESET;
+	}
+	if (rb <= 0)
+		return -1;
+
+	if (!(ipsc->flags & JRPC_FLAG_PROBED))
+	{
+		ipsc->flags |= JRPC_FLAG_PROBED;
+		if ((unsigned char)buf[0] == JRPC_FRAME_MAGIC)
+			ipsc->flags |= JRPC_FLAG_FRAMED;
+	}
+
+	len = rb;
+	if (ipsc->flags & JRPC_FLAG_FRAMED)
+	{
+		len = jrpc_frame_unpack ((unsigned char *)buf);
+		if (len < 0 || len != rb - JRPC_FRAME_HDRLEN)
+		{
+			errno = EPROTO;
+			return -1;
+		}
+		*flags = (unsigned char)buf[1];
+		buf += JRPC_FRAME_HDRLEN;
+	}
+
+	buf[len] = '\0';
+	ipsc->rlen = rb;
+	*p = buf;
+	return len;
+}
+
+/* legacy peers: message ends when nothing more arrives for a while */
+static ssize_t jrpc_recv_stream (ipsc_t *ipsc, char **p, int timeout)
+{
+	size_t rb = 0;
+	ssize_t trb = 0;
+
+	if (!ipsc_rbuf_reserve (ipsc, JRPC_DEFAULT_RCVBUF_STREAM))
+		return -1;
+
+	while ( (trb = ipsc_recv( ipsc, ipsc->rbuf + rb,
+					ipsc->rsize - rb - 1, timeout )) > 0 )
+	{
+		/* lower the timeout after first data received */
+		if ( timeout > 0 )
+			timeout = 10;
+		rb += trb;
+		/* doubles the buffer, fails past the connection limits */
+		if ( !ipsc_rbuf_reserve( ipsc, rb + 2 ) ) {
+			if ( errno == EMSGSIZE || errno == ENOBUFS )
+				jrpc_recv_skip( ipsc, -1, timeout );
+			return -1;
+		}
+	}
+
+	ipsc->rbuf[rb] = '\0';
+	ipsc->rlen = rb;
+	*p = ipsc->rbuf;
+	return rb;
+}
+
+/* legacy stream, JSON text up to where the top level value closes */
+static int jrpc_scan_json (ipsc_t *ipsc, jrpc_rstate_t *rs, size_t *len)
+{
+	const char *p = ipsc->rbuf + rs->off;
+	size_t n = ipsc->rlen - rs->off;
+	size_t i;
+
+	for (i = rs->scan; i < n; i++)
+	{
+		if (rs->str)
+		{
+			if (rs->str == 2)
+				rs->str = 1;
+			else if (p[i] == '\\')
+				rs->str = 2;
+			else if (p[i] == '"')
+				rs->str = 0;
+			continue;
+		}
+
+		switch (p[i])
+		{
+		case '{':
+		case '[':
+			rs->depth++;
+			break;
+		case '}':
+		case ']':
+			if (!rs->depth)
+				goto bad;
+			if (--rs->depth)
+				break;
+			*len = i + 1;
+			rs->scan = 0;
+			return 1;
+		case ' ':
+		case '\t':
+		case '\r':
+		case '\n':
+			break;
+		case '"':
+			if (!rs->depth)
+				goto bad;
+			rs->str = 1;
+			break;
+		default:
+			if (!rs->depth)
+				goto bad;
+			break;
+		}
+	}
+
+	rs->scan = n;
+	return 0;
+
+bad:
+	/* not a request, hand over everything so it gets a parse error */
+	rs->scan  = 0;
+	rs->depth = 0;
+	*len = n;
+	return 1;
+}
+
+/* srv->dlock held; its slot goes back, the handle itself stays */
+static void jrpc_reply_unlink (jrpc_reply_handle_t *h)
+{
+	if (h->prev)
+		h->prev->next = h->next;
+	else
+		h->srv->deferred = h->next;
+	if (h->next)
+		h->next->prev = h->prev;
+	h->prev = h->next = NULL;
+	__atomic_store_n (&h->held, 0, __ATOMIC_RELEASE);
+	__atomic_sub_fetch (&h->srv->inflight, 1, __ATOMIC_RELAXED);
+}
+
+/* the connection is closed: replies it still waits for stop counting */
+static void jrpc_rstate_free (void *priv)
+{
+	jrpc_rstate_t *rs = (jrpc_rstate_t *)priv;
+	jrpc_reply_handle_t *h;
+	jrpc_reply_handle_t *next;
+
+	if (rs->srv)
+	{
+		pthread_mutex_lock (&rs->srv->dlock);
+		for (h = rs->srv->deferred; h; h = next)
+		{
+			next = h->next;
+			if (h->ipsc == rs->ipsc)
+				jrpc_reply_unlink (h);
+		}
+		pthread_mutex_unlock (&rs->srv->dlock);
+	}
+
+	free (rs);
+}
+
+static jrpc_rstate_t *jrpc_rstate (ipsc_t *ipsc)
+{
+	jrpc_rstate_t *rs;
+
+	if (!ipsc->priv && (rs = calloc (1, sizeof (jrpc_rstate_t))))
+	{
+		rs->ipsc = ipsc;
+		rs->srv  = jrpc_loop_cur ? jrpc_loop_cur->srv : NULL;
+		ipsc->priv = rs;
+		ipsc->priv_free = jrpc_rstate_free;
+	}
+
+	return (jrpc_rstate_t *)ipsc->priv;
+}
+
+/*
+ * server side stream: the next whole message out of what has arrived so
+ * far, reading only what the socket or shm ring already holds. EAGAIN -
+ * not complete yet, the partial message stays in rbuf for the next event.
+ * Requests that are too large are refused once and dropped as the rest
+ * comes in.
+ */
+static ssize_t jrpc_recv_buffered (ipsc_t *ipsc, char **p, int *flags)
+{
+	jrpc_rstate_t *rs;
+	unsigned char *hdr;
+	size_t avail;
+	size_t need;
+	size_t len;
+	ssize_t rb;
+
+	if (!(rs = jrpc_rstate (ipsc)))
+		return -1;
+
+	while (1)
+	{
+		avail = ipsc->rlen - rs->off;
+		if (rs->skip)
+		{
+			len = rs->skip < avail ? rs->skip : avail;
+			rs->skip -= len;
+			rs->off  += len;
+			avail    -= len;
+		}
+		need = avail + 1;
+
+		if (avail && !(ipsc->flags & JRPC_FLAG_PROBED))
+		{
+			ipsc->flags |= JRPC_FLAG_PROBED;
+			if ((unsigned char)ipsc->rbuf[rs->off] == JRPC_FRAME_MAGIC)
+				ipsc->flags |= JRPC_FLAG_FRAMED;
+		}
+
+		if (avail && (ipsc->flags & JRPC_FLAG_FRAMED))
+		{
+			hdr  = (unsigned char *)ipsc->rbuf + rs->off;
+			need = JRPC_FRAME_HDRLEN;
+			if (avail >= need)
+			{
+				rb = jrpc_frame_unpack (hdr);
+				if (rb < 0 && errno != EMSGSIZE)
+					return -1;
+				if (rb < 0)
+				{
+					rs->skip = JRPC_FRAME_HDRLEN +
+						(((size_t)hdr[4] << 24) |
+						 ((size_t)hdr[5] << 16) |
+						 ((size_t)hdr[6] << 8) |
+						 (size_t)hdr[7]);
+					return -1;
+				}
+				need += rb;
+			}
+			if (avail >= need)
+			{
+				*flags = hdr[1];
+				*p = (char *)hdr + JRPC_FRAME_HDRLEN;
+				rs->off += need;
+				return need - JRPC_FRAME_HDRLEN;
+			}
+		}
+		else if (avail && jrpc_scan_json (ipsc, rs, &len))
+		{
+			*p = ipsc->rbuf + rs->off;
+			rs->off += len;
+			if (!rs->drop)
+				return len;
+			rs->drop = 0;
+			continue;
+		}
+		else if (avail && rs->drop)
+		{
+			/* scanned part of a refused message, nothing to keep */
+			ipsc->rlen -= rs->scan;
+			rs->scan = 0;
+			need = 1;
+		}
+
+		/* the rest waits until the output queue is down again */
+		if (ipsc->flags & IPSC_FLAG_PAUSED)
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+
+		/* what is left goes to the front, then room for the rest */
+		if (rs->off)
+		{
+			memmove (ipsc->rbuf, ipsc->rbuf + rs->off,
+				 ipsc->rlen - rs->off);
+			ipsc->rlen -= rs->off;
+			rs->off = 0;
+		}
+		if (!ipsc_rbuf_reserve (ipsc, need > ipsc->rlen ? need :
+					ipsc->rlen + 1))
+		{
+			if (errno != EMSGSIZE && errno != ENOBUFS)
+				return -1;
+			/* refused, what is buffered goes first */
+			if (ipsc->flags & JRPC_FLAG_FRAMED)
+				rs->skip = need;
+			else
+				rs->drop = 1;
+			return -1;
+		}
+
+		do {
+			rb = ipsc->shm ?
+			     ipsc_shm_read (ipsc, ipsc->rbuf + ipsc->rlen,
+					    ipsc->rsize - ipsc->rlen, 0, 0, 0) :
+			     recv (ipsc->sd, ipsc->rbuf + ipsc->rlen,
+				   ipsc->rsize - ipsc->rlen, MSG_DONTWAIT);
+		} while (rb < 0 && errno == EINTR);
+		if (rb == 0)
+			errno = ECONNRESET;
+		if (rb <= 0)
+			return -1;
+		ipsc->rlen += rb;
+		rs->stamp = jrpc_now_ns ();
+	}
+}
+
+/* buffered messages all served, rbuf can shrink back */
+static void jrpc_rbuf_consumed (ipsc_t *ipsc, size_t used)
+{
+	jrpc_rstate_t *rs = (jrpc_rstate_t *)ipsc->priv;
+
+	if (!rs || rs->off < ipsc->rlen)
+		return;
+
+	ipsc->rlen = 0;
+	rs->off = 0;
+	ipsc_rbuf_trim (ipsc, used);
+}
+
+/*
+ * jrpc_t.maxinflight and jrpc_t.rate: 0 - serve it, -1 - turn it down.
+ * The rate is a token bucket in ns, refilled as time goes by.
+ */
+static int jrpc_admit (ipsc_t *ipsc, jrpc_t *jrpc)
+{
+	jrpc_rstate_t *rs;
+	uint64_t now;
+	uint64_t cost;
+	uint64_t cap;
+
+	if (jrpc->maxinflight > 0 && jrpc->srv &&
+	    __atomic_load_n (&jrpc->srv->inflight, __ATOMIC_RELAXED) >=
+	    jrpc->maxinflight)
+		return -1;
+
+	if (jrpc->rate <= 0 || !(rs = jrpc_rstate (ipsc)))
+		return 0;
+
+	now  = jrpc_now_ns ();
+	cost = 1000000000ull / (unsigned)jrpc->rate;
+	cap  = cost * (unsigned)(jrpc->burst > 0 ? jrpc->burst : jrpc->rate);
+	if (!rs->last)
+		rs->credit = cap;
+	else if ((rs->credit += now - rs->last) > cap)
+		rs->credit = cap;
+	rs->last = now;
+
+	if (rs->credit < cost)
+		return -1;
+
+	rs->credit -= cost;
+	return 0;
+}
+
+/* an id as sent that can go back as it is: a string, a number or null */
+static int jrpc_id_valid (const char *p, size_t n)
+{
+	size_t i = 0;
+	size_t k;
+
+	if (n == 4 && !memcmp (p, "null", 4))
+		return 1;
+
+	if (p[0] == '"')
+	{
+		if (n < 2 || p[n - 1] != '"')
+			return 0;
+		for (i = 1; i < n - 1; i++)
+		{
+			if ((unsigned char)p[i] < 0x20)
+				return 0;
+			if (p[i] != '\\')
+				continue;
+			if (++i == n - 1)
+				return 0;
+			if (p[i] == 'u')
+			{
+				for (k = 0; k < 4; k++)
+					if (++i == n - 1 ||
+					    !isxdigit ((unsigned char)p[i]))
+						return 0;
+			}
+			else if (!strchr ("\"\\/bfnrt", p[i]) || !p[i])
+				return 0;
+		}
+		return 1;
+	}
+
+	/* -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)? */
+	if (p[i] == '-')
+		i++;
+	if (i < n && p[i] == '0')
+		i++;
+	else if (i < n && p[i] >= '1' && p[i] <= '9')
+		while (i < n && isdigit ((unsigned char)p[i]))
+			i++;
+	else
+		return 0;
+	if (i < n && p[i] == '.')
+	{
+		for (k = ++i; i < n && isdigit ((unsigned char)p[i]); i++)
+			;
+		if (i == k)
+			return 0;
+	}
+	if (i < n && (p[i] == 'e' || p[i] == 'E'))
+	{
+		if (++i < n && (p[i] == '+' || p[i] == '-'))
+			i++;
+		for (k = i; i < n && isdigit ((unsigned char)p[i]); i++)
+			;
+		if (i == k)
+			return 0;
+	}
+
+	return i == n;
+}
+
+/*
+ * the top level "id" of a request nobody is going to parse, as it was
+ * sent. 1 - found at *off, *n bytes long, 0 - none, a notification,
+ * -1 - not something to look into, or an id that can't be copied over
+ */
+static int jrpc_scan_id (const char *buf, size_t len, size_t *off, size_t *n)
+{
+	size_t i = 0;
+	size_t k;
+	int depth = 0;
+	int key = 0;
+	int esc;
+	int escaped;
+	int found = 0;
+
+	while (i < len && isspace ((unsigned char)buf[i]))
+		i++;
+	if (i == len || buf[i] != '{')
+		return -1;
+
+	/* to the end, the last of repeated keys is the one that counts */
+	for (; i < len; i++)
+	{
+		switch (buf[i])
+		{
+		case '{':
+		case '[':
+			key = !depth++;
+			break;
+		case '}':
+		case ']':
+			if (!--depth)
+				return found;
+			break;
+		case ',':
+			key = depth == 1;
+			break;
+		case '"':
+			for (k = ++i, esc = escaped = 0;
+			     i < len && (esc || buf[i] != '"'); i++)
+				escaped |= esc = !esc && buf[i] == '\\';
+			if (!key)
+				break;
+			key = 0;
+			/* "\u0069d" is an id too, not worth decoding here */
+			if (escaped)
+				return -1;
+			if (i - k != strlen (JRPC_KEY_ID) ||
+			    memcmp (buf + k, JRPC_KEY_ID, i - k))
+				break;
+
+			/* the value, whatever it is, up to where it ends */
+			for (i++; i < len && (isspace ((unsigned char)buf[i]) ||
+					      buf[i] == ':'); i++)
+				;
+			k = i;
+			if (i < len && buf[i] == '"')
+			{
+				for (i++, esc = 0; i < len && (esc || buf[i] != '"');
+				     i++)
+					esc = !esc && buf[i] == '\\';
+				i++;
+			}
+			else
+			{
+				while (i < len && (isalnum ((unsigned char)buf[i]) ||
+						   buf[i] == '+' || buf[i] == '-' ||
+						   buf[i] == '.'))
+					i++;
+			}
+			if (i > len || i == k || i - k > 128 ||
+			    !jrpc_id_valid (buf + k, i - k))
+				return -1;
+
+			*off = k;
+			*n = i - k;
+			found = 1;
+			/* whatever ended it is looked at next */
+			i--;
+			break;
+		}
+	}
+
+	return -1;
+}
+
+/* JRPC_CODE_BUSY for what jrpc_admit() turned down, the id copied over */
+static ssize_t jrpc_send_busy (ipsc_t *ipsc, const char *buf, size_t len,
+			       int flags)
+{
+	size_t off = 0;
+	size_t n = 0;
+	int found = -1;
+	const jrpc_codec_t *codec;
+
+	if (!(flags & JRPC_FRAME_ENC_MASK))
+		found = jrpc_scan_id (buf, len, &off, &n);
+#ifndef JRPC_LITE
+	/* a notification, nothing goes back for it either way */
+	if (!found)
+		return 0;
+#endif
+
+	flags = 0;
+	codec = (const jrpc_codec_t *)((jrpc_t *)ipsc->cb_args)->rt.bin_ctx;
+	if (codec && (ipsc->flags & JRPC_FLAG_FRAMED))
+		flags |= JRPC_FRAME_ACCEPT (codec->enc);
+
+	ipsc->wlen = JRPC_FRAME_HDRLEN;
+	if (!ipsc_wbuf_reserve (ipsc, JRPC_FRAME_HDRLEN) ||
+	    jrpc_wbuf_write (JRPC_REPLY_HEAD, strlen (JRPC_REPLY_HEAD), ipsc) ||
+#ifndef JRPC_LITE
+	    (found > 0 ? jrpc_wbuf_write (buf + off, n, ipsc) :
+			 jrpc_wbuf_write ("null", 4, ipsc)) ||
+#endif
+	    jrpc_wbuf_write (JRPC_REPLY_BUSY, strlen (JRPC_REPLY_BUSY), ipsc))
+	{
+		ipsc->wlen = 0;
+		return JRPC_ERR_GENERIC;
+	}
+
+	len = ipsc->wlen - JRPC_FRAME_HDRLEN;
+	if (jrpc_wbuf_fits (ipsc, len))
+		return JRPC_ERR_GENERIC;
+
+	jrpc_frame_pack ((unsigned char *)ipsc->wbuf, len, flags);
+	jrpc_trace (JRPC_TRACE_MSG, ">> %.*s", (int)len,
+		    ipsc->wbuf + JRPC_FRAME_HDRLEN);
+
+	return jrpc_wbuf_send (ipsc, len);
+}
+
+ssize_t jrpc_recv_json (ipsc_t *ipsc, json_t **jp)
+{
+	char *buf = NULL;
+	ssize_t rb = 0;
+	json_t *jobj = NULL;
+	int timeout;
+	int flags = 0;
+	jrpc_runtime_t rt;
+	const jrpc_codec_t *codec;
+	jrpc_sshard_t *st;
+	int shared;
+
+	json_error_t error;
+
+	/* a server never waits for one peer, over shared memory neither */
+	if ( ipsc->flags & IPSC_FLAG_SERVER ) {
+		timeout = -1;
+		rt = ((jrpc_t *)ipsc->cb_args)->rt;
+	} else {
+		timeout = ((jrpc_req_t *)ipsc->cb_args)->conn.timeout;
+		rt = ((jrpc_req_t *)ipsc->cb_args)->rt;
+	}
+
+	if (ipsc->type == SOCK_SEQPACKET)
+		rb = jrpc_recv_packet (ipsc, &buf, timeout, &flags);
+	else if (timeout < 0)
+		rb = jrpc_recv_buffered (ipsc, &buf, &flags);
+	else if (ipsc->flags & JRPC_FLAG_FRAMED)
+		rb = jrpc_recv_frame (ipsc, &buf, timeout, &flags);
+	else
+		rb = jrpc_recv_stream (ipsc, &buf, timeout);
+
+	/* keep errno for the caller, it tells oversized requests apart */
+	if ( rb < 0 )
+	{
+		*jp = NULL;
+		return -1;
+	}
+
+	/* pipelined ones have been waiting in rbuf since */
+	if (timeout < 0 && ipsc->type != SOCK_SEQPACKET)
+		jrpc_arrived = ((jrpc_rstate_t *)ipsc->priv)->stamp;
+	else
+		jrpc_arrived = 0;
+
+	if ( rb < 2 )
+		rb = 0;
+
+	/* over a limit: turned down before any parsing, the loop goes on */
+	if (buf && rb && (ipsc->flags & IPSC_FLAG_SERVER) &&
+	    jrpc_admit (ipsc, (jrpc_t *)ipsc->cb_args))
+	{
+		jrpc_send_busy (ipsc, buf, (size_t)rb, flags);
+		if ((st = jrpc_stats_srv ((jrpc_t *)ipsc->cb_args, &shared)))
+			jrpc_stats_add (&st->busy, 1, shared);
+		errno = EBUSY;
+		rb = -1;
+		goto exit;
+	}
+
+	/* raw bytes, no second serialization just to show them */
+	codec = jrpc_codec_find (flags & JRPC_FRAME_ENC_MASK);
+	if (codec)
+		jrpc_trace (JRPC_TRACE_MSG, "<< [%s, %zi bytes]",
+			    codec->name, rb);
+	else
+		jrpc_trace (JRPC_TRACE_MSG, "<< %.*s", (int)rb,
+			    buf ? buf : "");
+
+	if (buf && codec)
+		jobj = codec->decode (buf, (size_t)rb);
+	else if (buf && !(flags & JRPC_FRAME_ENC_MASK))
+		jobj = json_loadb (buf, (size_t)rb, JSON_DISABLE_EOF_CHECK, &error);
+	if (!jobj)
+	{
+		if (buf && rb && (ipsc->flags & IPSC_FLAG_SERVER) &&
+		    (st = jrpc_stats_srv ((jrpc_t *)ipsc->cb_args, &shared)))
+			jrpc_stats_add (&st->parse_errors, 1, shared);
+		errno = EBADMSG;
+		rb = -1;
+	}
+	else
+	{
+		jrpc_codec_seen (ipsc, &rt, flags);
+	}
+
+#ifdef DEBUG
+	//////////////////////////////////////
+
+	char *tmp;
+	tmp = json_dumps (jobj, JSON_INDENT(2));
+	if (tmp == NULL) 
+	{
+	}
+	else 
+	{
+		_dbg ("JRPC", "<< \n%s\n", tmp);
+		free (tmp);
+	}
+
+	//////////////////////////////////////
+#endif
+
+exit:
+	/* the buffer stays with the connection for the next message */
+	if (timeout < 0 && ipsc->type != SOCK_SEQPACKET)
+		jrpc_rbuf_consumed (ipsc, rb > 0 ? rb : 0);
+	else
+	{
+		ipsc->rlen = 0;
+		ipsc_rbuf_trim (ipsc, rb > 0 ? rb : 0);
+	}
+
+	*jp = jobj;
+	return rb;
+}
+
+/* FNV-1a */
+static uint32_t jrpc_hash (const char *name, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len--)
+	{
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static jrpc_mstats_t *jrpc_mstats_new (int nshards)
+{
+	void *p;
+	size_t size = sizeof (jrpc_mstats_t) + nshards * sizeof (jrpc_mshard_t);
+
+	if (posix_memalign (&p, 64, size))
+		return NULL;
+	memset (p, 0, size);
+
+	return (jrpc_mstats_t *)p;
+}
+
+static jrpc_mslot_t *jrpc_index_slot (jrpc_index_t *index, const char *name,
+				      size_t len, uint32_t hash)
+{
+	size_t i;
+	size_t mask = index->size - 1;
+	jrpc_mslot_t *slot;
+	jrpc_mslot_t *dead = NULL;
+
+	for (i = hash & mask; ; i = (i + 1) & mask)
+	{
+		slot = &index->slots[i];
+		if (!slot->name)
+			return dead ? dead : slot;
+		if (slot->name == JRPC_SLOT_DEAD)
+		{
+			if (!dead)
+				dead = slot;
+			continue;
+		}
+		if (slot->hash == hash && slot->len == len &&
+		    !memcmp (slot->name, name, len))
+			return slot;
+	}
+}
+
+static int jrpc_index_grow (jrpc_index_t *index)
+{
+	size_t i;
+	size_t size = index->size;
+	jrpc_mslot_t *old = index->slots;
+	jrpc_mslot_t *slot;
+
+	/* keep the load under a half, counting removed slots as well */
+	if ((index->used + index->dead + 1) * 2 <= index->size)
+		return 0;
+
+	/* rehash, doubling only if live entries alone need it */
+	if ((index->used + 1) * 4 > size)
+		size *= 2;
+
+	index->slots = (jrpc_mslot_t *)calloc (size, sizeof *index->slots);
+	if (!index->slots)
+	{
+		index->slots = old;
+		return -1;
+	}
+
+	for (i = 0; i < index->size; i++)
+	{
+		if (!old[i].name || old[i].name == JRPC_SLOT_DEAD)
+			continue;
+		slot = &index->slots[old[i].hash & (size - 1)];
+		while (slot->name)
+		{
+			if (++slot == index->slots + size)
+				slot = index->slots;
+		}
+		*slot = old[i];
+	}
+
+	index->size = size;
+	index->dead = 0;
+	free (old);
+
+	return 0;
+}
+
+/* smallest whole number >= d, held to what json_int_t can take */
+static json_int_t jrpc_int_ceil (double d)
+{
+	json_int_t i;
+
+	if (d <= (double)JRPC_INT_MIN)
+		return JRPC_INT_MIN;
+	if (d >= (double)JRPC_INT_MAX)
+		return JRPC_INT_MAX;
+	i = (json_int_t)d;
+	return (double)i < d ? i + 1 : i;
+}
+
+/* largest whole number <= d, likewise */
+static json_int_t jrpc_int_floor (double d)
+{
+	json_int_t i;
+
+	if (d <= (double)JRPC_INT_MIN)
+		return JRPC_INT_MIN;
+	if (d >= (double)JRPC_INT_MAX)
+		return JRPC_INT_MAX;
+	i = (json_int_t)d;
+	return (double)i > d ? i - 1 : i;
+}
+
+/* a length bound, negative ones are 0 */
+static size_t jrpc_len_bound (double d)
+{
+	if (d <= 0)
+		return 0;
+	if (d >= (double)SIZE_MAX)
+		return SIZE_MAX;
+	return (size_t)d;
+}
+
+/* NULL - the spec makes no sense, errno EINVAL */
+static jrpc_plan_t *jrpc_plan_new (const jrpc_param_t *spec)
+{
+	int i;
+	int j;
+	int n;
+	const jrpc_param_t *p;
+	jrpc_pstep_t *step;
+	jrpc_plan_t *plan;
+
+	for (n = 0; spec[n].name; n++)
+		;
+	if (n > JRPC_PARAMS_MAX)
+		goto inval;
+
+	/* by name the second one could never be told apart */
+	for (i = 0; i < n; i++)
+		for (j = 0; j < i; j++)
+			if (!strcmp (spec[i].name, spec[j].name))
+				goto inval;
+
+	plan = (jrpc_plan_t *)calloc (1, sizeof *plan + n * sizeof *plan->step);
+	if (!plan)
+		return NULL;
+	plan->n = n;
+
+	for (i = 0; i < n; i++)
+	{
+		p    = &spec[i];
+		step = &plan->step[i];
+		/* NaN fails the !(min <= max) as well */
+		if (p->type < JRPC_PARAM_ANY || p->type > JRPC_PARAM_OBJECT ||
+		    ((p->flags & JRPC_PARAM_FLAG_BOUNDED) &&
+		     (!(p->min <= p->max) || p->type == JRPC_PARAM_ANY ||
+		      p->type == JRPC_PARAM_BOOL)))
+		{
+			free (plan);
+			goto inval;
+		}
+
+		step->name     = p->name;
+		step->type     = p->type;
+		step->optional = p->flags & JRPC_PARAM_FLAG_OPTIONAL;
+		step->bounded  = p->flags & JRPC_PARAM_FLAG_BOUNDED;
+		if (!step->bounded)
+			continue;
+
+		switch (p->type)
+		{
+		case JRPC_PARAM_INT:
+			/* whole numbers inside [min, max], no rounding per call */
+			step->imin = jrpc_int_ceil (p->min);
+			step->imax = jrpc_int_floor (p->max);
+			break;
+		case JRPC_PARAM_REAL:
+			step->dmin = p->min;
+			step->dmax = p->max;
+			break;
+		default:
+			step->lmin = jrpc_len_bound (p->min);
+			step->lmax = jrpc_len_bound (p->max);
+			break;
+		}
+	}
+
+	return plan;
+
+inval:
+	errno = EINVAL;
+	return NULL;
+}
+
+static int jrpc_plan_arg (const jrpc_pstep_t *step, json_t *jv,
+			  jrpc_arg_t *arg)
+{
+	arg->j = jv;
+
+	switch (step->type)
+	{
+	case JRPC_PARAM_INT:
+		if (!json_is_integer (jv))
+			return -1;
+		arg->v.i = json_integer_value (jv);
+		if (step->bounded &&
+		    (arg->v.i < step->imin || arg->v.i > step->imax))
+			return -1;
+		break;
+	case JRPC_PARAM_REAL:
+		if (!json_is_number (jv))
+			return -1;
+		arg->v.d = json_number_value (jv);
+		if (step->bounded &&
+		    (arg->v.d < step->dmin || arg->v.d > step->dmax))
+			return -1;
+		break;
+	case JRPC_PARAM_BOOL:
+		if (!json_is_boolean (jv))
+			return -1;
+		arg->v.i = json_is_true (jv);
+		break;
+	case JRPC_PARAM_STRING:
+		if (!json_is_string (jv))
+			return -1;
+		arg->v.s = json_string_value (jv);
+		arg->len = json_string_length (jv);
+		break;
+	case JRPC_PARAM_ARRAY:
+		if (!json_is_array (jv))
+			return -1;
+		arg->len = json_array_size (jv);
+		break;
+	case JRPC_PARAM_OBJECT:
+		if (!json_is_object (jv))
+			return -1;
+		arg->len = json_object_size (jv);
+		break;
+	default:
+		break;
+	}
+
+	if (step->bounded && step->type >= JRPC_PARAM_STRING &&
+	    (arg->len < step->lmin || arg->len > step->lmax))
+		return -1;
+
+	arg->set = 1;
+	return 0;
+}
+
+/* check jparams and pull the values out into args, -1 - invalid params */
+static int jrpc_plan_run (const jrpc_plan_t *plan, json_t *jparams,
+			  jrpc_arg_t *args)
+{
+	int i;
+	size_t found = 0;
+	json_t *jv;
+	const jrpc_pstep_t *step;
+
+	if (jparams && !json_is_object (jparams) &&
+	    (!json_is_array (jparams) ||
+	     json_array_size (jparams) > (size_t)plan->n))
+		return -1;
+
+	for (i = 0; i < plan->n; i++)
+	{
+		step = &plan->step[i];
+		memset (&args[i], 0, sizeof args[i]);
+
+		if (!jparams)
+			jv = NULL;
+		else if (json_is_array (jparams))
+			jv = json_array_get (jparams, i);
+		else if ((jv = json_object_get (jparams, step->name)))
+			found++;
+
+		/* null stands in for a left out optional one */
+		if (!jv || (json_is_null (jv) && step->type != JRPC_PARAM_ANY))
+		{
+			if (!step->optional)
+				return -1;
+			continue;
+		}
+
+		if (jrpc_plan_arg (step, jv, &args[i]))
+			return -1;
+	}
+
+	/* names that aren't in the spec */
+	if (json_is_object (jparams) && json_object_size (jparams) > found)
+		return -1;
+
+	return 0;
+}
+
+/* insert or replace, takes a private copy of the name */
+static int jrpc_index_set (jrpc_index_t *index, const jrpc_method_t *m,
+			   int replace)
+{
+	size_t len = strlen (m->name);
+	uint32_t hash = jrpc_hash (m->name, len);
+	jrpc_mslot_t *slot;
+	jrpc_plan_t *plan = NULL;
+
+	if (m->spec && !(plan = jrpc_plan_new (m->spec)))
+	{
+		syslog (LOG_WARNING, "jrpc_method(%s): bad params spec", m->name);
+		return -1;
+	}
+
+	if (jrpc_index_grow (index))
+	{
+		free (plan);
+		return -1;
+	}
+
+	slot = jrpc_index_slot (index, m->name, len, hash);
+	if (slot->name && slot->name != JRPC_SLOT_DEAD)
+	{
+		if (!replace)
+		{
+			free (plan);
+			return 0;
+		}
+		/* a loop may still be checking a call against the old one */
+		if (slot->plan)
+		{
+			slot->plan->next = index->plans;
+			index->plans = slot->plan;
+		}
+		slot->m = *m;
+		slot->m.name = slot->name;
+		slot->plan = plan;
+		return 0;
+	}
+
+	if (slot->name == JRPC_SLOT_DEAD)
+		index->dead--;
+
+	slot->name = strdup (m->name);
+	if (!slot->name)
+	{
+		free (plan);
+		return -1;
+	}
+	if (index->nshards && !(slot->stats = jrpc_mstats_new (index->nshards)))
+	{
+		free (slot->name);
+		slot->name = NULL;
+		free (plan);
+		return -1;
+	}
+	slot->len  = len;
+	slot->hash = hash;
+	slot->m    = *m;
+	slot->m.name = slot->name;
+	slot->plan = plan;
+	index->used++;
+
+	return 0;
+}
+
+static void jrpc_index_free (jrpc_index_t *index)
+{
+	size_t i;
+	jrpc_mstats_t *ms;
+	jrpc_plan_t *plan;
+
+	if (!index)
+		return;
+
+	for (i = 0; i < index->size; i++)
+	{
+		if (index->slots[i].name != JRPC_SLOT_DEAD)
+		{
+			free (index->slots[i].name);
+			free (index->slots[i].plan);
+			free (index->slots[i].stats);
+		}
+	}
+
+	while ((ms = index->retired))
+	{
+		index->retired = ms->next;
+		free (ms);
+	}
+
+	while ((plan = index->plans))
+	{
+		index->plans = plan->next;
+		free (plan);
+	}
+
+	pthread_rwlock_destroy (&index->lock);
+	free (index->slots);
+	free (index);
+}
+
+static ssize_t jrpc_stats_method (ipsc_t *ipsc, json_t *jparams, json_t *jid);
+
+static jrpc_cb_t jrpc_stats_cbs[] = { jrpc_stats_method, NULL };
+
+static const jrpc_method_t jrpc_stats_def = {
+	(char *)JRPC_STATS_NAME, JRPC_CB_OPT_PARAMS, jrpc_stats_cbs, 0, 0,
+	NULL, NULL
+};
+
+static jrpc_index_t *jrpc_index_new (jrpc_method_t *methods, int nshards,
+				     int stats)
+{
+	int i;
+	jrpc_index_t *index = (jrpc_index_t *)calloc (1, sizeof *index);
+
+	if (!index)
+		return NULL;
+
+	pthread_rwlock_init (&index->lock, NULL);
+	index->nshards = nshards;
+	index->size  = JRPC_INDEX_MINSIZE;
+	index->slots = (jrpc_mslot_t *)calloc (index->size, sizeof *index->slots);
+	if (!index->slots)
+	{
+		free (index);
+		return NULL;
+	}
+
+	/* first definition wins, same as the linear scan did */
+	for (i = 0; methods && methods[i].name; i++)
+	{
+		if (jrpc_index_set (index, &methods[i], 0))
+		{
+			jrpc_index_free (index);
+			return NULL;
+		}
+	}
+
+	/* reserved, but a method of the same name still wins */
+	if ((stats & JRPC_STATS_METHOD) &&
+	    jrpc_index_set (index, &jrpc_stats_def, 0))
+	{
+		jrpc_index_free (index);
+		return NULL;
+	}
+
+	return index;
+}
+
+/*
+ * copies the method out, the slot may change once the lock is dropped;
+ * counters and plan stay around until the index goes
+ */
+static int jrpc_index_find (jrpc_index_t *index, const char *name, size_t len,
+			    jrpc_method_t *m, jrpc_mstats_t **ms,
+			    const jrpc_plan_t **plan)
+{
+	int ret = -1;
+	jrpc_mslot_t *slot;
+
+	pthread_rwlock_rdlock (&index->lock);
+	slot = jrpc_index_slot (index, name, len, jrpc_hash (name, len));
+	if (slot->name && slot->name != JRPC_SLOT_DEAD)
+	{
+		*m  = slot->m;
+		if (ms)
+			*ms = slot->stats;
+		if (plan)
+			*plan = slot->plan;
+		ret = 0;
+	}
+	pthread_rwlock_unlock (&index->lock);
+
+	return ret;
+}
+
+static int jrpc_method_lookup (jrpc_t *jrpc, const char *name, size_t len,
+			       jrpc_method_t *m, jrpc_mstats_t **ms,
+			       const jrpc_plan_t **plan)
+{
+	int i;
+
+	if (jrpc->srv && jrpc->srv->index)
+		return jrpc_index_find (jrpc->srv->index, name, len, m, ms,
+					plan);
+
+	/* jrpc_process() driven by somebody else's loop, no index */
+	for (i = 0; jrpc->methods && jrpc->methods[i].name; i++)
+	{
+		if (strlen (jrpc->methods[i].name) == len &&
+		    !memcmp (jrpc->methods[i].name, name, len))
+		{
+			*m = jrpc->methods[i];
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int jrpc_method_find (jrpc_t *jrpc, const char *name, size_t len,
+		      jrpc_method_t *m)
+{
+	int ret;
+
+	if (!jrpc || !name || !m)
+		return -1;
+
+	pthread_rwlock_rdlock (&jrpc_srv_lock);
+	ret = jrpc_method_lookup (jrpc, name, len, m, NULL, NULL);
+	pthread_rwlock_unlock (&jrpc_srv_lock);
+
+	return ret;
+}
+
+int jrpc_method_add (jrpc_t *jrpc, const jrpc_method_t *m)
+{
+	int ret = -1;
+	jrpc_index_t *index;
+
+	if (!jrpc || !m || !m->name)
+		return -1;
+
+	pthread_rwlock_rdlock (&jrpc_srv_lock);
+	if (jrpc->srv && (index = jrpc->srv->index))
+	{
+		pthread_rwlock_wrlock (&index->lock);
+		ret = jrpc_index_set (index, m, 1);
+		pthread_rwlock_unlock (&index->lock);
+	}
+	pthread_rwlock_unlock (&jrpc_srv_lock);
+
+	/* a replaced method may answer differently */
+	if (!ret)
+		jrpc_cache_invalidate (jrpc, m->name, NULL);
+
+	return ret;
+}
+
+int jrpc_method_remove (jrpc_t *jrpc, const char *name)
+{
+	int ret = -1;
+	size_t len;
+	jrpc_index_t *index;
+	jrpc_mslot_t *slot;
+
+	if (!jrpc || !name)
+		return -1;
+
+	len = strlen (name);
+
+	pthread_rwlock_rdlock (&jrpc_srv_lock);
+	if (jrpc->srv && (index = jrpc->srv->index))
+	{
+		pthread_rwlock_wrlock (&index->lock);
+		slot = jrpc_index_slot (index, name, len, jrpc_hash (name, len));
+		if (slot->name && slot->name != JRPC_SLOT_DEAD)
+		{
+			/* a loop may still be counting the call it runs */
+			if (slot->stats)
+			{
+				slot->stats->next = index->retired;
+				index->retired = slot->stats;
+				slot->stats = NULL;
+			}
+			/* or checking one against its plan */
+			if (slot->plan)
+			{
+				slot->plan->next = index->plans;
+				index->plans = slot->plan;
+				slot->plan = NULL;
+			}
+			free (slot->name);
+			slot->name = JRPC_SLOT_DEAD;
+			index->used--;
+			index->dead++;
+			ret = 0;
+		}
+		pthread_rwlock_unlock (&index->lock);
+	}
+	pthread_rwlock_unlock (&jrpc_srv_lock);
+
+	if (!ret)
+		jrpc_cache_invalidate (jrpc, name, NULL);
+
+	return ret;
+}
+
+/*
+ * Result cache. A chained hash table per stripe, each with its own lock,
+ * LRU list and share of jrpc_t.cache_max. Entries keep the result
+ * serialized, jrpc_cache_send() wraps it into a reply for any id.
+ */
+#define JRPC_CACHE_STRIPES	16
+#define JRPC_CACHE_MINBUCKETS	16
+
+/* method, '\0', then params dumped with sorted keys */
+typedef struct jrpc_ckey_t {
+	struct jrpc_cache_t *cache;
+	uint64_t gen;		/* cache generation the call started in */
+	int ms;			/* jrpc_method_t.cache_ms */
+	uint32_t hash;
+	size_t len;
+	char key[];
+} jrpc_ckey_t;
+
+typedef struct jrpc_centry_t {
+	struct jrpc_centry_t *hnext;	/* bucket chain */
+	struct jrpc_centry_t *prev;	/* LRU list, most recent first */
+	struct jrpc_centry_t *next;
+	uint32_t hash;
+	int refs;		/* the table's and those of senders */
+	uint64_t expires;	/* ns, CLOCK_MONOTONIC */
+	size_t size;		/* charged against the stripe */
+	size_t klen;
+	size_t len;		/* result, behind the key */
+	char data[];
+} jrpc_centry_t;
+
+typedef struct jrpc_cstripe_t {
+	pthread_mutex_t lock;
+	jrpc_centry_t **buckets;
+	size_t nbuckets;	/* power of two, 0 - none yet */
+	size_t count;
+	size_t bytes;
+	jrpc_centry_t *head;
+	jrpc_centry_t *tail;	/* evicted first */
+} __attribute__((aligned(64))) jrpc_cstripe_t;
+
+typedef struct jrpc_cache_t {
+	jrpc_cstripe_t stripe[JRPC_CACHE_STRIPES];
+	size_t max;		/* bytes per stripe */
+	uint64_t gen;		/* bumped by every invalidation */
+} jrpc_cache_t;
+
+/* json_dump_callback() sink growing a malloc()ed buffer */
+typedef struct jrpc_sbuf_t {
+	char *p;
+	size_t len;
+	size_t size;
+} jrpc_sbuf_t;
+
+static int jrpc_sbuf_write (const char *buf, size_t size, void *data)
+{
+	jrpc_sbuf_t *sb = (jrpc_sbuf_t *)data;
+	size_t n = sb->size * 2;
+	char *p;
+
+	if (sb->len + size > sb->size)
+	{
+		if (n < sb->len + size)
+			n = sb->len + size;
+		if (!(p = (char *)realloc (sb->p, n)))
+			return -1;
+		sb->p    = p;
+		sb->size = n;
+	}
+
+	memcpy (sb->p + sb->len, buf, size);
+	sb->len += size;
+	return 0;
+}
+
+static jrpc_cache_t *jrpc_cache_new (size_t max)
+{
+	int i;
+	jrpc_cache_t *cache;
+
+	if (posix_memalign ((void **)&cache, 64, sizeof *cache))
+		return NULL;
+	memset (cache, 0, sizeof *cache);
+
+	cache->max = max / JRPC_CACHE_STRIPES;
+	for (i = 0; i < JRPC_CACHE_STRIPES; i++)
+		pthread_mutex_init (&cache->stripe[i].lock, NULL);
+
+	return cache;
+}
+
+static void jrpc_centry_unref (jrpc_centry_t *ce)
+{
+	if (ce && !__atomic_sub_fetch (&ce->refs, 1, __ATOMIC_ACQ_REL))
+		free (ce);
+}
+
+static jrpc_cstripe_t *jrpc_cache_stripe (jrpc_cache_t *cache, uint32_t hash)
+{
+	return &cache->stripe[(hash >> 24) % JRPC_CACHE_STRIPES];
+}
+
+static void jrpc_cache_lru_del (jrpc_cstripe_t *st, jrpc_centry_t *ce)
+{
+	if (ce->prev)
+		ce->prev->next = ce->next;
+	else
+		st->head = ce->next;
+	if (ce->next)
+		ce->next->prev = ce->prev;
+	else
+		st->tail = ce->prev;
+}
+
+static void jrpc_cache_lru_push (jrpc_cstripe_t *st, jrpc_centry_t *ce)
+{
+	ce->prev = NULL;
+	ce->next = st->head;
+	if (st->head)
+		st->head->prev = ce;
+	else
+		st->tail = ce;
+	st->head = ce;
+}
+
+/* out of the table, senders holding it still get to finish */
+static void jrpc_cache_unlink (jrpc_cstripe_t *st, jrpc_centry_t *ce)
+{
+	jrpc_centry_t **pp = &st->buckets[ce->hash & (st->nbuckets - 1)];
+
+	while (*pp != ce)
+		pp = &(*pp)->hnext;
+	*pp = ce->hnext;
+	jrpc_cache_lru_del (st, ce);
+
+	st->count--;
+	st->bytes -= ce->size;
+	jrpc_centry_unref (ce);
+}
+
+static int jrpc_cache_grow (jrpc_cstripe_t *st)
+{
+	size_t i;
+	size_t n = st->nbuckets ? st->nbuckets * 2 : JRPC_CACHE_MINBUCKETS;
+	jrpc_centry_t **buckets;
+	jrpc_centry_t *ce;
+	jrpc_centry_t *next;
+
+	buckets = (jrpc_centry_t **)calloc (n, sizeof *buckets);
+	if (!buckets)
+		return -1;
+
+	for (i = 0; i < st->nbuckets; i++)
+	{
+		for (ce = st->buckets[i]; ce; ce = next)
+		{
+			next = ce->hnext;
+			ce->hnext = buckets[ce->hash & (n - 1)];
+			buckets[ce->hash & (n - 1)] = ce;
+		}
+	}
+
+	free (st->buckets);
+	st->buckets  = buckets;
+	st->nbuckets = n;
+	return 0;
+}
+
+static jrpc_centry_t *jrpc_cache_find (jrpc_cstripe_t *st, const char *key,
+				       size_t klen, uint32_t hash)
+{
+	jrpc_centry_t *ce;
+
+	if (!st->nbuckets)
+		return NULL;
+
+	for (ce = st->buckets[hash & (st->nbuckets - 1)]; ce; ce = ce->hnext)
+	{
+		if (ce->hash == hash && ce->klen == klen &&
+		    !memcmp (ce->data, key, klen))
+			return ce;
+	}
+
+	return NULL;
+}
+
+static void jrpc_cache_free (jrpc_cache_t *cache)
+{
+	int i;
+	jrpc_cstripe_t *st;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < JRPC_CACHE_STRIPES; i++)
+	{
+		st = &cache->stripe[i];
+		while (st->head)
+			jrpc_cache_unlink (st, st->head);
+		free (st->buckets);
+		pthread_mutex_destroy (&st->lock);
+	}
+	free (cache);
+}
+
+/* key of a call, NULL - params can't be serialized */
+static jrpc_ckey_t *jrpc_cache_key (jrpc_cache_t *cache, const char *method,
+				    size_t mlen, json_t *jparams, int ms)
+{
+	jrpc_sbuf_t sb;
+	jrpc_ckey_t *ck;
+
+	sb.len  = offsetof (jrpc_ckey_t, key);
+	sb.size = sb.len + mlen + 1 + 64;
+	if (!(sb.p = (char *)malloc (sb.size)))
+		return NULL;
+
+	memcpy (sb.p + sb.len, method, mlen);
+	sb.len += mlen;
+	sb.p[sb.len++] = '\0';
+
+	/* key order is up to the client, the cache shouldn't care */
+	if (jparams && json_dump_callback (jparams, jrpc_sbuf_write, &sb,
+					   JSON_COMPACT | JSON_SORT_KEYS |
+					   JSON_ENCODE_ANY))
+	{
+		free (sb.p);
+		return NULL;
+	}
+
+	ck = (jrpc_ckey_t *)sb.p;
+	ck->cache = cache;
+	ck->gen   = __atomic_load_n (&cache->gen, __ATOMIC_ACQUIRE);
+	ck->ms    = ms;
+	ck->len   = sb.len - offsetof (jrpc_ckey_t, key);
+	ck->hash  = jrpc_hash (ck->key, ck->len);
+
+	return ck;
+}
+
+/* a result for ck that is still fresh, referenced; NULL - none */
+static jrpc_centry_t *jrpc_cache_get (jrpc_ckey_t *ck)
+{
+	uint64_t now = jrpc_now_ns ();
+	jrpc_cstripe_t *st = jrpc_cache_stripe (ck->cache, ck->hash);
+	jrpc_centry_t *ce;
+
+	pthread_mutex_lock (&st->lock);
+	if ((ce = jrpc_cache_find (st, ck->key, ck->len, ck->hash)))
+	{
+		if (ce->expires <= now)
+		{
+			jrpc_cache_unlink (st, ce);
+			ce = NULL;
+		}
+		else
+		{
+			jrpc_cache_lru_del (st, ce);
+			jrpc_cache_lru_push (st, ce);
+			__atomic_add_fetch (&ce->refs, 1, __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock (&st->lock);
+
+	return ce;
+}
+
+/* keep jobj as the result for ck, the entry comes back referenced */
+static jrpc_centry_t *jrpc_cache_put (jrpc_ckey_t *ck, json_t *jobj)
+{
+	jrpc_cache_t *cache = ck->cache;
+	jrpc_cstripe_t *st = jrpc_cache_stripe (cache, ck->hash);
+	jrpc_centry_t *ce;
+	jrpc_centry_t *old;
+	jrpc_sbuf_t sb;
+
+	/* the entry is built in place, header and key first */
+	sb.len  = offsetof (jrpc_centry_t, data) + ck->len;
+	sb.size = sb.len + 256;
+	if (!(sb.p = (char *)malloc (sb.size)))
+		return NULL;
+	if (json_dump_callback (jobj, jrpc_sbuf_write, &sb,
+				JSON_COMPACT | JSON_ENCODE_ANY) ||
+	    sb.len > cache->max)
+	{
+		free (sb.p);
+		return NULL;
+	}
+	if (sb.len < sb.size && (ce = (jrpc_centry_t *)realloc (sb.p, sb.len)))
+		sb.p = (char *)ce;
+
+	ce = (jrpc_centry_t *)sb.p;
+	ce->hash    = ck->hash;
+	ce->refs    = 2;
+	ce->expires = jrpc_now_ns () + (uint64_t)ck->ms * 1000000ull;
+	ce->size    = sb.len;
+	ce->klen    = ck->len;
+	ce->len     = sb.len - offsetof (jrpc_centry_t, data) - ck->len;
+	memcpy (ce->data, ck->key, ck->len);
+
+	pthread_mutex_lock (&st->lock);
+	/* invalidated while the handlers ran, what they saw may be stale */
+	if (ck->gen != __atomic_load_n (&cache->gen, __ATOMIC_ACQUIRE) ||
+	    (st->count >= st->nbuckets && jrpc_cache_grow (st)))
+	{
+		pthread_mutex_unlock (&st->lock);
+		free (ce);
+		return NULL;
+	}
+
+	if ((old = jrpc_cache_find (st, ck->key, ck->len, ck->hash)))
+		jrpc_cache_unlink (st, old);
+	while (st->tail && st->bytes + ce->size > cache->max)
+		jrpc_cache_unlink (st, st->tail);
+
+	ce->hnext = st->buckets[ce->hash & (st->nbuckets - 1)];
+	st->buckets[ce->hash & (st->nbuckets - 1)] = ce;
+	jrpc_cache_lru_push (st, ce);
+	st->count++;
+	st->bytes += ce->size;
+	pthread_mutex_unlock (&st->lock);
+
+	return ce;
+}
+
+/* reply with a cached result, the id is all that gets serialized */
+static ssize_t jrpc_cache_send (ipsc_t *ipsc, jrpc_centry_t *ce, json_t *jid)
+{
+	size_t len;
+	int flags = 0;
+	const jrpc_codec_t *codec;
+
+	codec = (const jrpc_codec_t *)((jrpc_t *)ipsc->cb_args)->rt.bin_ctx;
+	if (codec && (ipsc->flags & JRPC_FLAG_FRAMED))
+		flags |= JRPC_FRAME_ACCEPT (codec->enc);
+
+	ipsc->wlen = JRPC_FRAME_HDRLEN;
+	if (!ipsc_wbuf_reserve (ipsc, JRPC_FRAME_HDRLEN) ||
+	    jrpc_wbuf_write (JRPC_REPLY_HEAD, strlen (JRPC_REPLY_HEAD), ipsc) ||
+#ifndef JRPC_LITE
+	    (jid ? json_dump_callback (jid, jrpc_wbuf_write, ipsc,
+				       JSON_COMPACT | JSON_ENCODE_ANY) :
+		   jrpc_wbuf_write ("null", 4, ipsc)) ||
+#endif
+	    jrpc_wbuf_write (JRPC_REPLY_RESULT, strlen (JRPC_REPLY_RESULT),
+			     ipsc) ||
+	    jrpc_wbuf_write (ce->data + ce->klen, ce->len, ipsc) ||
+	    jrpc_wbuf_write ("}", 1, ipsc))
+	{
+		ipsc->wlen = 0;
+		return JRPC_ERR_GENERIC;
+	}
+
+	len = ipsc->wlen - JRPC_FRAME_HDRLEN;
+	if (jrpc_wbuf_fits (ipsc, len))
+	{
+		syslog (LOG_WARNING, "jrpc_send_reply: result too large");
+		return jrpc_error (ipsc, jid, JRPC_CODE_INTERNAL_ERROR,
+				   JRPC_ERR_REPLY_TOO_LARGE);
+	}
+
+	jrpc_frame_pack ((unsigned char *)ipsc->wbuf, len, flags);
+	jrpc_trace (JRPC_TRACE_MSG, ">> %.*s", (int)len,
+		    ipsc->wbuf + JRPC_FRAME_HDRLEN);
+
+	return jrpc_wbuf_send (ipsc, len);
+}
+
+int jrpc_cache_invalidate (jrpc_t *jrpc, const char *method, json_t *jparams)
+{
+	int i;
+	int n = -1;
+	size_t mlen = 0;
+	jrpc_cache_t *cache;
+	jrpc_cstripe_t *st;
+	jrpc_centry_t *ce;
+	jrpc_centry_t *next;
+	jrpc_ckey_t *ck;
+
+	if (!jrpc)
+		return -1;
+
+	pthread_rwlock_rdlock (&jrpc_srv_lock);
+	if (!jrpc->srv || !(cache = jrpc->srv->cache))
+		goto exit;
+
+	/* calls running now don't put what they got in afterwards */
+	__atomic_add_fetch (&cache->gen, 1, __ATOMIC_ACQ_REL);
+	n = 0;
+
+	if (method && jparams)
+	{
+		ck = jrpc_cache_key (cache, method, strlen (method), jparams, 0);
+		if (!ck)
+		{
+			n = -1;
+			goto exit;
+		}
+		st = jrpc_cache_stripe (cache, ck->hash);
+		pthread_mutex_lock (&st->lock);
+		if ((ce = jrpc_cache_find (st, ck->key, ck->len, ck->hash)))
+		{
+			jrpc_cache_unlink (st, ce);
+			n++;
+		}
+		pthread_mutex_unlock (&st->lock);
+		free (ck);
+		goto exit;
+	}
+
+	/* the name and its terminator prefix every key of the method */
+	if (method)
+		mlen = strlen (method) + 1;
+	for (i = 0; i < JRPC_CACHE_STRIPES; i++)
+	{
+		st = &cache->stripe[i];
+		pthread_mutex_lock (&st->lock);
+		for (ce = st->head; ce; ce = next)
+		{
+			next = ce->next;
+			if (!method || (ce->klen >= mlen &&
+					!memcmp (ce->data, method, mlen)))
+			{
+				jrpc_cache_unlink (st, ce);
+				n++;
+			}
+		}
+		pthread_mutex_unlock (&st->lock);
+	}
+
+exit:
+	pthread_rwlock_unlock (&jrpc_srv_lock);
+	return n;
+}
+
+/*
+ * the first handler that returns 0 has answered, errors end the chain;
+ * args_handler is a chain of its own
+ */
+static ssize_t jrpc_call_handlers( ipsc_t *ipsc, const jrpc_method_t *m,
+				   json_t *jparams, const jrpc_arg_t *args,
+				   json_t *jid )
+{
+	int idx;
+	ssize_t sb = 0;
+
+	if (m->args_handler)
+	{
+		sb = m->args_handler (ipsc, args, jid);
+		if ( sb < 0 )
+			sb = jrpc_internal_error (ipsc, jid);
+		return sb;
+	}
+
+	for (idx = 0; m->handlers[idx]; idx++)
+	{
+		sb = m->handlers[idx] (ipsc, jparams, jid);
+		if ( sb == 0 )
+			break;
+		if ( sb < 0 ) {
+			sb = jrpc_internal_error (ipsc, jid);
+			break;
+		}
+	}
+
+	return sb;
+}
+
+/*
+ * JRPC_METHOD_FLAG_WORKER calls, run by a worker thread. Whatever the
+ * handlers send is collected and goes back to the loop serving the
+ * connection, which sends it and does the statistics.
+ */
+typedef struct jrpc_job_t {
+	struct jrpc_job_t *next;
+	jrpc_t *jrpc;
+	jrpc_srv_t *srv;
+	ipsc_t *ipsc;		/* referenced until the job is freed */
+	int loop;
+	json_t *jp;		/* the request, jparams, jid and args point into it */
+	json_t *jparams;
+	json_t *jid;
+	jrpc_method_t m;
+	jrpc_arg_t *args;
+	jrpc_mstats_t *ms;
+	size_t len;
+	int discard;
+	jrpc_ckey_t *ckey;	/* cacheable, see jrpc_ctx_t */
+	uint64_t deadline;	/* see jrpc_ctx_t */
+	int expired;		/* waited in the queue past it, not run */
+	json_t *replies;	/* collected by the worker */
+	int error;
+	int code;
+	uint64_t ns;		/* handler time */
+} jrpc_job_t;
+
+/*
+ * a worker's own queue and the place it sleeps; once it runs out it takes
+ * from the others' before going to sleep, no lock is shared by all
+ */
+typedef struct jrpc_worker_t {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	jrpc_job_t *head;
+	jrpc_job_t *tail;
+	int sleeping;		/* on cond with its queue empty */
+	pthread_t tid;
+	struct jrpc_wpool_t *pool;
+} __attribute__((aligned(64))) jrpc_worker_t;
+
+typedef struct jrpc_wpool_t {
+	int n;
+	int stop;		/* run what is queued, then exit */
+	unsigned int next;	/* queue the next job goes to */
+	jrpc_worker_t *w;
+} jrpc_wpool_t;
+
+/* the pool is started on first use, by whichever loop gets there first */
+static pthread_mutex_t jrpc_wpool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void jrpc_job_free( jrpc_job_t *job )
+{
+	free( job->ckey );
+	free( job->args );
+	json_decref( job->replies );
+	json_decref( job->jp );
+	ipsc_unref( job->ipsc );
+	free( job );
+}
+
+/* back on the loop: send what the handlers said, count the call */
+static void jrpc_job_done( void *arg )
+{
+	size_t i;
+	jrpc_job_t *job = (jrpc_job_t *)arg;
+	uint64_t sent = jrpc_sent;
+	jrpc_ctx_t ctx;
+	jrpc_sshard_t *st;
+	int shared;
+
+	__atomic_sub_fetch( &job->srv->inflight, 1, __ATOMIC_RELAXED );
+
+	for ( i = 0; i < json_array_size( job->replies ); i++ ) {
+		if ( job->ipsc->flags & IPSC_FLAG_CLOSED )
+			break;
+		if ( jrpc_send_json( job->ipsc,
+				     json_array_get( job->replies, i ) ) < 0 )
+			syslog( LOG_WARNING, "jrpc_job_done(send): %m" );
+	}
+
+	if ( job->expired && (st = jrpc_stats_srv( job->jrpc, &shared )) )
+		jrpc_stats_add( &st->expired, 1, shared );
+	else if ( job->ms ) {
+		ctx.error = job->error;
+		ctx.code  = job->code;
+		ctx.hit   = 0;
+		jrpc_stats_call( job->srv, job->ms, &ctx, job->len,
+				 jrpc_sent - sent, job->ns );
+	}
+	if ( (st = jrpc_stats_srv( job->jrpc, &shared )) )
+		jrpc_stats_add( &st->bytes_out, jrpc_sent - sent, shared );
+
+	jrpc_job_free( job );
+}
+
+static void jrpc_job_run( jrpc_job_t *job )
+{
+	uint64_t t0 = jrpc_now_ns();
+	jrpc_ctx_t ctx;
+
+	ctx.ipsc    = job->ipsc;
+	ctx.batch   = json_array();
+	ctx.discard = job->discard;
+	ctx.error   = 0;
+	ctx.code    = 0;
+	ctx.loop    = job->loop;
+	ctx.job     = job;
+	ctx.ckey    = job->ckey;
+	ctx.hit     = 0;
+	ctx.deadline = job->deadline;
+	job->ckey   = NULL;
+
+	/* the queue was long enough for the caller to give up */
+	job->expired = ctx.deadline && t0 >= ctx.deadline;
+
+	jrpc_ctx = &ctx;
+	if ( ctx.batch && !job->expired )
+		jrpc_call_handlers( job->ipsc, &job->m, job->jparams,
+				    job->args, job->jid );
+	jrpc_ctx = NULL;
+	free( ctx.ckey );
+
+	job->replies = ctx.batch;
+	job->error   = ctx.error;
+	job->code    = ctx.code;
+	job->ns      = jrpc_now_ns() - t0;
+
+	/* the server is going away, nobody left to send it */
+	if ( jrpc_server_post( job->jrpc, job->loop, jrpc_job_done, job ) )
+		jrpc_job_free( job );
+}
+
+static jrpc_job_t *jrpc_worker_take( jrpc_worker_t *w )
+{
+	jrpc_job_t *job;
+
+	pthread_mutex_lock( &w->lock );
+	if ( (job = w->head) && !(w->head = job->next) )
+		w->tail = NULL;
+	pthread_mutex_unlock( &w->lock );
+
+	return job;
+}
+
+static void *jrpc_worker_run( void *args )
+{
+	int i;
+	jrpc_worker_t *w = (jrpc_worker_t *)args;
+	jrpc_wpool_t *pool = w->pool;
+	jrpc_job_t *job;
+	int stop;
+	int n;
+
+	while ( 1 ) {
+		/* own queue first, then whoever is behind */
+		job = jrpc_worker_take( w );
+		n = __atomic_load_n( &pool->n, __ATOMIC_ACQUIRE );
+		for ( i = 1; !job && i < n; i++ )
+			job = jrpc_worker_take( &pool->w[(w - pool->w + i) %
+							 n] );
+		if ( job ) {
+			jrpc_job_run( job );
+			continue;
+		}
+
+		/* submitters see the flag under the lock, nothing gets lost */
+		pthread_mutex_lock( &w->lock );
+		while ( !w->head && !__atomic_load_n( &pool->stop,
+						      __ATOMIC_ACQUIRE ) ) {
+			__atomic_store_n( &w->sleeping, 1, __ATOMIC_RELAXED );
+			pthread_cond_wait( &w->cond, &w->lock );
+		}
+		__atomic_store_n( &w->sleeping, 0, __ATOMIC_RELAXED );
+		stop = !w->head;
+		pthread_mutex_unlock( &w->lock );
+		if ( stop )
+			break;
+	}
+
+	return NULL;
+}
+
+static void jrpc_wpool_stop( jrpc_wpool_t *pool )
+{
+	int i;
+
+	if ( !pool )
+		return;
+
+	__atomic_store_n( &pool->stop, 1, __ATOMIC_RELEASE );
+	for ( i = 0; i < pool->n; i++ ) {
+		pthread_mutex_lock( &pool->w[i].lock );
+		pthread_cond_signal( &pool->w[i].cond );
+		pthread_mutex_unlock( &pool->w[i].lock );
+	}
+
+	for ( i = 0; i < pool->n; i++ ) {
+		if ( pool->w[i].tid )
+			pthread_join( pool->w[i].tid, NULL );
+		pthread_cond_destroy( &pool->w[i].cond );
+		pthread_mutex_destroy( &pool->w[i].lock );
+	}
+
+	free( pool->w );
+	free( pool );
+}
+
+static jrpc_wpool_t *jrpc_wpool_start( jrpc_srv_t *srv )
+{
+	int i;
+	int n = srv->jrpc->workers;
+	jrpc_wpool_t *pool;
+
+	if ( n > JRPC_MAX_WORKERS )
+		n = JRPC_MAX_WORKERS;
+
+	pthread_mutex_lock( &jrpc_wpool_lock );
+	if ( (pool = srv->wpool) || n < 1 )
+		goto exit;
+
+	pool = (jrpc_wpool_t *)calloc( 1, sizeof *pool );
+	if ( !pool )
+		goto exit;
+	if ( posix_memalign( (void **)&pool->w, 64, n * sizeof *pool->w ) ) {
+		free( pool );
+		pool = NULL;
+		goto exit;
+	}
+	memset( pool->w, 0, n * sizeof *pool->w );
+	for ( i = 0; i < n; i++ ) {
+		pthread_mutex_init( &pool->w[i].lock, NULL );
+		pthread_cond_init( &pool->w[i].cond, NULL );
+		pool->w[i].pool = pool;
+	}
+
+	/* the ones running already take from the queues counted so far */
+	for ( i = 0; i < n; i++ ) {
+		__atomic_store_n( &pool->n, i + 1, __ATOMIC_RELEASE );
+		if ( pthread_create( &pool->w[i].tid, NULL, jrpc_worker_run,
+				     &pool->w[i] ) ) {
+			syslog( LOG_WARNING, "jrpc_wpool_start(thread): %m" );
+			__atomic_store_n( &pool->n, i, __ATOMIC_RELEASE );
+			break;
+		}
+	}
+	for ( ; i < n; i++ ) {
+		pthread_cond_destroy( &pool->w[i].cond );
+		pthread_mutex_destroy( &pool->w[i].lock );
+	}
+	if ( !pool->n ) {
+		jrpc_wpool_stop( pool );
+		pool = NULL;
+		goto exit;
+	}
+
+	__atomic_store_n( &srv->wpool, pool, __ATOMIC_RELEASE );
+
+exit:
+	pthread_mutex_unlock( &jrpc_wpool_lock );
+	return pool;
+}
+
+/* -1 - no pool to take it, the caller runs it inline */
+static int jrpc_job_submit( jrpc_t *jrpc, ipsc_t *ipsc, json_t *jp,
+			    json_t *jparams, json_t *jid, jrpc_method_t *m,
+			    const jrpc_arg_t *args, int nargs,
+			    jrpc_mstats_t *ms, size_t len, jrpc_ctx_t *ctx )
+{
+	jrpc_srv_t *srv = jrpc_loop_cur ? jrpc_loop_cur->srv : NULL;
+	jrpc_wpool_t *pool;
+	jrpc_worker_t *w;
+	jrpc_job_t *job;
+	int i;
+	int k;
+
+	/* only loops can have the reply come back to them */
+	if ( !srv || srv->jrpc != jrpc )
+		return -1;
+
+	pool = __atomic_load_n( &srv->wpool, __ATOMIC_ACQUIRE );
+	if ( !pool && !(pool = jrpc_wpool_start( srv )) )
+		return -1;
+
+	/* a handler on the worker may defer, see jrpc_reply_defer() */
+	if ( !jrpc_rstate( ipsc ) )
+		return -1;
+
+	job = (jrpc_job_t *)calloc( 1, sizeof *job );
+	if ( !job )
+		return -1;
+	if ( nargs &&
+	     !(job->args = (jrpc_arg_t *)malloc( nargs * sizeof *args )) ) {
+		free( job );
+		return -1;
+	}
+	if ( nargs )
+		memcpy( job->args, args, nargs * sizeof *args );
+	job->jrpc     = jrpc;
+	job->srv      = srv;
+	job->ipsc     = ipsc;
+	job->loop     = ctx->loop;
+	job->jp       = json_incref( jp );
+	job->jparams  = jparams;
+	job->jid      = jid;
+	job->m        = *m;
+	job->ms       = ms;
+	job->len      = len;
+	job->discard  = ctx->discard;
+	job->ckey     = ctx->ckey;
+	job->deadline = ctx->deadline;
+	ctx->ckey     = NULL;
+	ipsc_ref( ipsc );
+	__atomic_add_fetch( &srv->inflight, 1, __ATOMIC_RELAXED );
+
+	/* to one that sleeps if there is one, round robin otherwise */
+	i = __atomic_fetch_add( &pool->next, 1, __ATOMIC_RELAXED ) % pool->n;
+	w = &pool->w[i];
+	for ( k = 0; k < pool->n; k++ ) {
+		if ( __atomic_load_n( &pool->w[(i + k) % pool->n].sleeping,
+				      __ATOMIC_RELAXED ) ) {
+			w = &pool->w[(i + k) % pool->n];
+			break;
+		}
+	}
+
+	pthread_mutex_lock( &w->lock );
+	if ( w->tail )
+		w->tail->next = job;
+	else
+		w->head = job;
+	w->tail = job;
+	if ( w->sleeping )
+		pthread_cond_signal( &w->cond );
+	pthread_mutex_unlock( &w->lock );
+
+	return 0;
+}
+
+/*
+ * gives back the in-flight slot unless its connection did already; held
+ * is looked at again under jrpc_srv_lock, jrpc_srv_free() clears it there
+ * before srv goes away
+ */
+static void jrpc_reply_release( jrpc_reply_handle_t *h )
+{
+	if ( !__atomic_load_n( &h->held, __ATOMIC_ACQUIRE ) )
+		return;
+
+	pthread_rwlock_rdlock( &jrpc_srv_lock );
+	if ( __atomic_load_n( &h->held, __ATOMIC_ACQUIRE ) ) {
+		pthread_mutex_lock( &h->srv->dlock );
+		if ( h->held )
+			jrpc_reply_unlink( h );
+		pthread_mutex_unlock( &h->srv->dlock );
+	}
+	pthread_rwlock_unlock( &jrpc_srv_lock );
+}
+
+static void jrpc_reply_free( jrpc_reply_handle_t *h )
+{
+	jrpc_reply_release( h );
+	json_decref( h->jobj );
+	json_decref( h->jid );
+	ipsc_unref( h->ipsc );
+	free( h );
+}
+
+/* on the loop serving the connection */
+static void jrpc_reply_send( void *arg )
+{
+	jrpc_reply_handle_t *h = (jrpc_reply_handle_t *)arg;
+	jrpc_sshard_t *st;
+	int shared;
+	uint64_t sent = jrpc_sent;
+
+	jrpc_reply_release( h );
+
+	if ( !h->discard && !(h->ipsc->flags & IPSC_FLAG_CLOSED) &&
+	     jrpc_send_reply( h->ipsc, h->jobj, h->jid, h->type ) < 0 )
+		syslog( LOG_WARNING, "jrpc_reply_send: %m" );
+	if ( (st = jrpc_stats_srv( h->jrpc, &shared )) )
+		jrpc_stats_add( &st->bytes_out, jrpc_sent - sent, shared );
+
+	jrpc_reply_free( h );
+}
+
+jrpc_reply_handle_t *jrpc_reply_defer( ipsc_t *ipsc, json_t *jid )
+{
+	jrpc_ctx_t *ctx = jrpc_ctx;
+	jrpc_reply_handle_t *h;
+
+	if ( !ctx || ctx->ipsc != ipsc || ctx->loop < 0 ||
+	     (ctx->batch && !ctx->job) ) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* its teardown is what lets go of a handle never completed */
+	if ( !ctx->job && !jrpc_rstate( ipsc ) )
+		return NULL;
+
+	h = (jrpc_reply_handle_t *)calloc( 1, sizeof *h );
+	if ( !h )
+		return NULL;
+	h->jrpc    = ctx->job ? ctx->job->jrpc : (jrpc_t *)ipsc->cb_args;
+	h->srv     = ctx->job ? ctx->job->srv : jrpc_loop_cur->srv;
+	h->ipsc    = ipsc;
+	h->loop    = ctx->loop;
+	h->discard = ctx->discard;
+
+	/* a worker may get here after the connection was torn down */
+	pthread_mutex_lock( &h->srv->dlock );
+	if ( __atomic_load_n( &ipsc->sd, __ATOMIC_RELAXED ) < 0 ) {
+		pthread_mutex_unlock( &h->srv->dlock );
+		free( h );
+		errno = EPIPE;
+		return NULL;
+	}
+	if ( (h->next = h->srv->deferred) )
+		h->next->prev = h;
+	h->srv->deferred = h;
+	h->held = 1;
+	__atomic_add_fetch( &h->srv->inflight, 1, __ATOMIC_RELAXED );
+	pthread_mutex_unlock( &h->srv->dlock );
+
+	h->jid = json_incref( jid );
+	ipsc_ref( ipsc );
+
+	return h;
+}
+
+ssize_t jrpc_reply_complete( jrpc_reply_handle_t *h, json_t *jobj, int type )
+{
+	if ( !h )
+		return JRPC_ERR_GENERIC;
+
+	/* nothing to send, it still goes back so the loop counts it done */
+	h->jobj = json_incref( jobj );
+	h->type = type;
+	if ( !jobj )
+		h->discard = 1;
+	if ( jrpc_server_post( h->jrpc, h->loop, jrpc_reply_send, h ) ) {
+		jrpc_reply_free( h );
+		return JRPC_ERR_SEND;
+	}
+
+	return 0;
+}
+
+/*
+ * JRPC_KEY_TIMEOUT counts from when the request came in: -1 - it's past
+ * that already, 0 - *deadline is set, or 0 if there isn't one
+ */
+static int jrpc_deadline (json_t *jp, uint64_t *deadline)
+{
+	json_t *jtimeout = json_object_get (jp, JRPC_KEY_TIMEOUT);
+	uint64_t now;
+
+	*deadline = 0;
+	if (!json_is_integer (jtimeout) || json_integer_value (jtimeout) <= 0)
+		return 0;
+
+	now = jrpc_now_ns ();
+	*deadline = (jrpc_arrived ? jrpc_arrived : now) +
+		    (uint64_t)json_integer_value (jtimeout) * 1000000ull;
+
+	return now < *deadline ? 0 : -1;
+}
+
+long jrpc_time_left (void)
+{
+	jrpc_ctx_t *ctx = jrpc_ctx;
+	uint64_t now;
+
+	if (!ctx || !ctx->deadline)
+		return -1;
+
+	now = jrpc_now_ns ();
+	if (now >= ctx->deadline)
+		return 0;
+
+	/* rounded up, 0 only when there is really nothing left */
+	return (long)((ctx->deadline - now + 999999) / 1000000);
+}
+
+/* run a single request object, len - its size if it came on its own */
+static ssize_t jrpc_dispatch( ipsc_t *ipsc, json_t *jp, size_t len )
+{
+	ssize_t sb = 0;
+	json_t *jparams = NULL;
+	json_t *jid = NULL;
+	jrpc_t *jrpc = (jrpc_t *)ipsc->cb_args;
+	json_t *jmethod = NULL;
+	jrpc_method_t m;
+	jrpc_mstats_t *ms = NULL;
+	const jrpc_plan_t *plan = NULL;
+	jrpc_plan_t *tmp = NULL;
+	jrpc_arg_t args[JRPC_PARAMS_MAX];
+	jrpc_sshard_t *st;
+	jrpc_cache_t *cache;
+	jrpc_centry_t *ce;
+	int shared;
+	uint64_t t0 = 0;
+	uint64_t sent = jrpc_sent;
+	jrpc_ctx_t ctx;
+	jrpc_ctx_t *prev = jrpc_ctx;
+
+	json_unpack (jp, "{s?:o}", JRPC_KEY_ID, &jid);
+
+	ctx.ipsc    = ipsc;
+	ctx.batch   = prev ? prev->batch : NULL;
+	ctx.discard = 0;
+	ctx.error   = 0;
+	ctx.code    = 0;
+	ctx.loop    = jrpc_loop_index ();
+	ctx.job     = NULL;
+	ctx.ckey    = NULL;
+	ctx.hit     = 0;
+	ctx.deadline = 0;
+	jrpc_ctx = &ctx;
+
+#ifndef JRPC_LITE
+	/* check version string if we use standart fields */
+	if (jrpc_check_version (jp))
+	{
+		sb = jrpc_invalid_request (ipsc, jid);
+		goto ret;
+	}
+#endif
+
+	/* send error back if 'method' key is not found */
+	jmethod = json_object_get (jp, JRPC_KEY_METHOD);
+	if (!json_is_string (jmethod))
+	{
+		sb = jrpc_invalid_request (ipsc, jid);
+		goto ret;
+	}
+
+#ifndef JRPC_LITE
+	/* valid request without an id is a notification, never reply to it */
+	if (!jid)
+		ctx.discard = 1;
+#endif
+
+	/* the caller gave up on it already, nobody would read the reply */
+	if (jrpc_deadline (jp, &ctx.deadline))
+	{
+		if ((st = jrpc_stats_srv (jrpc, &shared)))
+			jrpc_stats_add (&st->expired, 1, shared);
+		goto ret;
+	}
+
+	if (!jrpc_method_lookup (jrpc, json_string_value (jmethod),
+				 json_string_length (jmethod), &m, &ms, &plan))
+	{
+		if (ms)
+			t0 = jrpc_now_ns ();
+
+		/* with a spec it's the spec that says what has to be there */
+		if (m.spec)
+			m.params = JRPC_CB_OPT_PARAMS;
+
+		switch ( m.params )
+		{
+		case JRPC_CB_HAS_PARAMS:
+			if (json_unpack (jp, "{s:o}", JRPC_KEY_PARAMS, &jparams))
+			{
+				sb = jrpc_invalid_params (ipsc, jid);
+				goto ret;
+			}
+			break;
+		case JRPC_CB_OPT_PARAMS:
+			if (json_unpack (jp, "{s?:o}", JRPC_KEY_PARAMS, &jparams))
+			{
+				sb = jrpc_invalid_params (ipsc, jid);
+				goto ret;
+			}
+			break;
+		case JRPC_CB_NO_PARAMS:
+		default:
+			break;
+		}
+
+		if (m.args_handler && !m.spec)
+		{
+			sb = jrpc_not_implemented (ipsc, jid);
+			goto ret;
+		}
+
+		if (!m.args_handler && !m.handlers)
+		{
+			sb = jrpc_not_implemented (ipsc, jid);
+			goto ret;
+		}
+
+		if (!m.args_handler && !m.handlers[0])
+		{
+			sb = jrpc_not_implemented (ipsc, jid);
+			goto ret;
+		}
+
+		/* no index to keep it in, compiled for this call only */
+		if (m.spec && !plan && !(plan = tmp = jrpc_plan_new (m.spec)))
+		{
+			sb = jrpc_internal_error (ipsc, jid);
+			goto ret;
+		}
+
+		/* declared params are checked before any handler sees them */
+		if (plan && jrpc_plan_run (plan, jparams, args))
+		{
+			sb = jrpc_invalid_params (ipsc, jid);
+			goto ret;
+		}
+
+		/* asked again while the last result is fresh, send that */
+		if (m.cache_ms > 0 && !ctx.batch && !ctx.discard &&
+		    jrpc->srv && (cache = jrpc->srv->cache) &&
+		    !(ipsc->flags & JRPC_FLAG_BINARY) &&
+		    (ctx.ckey = jrpc_cache_key (cache,
+						json_string_value (jmethod),
+						json_string_length (jmethod),
+						jparams, m.cache_ms)) &&
+		    (ce = jrpc_cache_get (ctx.ckey)))
+		{
+			sb = jrpc_cache_send (ipsc, ce, jid);
+			jrpc_centry_unref (ce);
+			ctx.hit = 1;
+			goto ret;
+		}
+
+		/* slow ones go to the workers, batches are answered at once */
+		if ((m.flags & JRPC_METHOD_FLAG_WORKER) && !ctx.batch &&
+		    !jrpc_job_submit (jrpc, ipsc, jp, jparams, jid, &m, args,
+				      plan ? plan->n : 0, ms, len, &ctx))
+		{
+			ms = NULL;	/* counted when the reply goes out */
+			goto ret;
+		}
+
+		sb = jrpc_call_handlers (ipsc, &m, jparams, args, jid);
+		goto ret;
+	}
+
+	/* no method defined, send standard error */
+	if ((st = jrpc_stats_srv (jrpc, &shared)))
+		jrpc_stats_add (&st->unknown, 1, shared);
+	sb = jrpc_method_not_found (ipsc, jid);
+
+ret:
+	if (ms)
+		jrpc_stats_call (jrpc->srv, ms, &ctx, len, jrpc_sent - sent,
+				 jrpc_now_ns () - t0);
+	free (ctx.ckey);
+	free (tmp);
+	jrpc_ctx = prev;
+	return sb;
+}
+
+/* run every element of a batch, send all replies back in one go */
+static ssize_t jrpc_dispatch_batch( ipsc_t *ipsc, json_t *jp )
+{
+	size_t i;
+	ssize_t sb = 0;
+	jrpc_ctx_t ctx;
+
+	if (!json_array_size (jp))
+		return jrpc_invalid_request (ipsc, NULL);
+
+	ctx.ipsc    = ipsc;
+	ctx.batch   = json_array ();
+	ctx.discard = 0;
+	ctx.error   = 0;
+	ctx.code    = 0;
+	ctx.loop    = jrpc_loop_index ();
+	ctx.job     = NULL;
+	ctx.ckey    = NULL;
+	ctx.hit     = 0;
+	ctx.deadline = 0;
+	if (!ctx.batch)
+		return jrpc_internal_error (ipsc, NULL);
+
+	jrpc_ctx = &ctx;
+	for (i = 0; i < json_array_size (jp); i++)
+		jrpc_dispatch (ipsc, json_array_get (jp, i), 0);
+	jrpc_ctx = NULL;
+
+	if (json_array_size (ctx.batch))
+		sb = jrpc_send_json (ipsc, ctx.batch);
+
+	json_decref (ctx.batch);
+	return sb;
+}
+
+/* idle - nothing complete is left, wait for the next event */
+static ssize_t jrpc_process_one( ipsc_t *ipsc, int *idle )
+{
+	ssize_t rb;
+	ssize_t sb = 0;
+	json_t *jp = NULL;
+	jrpc_sshard_t *st;
+	int shared;
+	uint64_t sent = jrpc_sent;
+
+	ipsc->flags |= IPSC_FLAG_SERVER;
+
+	rb = jrpc_recv_json (ipsc, &jp);
+	if ( rb < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+	{
+		*idle = 1;
+		return 0;
+	}
+	/* peer gone, or out of step with the framing, nobody to answer */
+	if ( rb < 0 && (errno == ECONNRESET || errno == EPROTO) )
+	{
+		jrpc_trace( JRPC_TRACE_DEBUG, "fd %i: closing: %m", ipsc->sd );
+		json_decref( jp );
+		return -1;
+	}
+	/* over a limit, jrpc_recv_json() already said so */
+	if ( rb < 0 && errno == EBUSY )
+		goto ret;
+	if ( rb < 0 && (errno == EMSGSIZE || errno == ENOBUFS) )
+	{
+		jrpc_trace( JRPC_TRACE_WARN, "fd %i: request refused: %m",
+			    ipsc->sd );
+		/* refused before buffering it, the connection stays usable */
+		if ( errno == EMSGSIZE )
+			sb = jrpc_error( ipsc, NULL, JRPC_CODE_TOO_LARGE,
+					 JRPC_ERR_TOO_LARGE );
+		else
+			sb = jrpc_error( ipsc, NULL, JRPC_CODE_INTERNAL_ERROR,
+					 JRPC_ERR_NO_MEMORY );
+		syslog( LOG_WARNING, "jrpc_process(recv): request refused" );
+		goto ret;
+	}
+	/*
+	 * out of memory, or the transport failed: nothing was consumed and
+	 * reading again fails the same way, let the connection go
+	 */
+	if ( rb < 0 && errno != EBADMSG )
+	{
+		jrpc_trace( JRPC_TRACE_WARN, "fd %i: closing: %m", ipsc->sd );
+		syslog( LOG_WARNING, "jrpc_process(recv): %m, closing" );
+		json_decref( jp );
+		return -1;
+	}
+	/* read whole, but not JSON */
+	if ( rb < 2 )
+	{
+		syslog( LOG_WARNING, "jrpc_process(recv): %m (%li)", rb );
+		sb = jrpc_parse_error( ipsc, NULL );
+		goto ret;
+	}
+
+	if (json_is_array (jp))
+		sb = jrpc_dispatch_batch (ipsc, jp);
+	else
+		sb = jrpc_dispatch (ipsc, jp, rb);
+
+ret:
+	/* unreadable messages were counted by jrpc_recv_json() */
+	if ( (st = jrpc_stats_srv( (jrpc_t *)ipsc->cb_args, &shared )) ) {
+		if ( rb >= 2 ) {
+			jrpc_stats_add( &st->requests, 1, shared );
+			jrpc_stats_add( &st->bytes_in, rb, shared );
+		}
+		jrpc_stats_add( &st->bytes_out, jrpc_sent - sent, shared );
+	}
+
+	if (sb < 0)
+		syslog (LOG_WARNING, "jrpc_process(recv|send): %m (%li)", sb);
+
+	json_decref (jp);
+
+	return sb;
+}
+
+ssize_t jrpc_process( ipsc_t *ipsc )
+{
+	ssize_t sb;
+	int idle = 0;
+
+	/*
+	 * edge triggered: serve every whole message that came in, pipelined
+	 * ones too, and leave a partial one for the next event or bell
+	 */
+	do {
+		sb = jrpc_process_one (ipsc, &idle);
+	} while ( sb >= 0 && !idle );
+
+	return sb;
+}
+
+static void jrpc_loop_run_posted( jrpc_loop_t *loop )
+{
+	jrpc_post_t *p;
+	jrpc_post_t *next;
+
+	pthread_mutex_lock( &loop->lock );
+	p = loop->head;
+	loop->head = loop->tail = NULL;
+	pthread_mutex_unlock( &loop->lock );
+
+	for ( ; p; p = next ) {
+		next = p->next;
+		p->fn( p->arg );
+		free( p );
+	}
+}
+
+/* epoll callback: posted work or a request on a client connection */
+static ssize_t jrpc_loop_event( ipsc_t *ipsc )
+{
+	if ( ipsc->flags & IPSC_FLAG_NOTIFY ) {
+		jrpc_loop_run_posted( (jrpc_loop_t *)ipsc->cb_args );
+		return 0;
+	}
+
+	return jrpc_process( ipsc );
+}
+
+static void *jrpc_loop_run( void *args )
+{
+	jrpc_loop_t *loop = (jrpc_loop_t *)args;
+	jrpc_srv_t *srv = loop->srv;
+
+	jrpc_loop_cur = loop;
+	while ( !__atomic_load_n( &srv->stop, __ATOMIC_ACQUIRE ) ) {
+		/* do we actually need to check for error here? */
+		ipsc_epoll_wait (srv->ipsc, loop->epfd, &jrpc_loop_event);
+		if ( srv->stats )
+			jrpc_stats_add( &srv->stats[loop - srv->loops].wakeups,
+					1, 0 );
+	}
+	jrpc_loop_cur = NULL;
+
+	return NULL;
+}
+
+static int jrpc_loop_init( jrpc_loop_t *loop, jrpc_srv_t *srv )
+{
+	loop->srv  = srv;
+	loop->epfd = -1;
+	pthread_mutex_init( &loop->lock, NULL );
+
+	loop->ev = ipsc_notifier();
+	if ( !loop->ev )
+		return -1;
+	loop->ev->cb_args = loop;
+
+	loop->epfd = ipsc_epoll_init (srv->ipsc);
+	if ( loop->epfd < 0 )
+		return -1;
+
+	return ipsc_epoll_newfd( loop->ev, loop->epfd );
+}
+
+static void jrpc_srv_free( jrpc_srv_t *srv )
+{
+	int i;
+	jrpc_reply_handle_t *h;
+
+	/* whatever was posted after the loops stopped still gets to run */
+	for ( i = 0; i < srv->nloops; i++ )
+		jrpc_loop_run_posted( &srv->loops[i] );
+
+	/* closes all remaining client connections as well */
+	ipsc_close( srv->ipsc );
+
+	for ( i = 0; i < srv->nloops; i++ ) {
+		if ( srv->loops[i].epfd >= 0 )
+			close( srv->loops[i].epfd );
+		ipsc_close( srv->loops[i].ev );
+		pthread_mutex_destroy( &srv->loops[i].lock );
+	}
+
+	/*
+	 * every connection let go of its deferred replies on the way; any
+	 * left are detached here, where no jrpc_reply_release() can be
+	 * half way into dlock
+	 */
+	pthread_rwlock_wrlock( &jrpc_srv_lock );
+	pthread_mutex_lock( &srv->dlock );
+	while ( (h = srv->deferred) ) {
+		jrpc_reply_unlink( h );
+		h->srv = NULL;
+	}
+	pthread_mutex_unlock( &srv->dlock );
+	pthread_rwlock_unlock( &jrpc_srv_lock );
+	pthread_mutex_destroy( &srv->dlock );
+	jrpc_index_free( srv->index );
+	jrpc_cache_free( srv->cache );
+	free( srv->stats );
+	free( srv->epfds );
+	free( srv->loops );
+	free( srv );
+}
+
+void *jrpc_server( void *args )
+{
+	if ( !args )
+		return NULL;
+
+	int i;
+	int nloops;
+	jrpc_t *jrpc = (jrpc_t *)args;
+	jrpc_srv_t *srv = NULL;
+	char addr[32];
+	ipsc_t *ipsc = ipsc_listen_addr( jrpc_conn_addr( &jrpc->conn, addr,
+							 sizeof addr ),
+					 jrpc->maxqueue,
+					 jrpc_sock_type( &jrpc->conn ),
+					 jrpc->conn.sndbuf, jrpc->conn.rcvbuf );
+
+	if ( !ipsc ) {
 		syslog( LOG_WARNING,"jrpc_server(listen): %m" );
 		_dbg ("LIBJRPC", "jrpc_server(listen): %m" );
 		return NULL;
 	}
 
-	ipsc->cb_args = args;
+	ipsc->cb_args = args;
+	ipsc_set_rlimit( ipsc, jrpc->rcvbuf_max, jrpc->rcvmem_max );
+	ipsc_set_wlimit( ipsc, jrpc->wqueue_high, jrpc->wqueue_low );
+	ipsc_set_maxconn( ipsc, jrpc->maxconn );
+
+	nloops = jrpc->loops;
+	if ( nloops < 1 )
+		nloops = 1;
+	if ( nloops > JRPC_MAX_LOOPS )
+		nloops = JRPC_MAX_LOOPS;
+	if ( nloops > 1 )
+		ipsc->flags |= IPSC_FLAG_SHARED;
+
+	srv = (jrpc_srv_t *)calloc( 1, sizeof *srv );
+	if ( !srv ) {
+		ipsc_close( ipsc );
+		return NULL;
+	}
+	srv->jrpc  = jrpc;
+	srv->ipsc  = ipsc;
+	pthread_mutex_init( &srv->dlock, NULL );
+	srv->loops = (jrpc_loop_t *)calloc( nloops, sizeof *srv->loops );
+	srv->epfds = (int *)calloc( nloops, sizeof *srv->epfds );
+	srv->index = jrpc_index_new( jrpc->methods,
+				     jrpc->stats & JRPC_STATS_ON ? nloops + 1 : 0,
+				     jrpc->stats );
+	srv->started = jrpc_now_ns();
+	if ( jrpc->cache_max )
+		srv->cache = jrpc_cache_new( jrpc->cache_max );
+	if ( jrpc->stats & JRPC_STATS_ON ) {
+		/* a cache line per shard, loops don't share them */
+		if ( posix_memalign( (void **)&srv->stats, 64,
+				     (nloops + 1) * sizeof *srv->stats ) )
+			srv->stats = NULL;
+		else
+			memset( srv->stats, 0,
+				(nloops + 1) * sizeof *srv->stats );
+	}
+	if ( !srv->loops || !srv->epfds || !srv->index ||
+	     (jrpc->cache_max && !srv->cache) ||
+	     ((jrpc->stats & JRPC_STATS_ON) && !srv->stats) ) {
+		jrpc_srv_free( srv );
+		return NULL;
+	}
+
+	/* joinable thread callback helper */
+	if ( jrpc->connreg )
+		jrpc->connreg( ipsc );
+
+	for ( i = 0; i < nloops; i++ ) {
+		srv->nloops++;
+		if ( jrpc_loop_init( &srv->loops[i], srv ) ) {
+			syslog( LOG_WARNING, "jrpc_server(create): %m (%i)",
+					srv->loops[i].epfd );
+			_dbg ("LIBJRPC", "jrpc_server(create): %m (%i)",
+					srv->loops[i].epfd );
+			jrpc_srv_free( srv );
+			return NULL;
+		}
+		srv->epfds[i] = srv->loops[i].epfd;
+	}
+
+	/* whichever loop accepts, clients are spread evenly and stay put */
+	ipsc_epoll_spread( ipsc, srv->epfds, nloops );
+
+	pthread_rwlock_wrlock( &jrpc_srv_lock );
+	jrpc->srv = srv;
+	pthread_rwlock_unlock( &jrpc_srv_lock );
+
+	/* the calling thread runs the first loop itself */
+	for ( i = 1; i < nloops; i++ ) {
+		if ( pthread_create( &srv->loops[i].tid, NULL,
+				     jrpc_loop_run, &srv->loops[i] ) ) {
+			syslog( LOG_WARNING, "jrpc_server(thread): %m" );
+			__atomic_store_n( &srv->stop, 1, __ATOMIC_RELEASE );
+			break;
+		}
+	}
+	nloops = i;
+
+	jrpc_loop_run( &srv->loops[0] );
+
+	for ( i = 1; i < nloops; i++ )
+		pthread_join( srv->loops[i].tid, NULL );
+
+	/* workers finish what they have, the replies go out below */
+	jrpc_wpool_stop( srv->wpool );
+	srv->wpool = NULL;
+
+	pthread_rwlock_wrlock( &jrpc_srv_lock );
+	jrpc->srv = NULL;
+	pthread_rwlock_unlock( &jrpc_srv_lock );
+
+	jrpc_srv_free( srv );
+	return NULL;
+}
+
+static void jrpc_srv_wake( jrpc_srv_t *srv )
+{
+	int i;
+
+	for ( i = 0; i < srv->nloops; i++ )
+		ipsc_notify( srv->loops[i].ev );
+}
+
+int jrpc_server_wake( jrpc_t *jrpc )
+{
+	int ret = -1;
+
+	if ( !jrpc )
+		return -1;
+
+	pthread_rwlock_rdlock( &jrpc_srv_lock );
+	if ( jrpc->srv ) {
+		jrpc_srv_wake( jrpc->srv );
+		ret = 0;
+	}
+	pthread_rwlock_unlock( &jrpc_srv_lock );
+
+	return ret;
+}
+
+int jrpc_server_post( jrpc_t *jrpc, int loop, jrpc_work_t fn, void *arg )
+{
+	int ret = -1;
+	jrpc_loop_t *l;
+	jrpc_post_t *p;
+
+	if ( !jrpc || !fn || loop < 0 )
+		return -1;
+
+	p = (jrpc_post_t *)malloc( sizeof *p );
+	if ( !p )
+		return -1;
+	p->next = NULL;
+	p->fn   = fn;
+	p->arg  = arg;
+
+	pthread_rwlock_rdlock( &jrpc_srv_lock );
+	if ( jrpc->srv ) {
+		l = &jrpc->srv->loops[loop % jrpc->srv->nloops];
+		pthread_mutex_lock( &l->lock );
+		if ( l->tail )
+			l->tail->next = p;
+		else
+			l->head = p;
+		l->tail = p;
+		pthread_mutex_unlock( &l->lock );
+		/* queued, it runs at the latest when the server stops */
+		if ( ipsc_notify( l->ev ) )
+			syslog( LOG_WARNING, "jrpc_server_post(notify): %m" );
+		ret = 0;
+		p = NULL;
+	}
+	pthread_rwlock_unlock( &jrpc_srv_lock );
+
+	free( p );
+	return ret;
+}
+
+int jrpc_server_stop( jrpc_t *jrpc )
+{
+	int ret = -1;
+
+	if ( !jrpc )
+		return -1;
+
+	pthread_rwlock_rdlock( &jrpc_srv_lock );
+	if ( jrpc->srv ) {
+		__atomic_store_n( &jrpc->srv->stop, 1, __ATOMIC_RELEASE );
+		jrpc_srv_wake( jrpc->srv );
+		ret = 0;
+	}
+	pthread_rwlock_unlock( &jrpc_srv_lock );
+
+	return ret;
+}
+
+#define JRPC_STATS_LOAD(p)	__atomic_load_n( &(p), __ATOMIC_RELAXED )
+
+static void jrpc_stats_merge( jrpc_method_stats_t *dst,
+			      jrpc_method_stats_t *src )
+{
+	int i;
+	int code;
+	uint64_t n;
+
+	dst->calls     += JRPC_STATS_LOAD( src->calls );
+	dst->hits      += JRPC_STATS_LOAD( src->hits );
+	dst->errors    += JRPC_STATS_LOAD( src->errors );
+	dst->bytes_in  += JRPC_STATS_LOAD( src->bytes_in );
+	dst->bytes_out += JRPC_STATS_LOAD( src->bytes_out );
+	dst->time_ns   += JRPC_STATS_LOAD( src->time_ns );
+	for ( i = 0; i < JRPC_STATS_BUCKETS; i++ )
+		dst->hist[i] += JRPC_STATS_LOAD( src->hist[i] );
+
+	for ( i = 0; i < JRPC_STATS_CODES; i++ ) {
+		n = JRPC_STATS_LOAD( src->codes[i].count );
+		if ( !n )
+			continue;
+		code = i < JRPC_STATS_CODES - 1 ?
+		       __atomic_load_n( &src->codes[i].code, __ATOMIC_ACQUIRE ) : 0;
+		jrpc_stats_code( dst, code )->count += n;
+	}
+}
+
+int jrpc_server_stats( jrpc_t *jrpc, jrpc_stats_t *st )
+{
+	int ret = -1;
+	int k;
+	size_t i;
+	jrpc_srv_t *srv;
+	jrpc_index_t *index;
+	jrpc_mslot_t *slot;
+	jrpc_method_stats_t *ms;
+
+	if ( !jrpc || !st )
+		return -1;
+
+	memset( st, 0, sizeof *st );
+
+	pthread_rwlock_rdlock( &jrpc_srv_lock );
+	srv = jrpc->srv;
+	if ( !srv || !srv->stats )
+		goto exit;
+
+	st->uptime_ms = (jrpc_now_ns() - srv->started) / 1000000;
+	st->conns     = JRPC_STATS_LOAD( srv->ipsc->nconn );
+	st->accepts   = JRPC_STATS_LOAD( srv->ipsc->naccept );
+	st->refused   = JRPC_STATS_LOAD( srv->ipsc->nrefused );
+	for ( k = 0; k <= srv->nloops; k++ ) {
+		st->wakeups      += JRPC_STATS_LOAD( srv->stats[k].wakeups );
+		st->requests     += JRPC_STATS_LOAD( srv->stats[k].requests );
+		st->parse_errors += JRPC_STATS_LOAD( srv->stats[k].parse_errors );
+		st->unknown      += JRPC_STATS_LOAD( srv->stats[k].unknown );
+		st->busy         += JRPC_STATS_LOAD( srv->stats[k].busy );
+		st->expired      += JRPC_STATS_LOAD( srv->stats[k].expired );
+		st->bytes_in     += JRPC_STATS_LOAD( srv->stats[k].bytes_in );
+		st->bytes_out    += JRPC_STATS_LOAD( srv->stats[k].bytes_out );
+	}
+
+	index = srv->index;
+	pthread_rwlock_rdlock( &index->lock );
+	st->methods = (jrpc_method_stats_t *)calloc( index->used + 1,
+						     sizeof *st->methods );
+	for ( i = 0; st->methods && i < index->size; i++ ) {
+		slot = &index->slots[i];
+		if ( !slot->name || slot->name == JRPC_SLOT_DEAD ||
+		     !slot->stats )
+			continue;
+		ms = &st->methods[st->nmethods++];
+		ms->name = strdup( slot->name );
+		for ( k = 0; k <= srv->nloops; k++ )
+			jrpc_stats_merge( ms, &slot->stats->shard[k].s );
+	}
+	pthread_rwlock_unlock( &index->lock );
+
+	if ( st->methods )
+		ret = 0;
+
+exit:
+	pthread_rwlock_unlock( &jrpc_srv_lock );
+	return ret;
+}
+
+void jrpc_stats_free( jrpc_stats_t *st )
+{
+	size_t i;
+
+	if ( !st )
+		return;
+
+	for ( i = 0; i < st->nmethods; i++ )
+		free( st->methods[i].name );
+	free( st->methods );
+	st->methods = NULL;
+	st->nmethods = 0;
+}
+
+uint64_t jrpc_stats_percentile( const jrpc_method_stats_t *ms, double p )
+{
+	int i;
+	uint64_t want;
+	uint64_t seen = 0;
+
+	if ( !ms || !ms->calls )
+		return 0;
+
+	want = (uint64_t)(p / 100.0 * ms->calls + 0.5);
+	if ( !want )
+		want = 1;
+	for ( i = 0; i < JRPC_STATS_BUCKETS - 1; i++ ) {
+		seen += ms->hist[i];
+		if ( seen >= want )
+			break;
+	}
+
+	return (uint64_t)1 << i;
+}
+
+json_t *jrpc_stats_json( const jrpc_stats_t *st )
+{
+	int i;
+	size_t k;
+	char code[16];
+	const jrpc_method_stats_t *ms;
+	json_t *jroot;
+	json_t *jmethods;
+	json_t *jm;
+	json_t *jcodes;
+	json_t *jhist;
+
+	if ( !st )
+		return NULL;
+
+	jroot = json_object();
+	json_object_set_new( jroot, "uptime_ms", json_integer( st->uptime_ms ) );
+	json_object_set_new( jroot, "connections", json_integer( st->conns ) );
+	json_object_set_new( jroot, "accepts", json_integer( st->accepts ) );
+	json_object_set_new( jroot, "refused", json_integer( st->refused ) );
+	json_object_set_new( jroot, "wakeups", json_integer( st->wakeups ) );
+	json_object_set_new( jroot, "requests", json_integer( st->requests ) );
+	json_object_set_new( jroot, "parse_errors",
+			     json_integer( st->parse_errors ) );
+	json_object_set_new( jroot, "unknown_methods",
+			     json_integer( st->unknown ) );
+	json_object_set_new( jroot, "busy", json_integer( st->busy ) );
+	json_object_set_new( jroot, "expired", json_integer( st->expired ) );
+	json_object_set_new( jroot, "bytes_in", json_integer( st->bytes_in ) );
+	json_object_set_new( jroot, "bytes_out", json_integer( st->bytes_out ) );
+
+	jmethods = json_object();
+	for ( k = 0; k < st->nmethods; k++ ) {
+		ms = &st->methods[k];
+		if ( !ms->name )
+			continue;
+
+		jcodes = json_object();
+		for ( i = 0; i < JRPC_STATS_CODES; i++ ) {
+			if ( !ms->codes[i].count )
+				continue;
+			if ( i < JRPC_STATS_CODES - 1 )
+				snprintf( code, sizeof code, "%i",
+					  ms->codes[i].code );
+			else
+				snprintf( code, sizeof code, "other" );
+			json_object_set_new( jcodes, code,
+					     json_integer( ms->codes[i].count ) );
+		}
+
+		/* bucket i counts handlers that took less than 2^i us */
+		jhist = json_array();
+		for ( i = 0; i < JRPC_STATS_BUCKETS; i++ )
+			json_array_append_new( jhist,
+					       json_integer( ms->hist[i] ) );
+
+		jm = json_object();
+		json_object_set_new( jm, "calls", json_integer( ms->calls ) );
+		json_object_set_new( jm, "cache_hits", json_integer( ms->hits ) );
+		json_object_set_new( jm, "errors", json_integer( ms->errors ) );
+		json_object_set_new( jm, "codes", jcodes );
+		json_object_set_new( jm, "bytes_in",
+				     json_integer( ms->bytes_in ) );
+		json_object_set_new( jm, "bytes_out",
+				     json_integer( ms->bytes_out ) );
+		json_object_set_new( jm, "time_us",
+				     json_integer( ms->time_ns / 1000 ) );
+		json_object_set_new( jm, "p50_us",
+				     json_integer( jrpc_stats_percentile( ms, 50 ) ) );
+		json_object_set_new( jm, "p99_us",
+				     json_integer( jrpc_stats_percentile( ms, 99 ) ) );
+		json_object_set_new( jm, "histogram", jhist );
+		json_object_set_new( jmethods, ms->name, jm );
+	}
+	json_object_set_new( jroot, "methods", jmethods );
+
+	return jroot;
+}
+
+static ssize_t jrpc_stats_method( ipsc_t *ipsc, json_t *jparams, json_t *jid )
+{
+	ssize_t sb;
+	jrpc_stats_t st;
+	json_t *jres;
+
+	if ( jrpc_server_stats( (jrpc_t *)ipsc->cb_args, &st ) )
+		return jrpc_internal_error( ipsc, jid );
+
+	jres = jrpc_stats_json( &st );
+	jrpc_stats_free( &st );
+	if ( !jres )
+		return jrpc_internal_error( ipsc, jid );
+
+	sb = jrpc_send_reply( ipsc, jres, jid, JRPC_REPLY_TYPE_RESULT );
+	json_decref( jres );
+	return sb;
+}
+
+/* idle client connections, keyed by endpoint */
+typedef struct jrpc_pool_ent_t {
+	struct jrpc_pool_ent_t *next;
+	int port;
+	int flags;
+	int transport;
+	char *addr;
+	ipsc_t *ipsc;
+} jrpc_pool_ent_t;
+
+static pthread_mutex_t jrpc_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static jrpc_pool_ent_t *jrpc_pool[JRPC_POOL_BUCKETS];
+static jrpc_pool_ent_t *jrpc_pool_free;
+
+static int jrpc_pool_match( jrpc_pool_ent_t *e, jrpc_conn_t *conn )
+{
+	if ( e->flags != conn->flags || e->transport != conn->transport )
+		return 0;
+
+	if ( e->addr || conn->addr )
+		return e->addr && conn->addr && !strcmp( e->addr, conn->addr );
+
+	return e->port == conn->port;
+}
+
+static jrpc_pool_ent_t **jrpc_pool_bucket( jrpc_conn_t *conn )
+{
+	uint32_t h = conn->addr ? jrpc_hash( conn->addr, strlen( conn->addr ) )
+				: (uint32_t)conn->port;
+
+	return &jrpc_pool[h % JRPC_POOL_BUCKETS];
+}
+
+static ipsc_t *jrpc_conn_open( jrpc_conn_t *conn )
+{
+	char addr[32];
+	ipsc_t *ipsc = ipsc_connect_addr( jrpc_conn_addr( conn, addr,
+							  sizeof addr ),
+					  jrpc_sock_type( conn ),
+					  conn->sndbuf, conn->rcvbuf );
+	jrpc_conn_t sock;
+
+	if ( !ipsc )
+		return NULL;
+
+	/* servers that don't know the rings still talk over the socket */
+	if ( conn->transport == JRPC_TRANSPORT_SHM &&
+	     ipsc_shm_open( ipsc, 0, conn->timeout ) ) {
+		syslog( LOG_INFO, "jrpc_conn_open(shm): %m, using the socket" );
+		ipsc_close( ipsc );
+		sock = *conn;
+		sock.transport = JRPC_TRANSPORT_STREAM;
+		return jrpc_conn_open( &sock );
+	}
+
+	ipsc_set_rlimit( ipsc, JRPC_FRAME_HDRLEN + JRPC_FRAME_MAXLEN + 1, 0 );
+
+	if ( (conn->flags & JRPC_CONN_FLAG_FRAMED) || ipsc->shm )
+		ipsc->flags |= JRPC_FLAG_FRAMED | JRPC_FLAG_PROBED;
+
+	return ipsc;
+}
+
+/* take an idle connection from the pool or open a new one */
+static ipsc_t *jrpc_pool_get( jrpc_conn_t *conn )
+{
+	ipsc_t *ipsc = NULL;
+	jrpc_pool_ent_t **pe;
+	jrpc_pool_ent_t *e;
+
+	pthread_mutex_lock( &jrpc_pool_lock );
+	pe = jrpc_pool_bucket( conn );
+	for ( ; (e = *pe); pe = &e->next ) {
+		if ( !jrpc_pool_match( e, conn ) )
+			continue;
+		ipsc = e->ipsc;
+		*pe = e->next;
+		free( e->addr );
+		e->addr = NULL;
+		e->next = jrpc_pool_free;
+		jrpc_pool_free = e;
+		break;
+	}
+	pthread_mutex_unlock( &jrpc_pool_lock );
+
+	if ( ipsc )
+		return ipsc;
+
+	return jrpc_conn_open( conn );
+}
+
+/* give a healthy connection back, close it if the pool is full */
+static void jrpc_pool_put( jrpc_conn_t *conn, ipsc_t *ipsc )
+{
+	int idle = 0;
+	jrpc_pool_ent_t **pe;
+	jrpc_pool_ent_t *e;
+
+	pthread_mutex_lock( &jrpc_pool_lock );
+	pe = jrpc_pool_bucket( conn );
+	for ( ; (e = *pe); pe = &e->next ) {
+		if ( jrpc_pool_match( e, conn ) )
+			idle++;
+	}
+
+	if ( idle < JRPC_POOL_MAXIDLE ) {
+		e = jrpc_pool_free;
+		if ( e )
+			jrpc_pool_free = e->next;
+		else
+			e = (jrpc_pool_ent_t *)malloc( sizeof *e );
+	} else {
+		e = NULL;
+	}
+
+	if ( e ) {
+		e->next  = NULL;
+		e->port  = conn->port;
+		e->flags = conn->flags;
+		e->transport = conn->transport;
+		e->addr  = conn->addr ? strdup( conn->addr ) : NULL;
+		e->ipsc  = ipsc;
+		if ( conn->addr && !e->addr ) {
+			e->next = jrpc_pool_free;
+			jrpc_pool_free = e;
+		} else {
+			*pe = e;
+			ipsc = NULL;
+		}
+	}
+	pthread_mutex_unlock( &jrpc_pool_lock );
+
+	ipsc_close( ipsc );
+}
+
+void jrpc_pool_flush( void )
+{
+	int i;
+	jrpc_pool_ent_t *e;
+
+	pthread_mutex_lock( &jrpc_pool_lock );
+	for ( i = 0; i < JRPC_POOL_BUCKETS; i++ ) {
+		while ( (e = jrpc_pool[i]) ) {
+			jrpc_pool[i] = e->next;
+			ipsc_close( e->ipsc );
+			free( e->addr );
+			free( e );
+		}
+	}
+	while ( (e = jrpc_pool_free) ) {
+		jrpc_pool_free = e->next;
+		free( e );
+	}
+	pthread_mutex_unlock( &jrpc_pool_lock );
+}
+
+/* conn - what it goes over, says if the server learns the timeout */
+static json_t *jrpc_request_new( jrpc_req_t *req, const jrpc_conn_t *conn )
+{
+	json_t *jroot = json_object ();
+
+#ifndef JRPC_LITE
+	jrpc_add_version (jroot, req->jid);
+#endif
+
+	json_object_set_new (jroot, JRPC_KEY_METHOD, json_string (req->method));
+	if (req->jparams)
+		json_object_set_new (jroot, JRPC_KEY_PARAMS, req->jparams);
+	if (conn && (conn->flags & JRPC_CONN_FLAG_DEADLINE) && conn->timeout > 0)
+		json_object_set_new (jroot, JRPC_KEY_TIMEOUT,
+				     json_integer (conn->timeout));
+
+	return jroot;
+}
+
+/*
+ * batch elements need an id to find their reply, number the ones without
+ * past the integer ids the caller picked so none can be taken for another;
+ * NULL - the caller's ids leave no room on either end
+ */
+static json_t *jrpc_batch_new( jrpc_req_t *reqs, int n,
+			       const jrpc_conn_t *conn )
+{
+	int i;
+	json_int_t v;
+	json_int_t min = 0;
+	json_int_t max = -1;
+	json_int_t next;
+	json_t *jroot;
+	json_t *jreq;
+
+	for (i = 0; i < n; i++)
+	{
+		if (!json_is_integer (reqs[i].jid))
+			continue;
+		v = json_integer_value (reqs[i].jid);
+		if (v > max)
+			max = v;
+		if (v < min)
+			min = v;
+	}
+
+	if (max <= JRPC_INT_MAX - n)
+		next = max + 1;
+	else if (min >= JRPC_INT_MIN + n)
+		next = min - n;
+	else
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	jroot = json_array ();
+	for (i = 0; i < n; i++)
+	{
+		jreq = jrpc_request_new (&reqs[i], conn);
+		if (!reqs[i].jid)
+			json_object_set_new (jreq, JRPC_KEY_ID,
+					     json_integer (next++));
+		json_array_append_new (jroot, jreq);
+	}
+
+	return jroot;
+}
+
+/* pick the outcome of one call out of its reply */
+static ssize_t jrpc_reply_result( jrpc_req_t *req, json_t *jp )
+{
+	ssize_t sb = JRPC_SUCCESS;
+
+	req->jres = json_copy (json_object_get (jp, JRPC_KEY_RESULT));
+	if (req->jres == NULL)
+	{
+		sb = JRPC_ERR_NORESULT;
+
+		req->jres = json_copy(json_object_get (jp, JRPC_KEY_ERROR));
+		if (req->jres == NULL)
+		{
+			sb = JRPC_ERR_USER;
+		}
+	}
+
+	req->status = sb;
+	return sb;
+}
+
+/* replies may come in any order, match them up by id */
+static ssize_t jrpc_reply_batch( jrpc_req_t *reqs, int n, json_t *jroot,
+				 json_t *jp )
+{
+	int i;
+	size_t k;
+	json_t *jrep;
+	json_t *jid;
+
+	for (i = 0; i < n; i++)
+	{
+		reqs[i].jres   = NULL;
+		reqs[i].status = JRPC_ERR_RECV;
+	}
+
+	/* whole batch rejected, e.g. by a server not knowing batches */
+	if (!json_is_array (jp))
+	{
+		for (i = 0; i < n; i++)
+			jrpc_reply_result (&reqs[i], jp);
+		return JRPC_ERR_NORESULT;
+	}
+
+	for (k = 0; k < json_array_size (jp); k++)
+	{
+		jrep = json_array_get (jp, k);
+		jid  = json_object_get (jrep, JRPC_KEY_ID);
+
+		for (i = 0; i < n; i++)
+		{
+			if (reqs[i].status != JRPC_ERR_RECV)
+				continue;
+			/* no ids at all (JRPC_LITE peers), go by position */
+			if (!jid || json_equal (jid, json_object_get (
+					json_array_get (jroot, i), JRPC_KEY_ID)))
+				break;
+		}
+
+		if (i < n)
+			jrpc_reply_result (&reqs[i], jrep);
+	}
+
+	return JRPC_SUCCESS;
+}
+
+/* one exchange over an already connected socket, jroot is a call or a batch */
+static ssize_t jrpc_transact( ipsc_t *ipsc, jrpc_req_t *reqs, int n,
+			      json_t *jroot )
+{
+	ssize_t sb = 0;
+	ssize_t rb = 0;
+	json_t *jp = NULL;
+
+	/* send request */
+	ipsc->cb_args = (void *)reqs;
+	sb = jrpc_send_json (ipsc, jroot);
+	if ( sb < 2 ) {
+		return JRPC_ERR_SEND;
+	}
+
+	/* get reply */
+	rb = jrpc_recv_json (ipsc, &jp);
+	if ( rb < 2 ) {
+		syslog(LOG_WARNING, "jrpc_process(recv): %m (%li)", rb);
+//		_dbg ("LIBJRPC", "jrpc_process(recv): %m (%li)", rb);
+		json_decref (jp);
+		return JRPC_ERR_RECV;
+	}
+
+	if (json_is_array (jroot))
+		sb = jrpc_reply_batch (reqs, n, jroot, jp);
+	else
+		sb = jrpc_reply_result (reqs, jp);
+
+	json_decref (jp);
+	return sb;
+}
+
+/* peer went away while the connection sat idle, worth one more try */
+static int jrpc_conn_stale( ssize_t sb )
+{
+	return sb == JRPC_ERR_SEND && (errno == EPIPE || errno == ECONNRESET);
+}
+
+/* one-shot or pooled connection, as conn->flags say */
+static ssize_t jrpc_call( jrpc_conn_t *conn, jrpc_req_t *reqs, int n,
+			  json_t *jroot )
+{
+	ssize_t sb = 0;
+	int pooled = conn->flags & JRPC_CONN_FLAG_POOL;
+	ipsc_t *ipsc = NULL;
+
+	if ( pooled )
+		ipsc = jrpc_pool_get( conn );
+	else
+		ipsc = jrpc_conn_open( conn );
+	if ( !ipsc )
+		return JRPC_ERR_GENERIC;
+
+	sb = jrpc_transact (ipsc, reqs, n, jroot);
+	if ( pooled && jrpc_conn_stale( sb ) ) {
+		ipsc_close (ipsc);
+		ipsc = jrpc_conn_open( conn );
+		if ( ipsc )
+			sb = jrpc_transact (ipsc, reqs, n, jroot);
+	}
+
+	/* only a connection with a complete exchange behind it can be reused */
+	if ( pooled && ipsc && sb != JRPC_ERR_SEND && sb != JRPC_ERR_RECV )
+		jrpc_pool_put( conn, ipsc );
+	else
+		ipsc_close (ipsc);
+
+	return sb;
+}
+
+ssize_t jrpc_request( jrpc_req_t *req )
+{
+	if ( !req || !req->method )
+		return JRPC_ERR_GENERIC;
+
+	ssize_t sb = 0;
+	json_t *jroot = NULL;
+
+	jroot = jrpc_request_new (req, &req->conn);
+	sb = jrpc_call (&req->conn, req, 1, jroot);
+	json_decref (jroot);
+
+	return sb;
+}
+
+ssize_t jrpc_request_batch( jrpc_req_t *reqs, int n )
+{
+	int i;
+	ssize_t sb = 0;
+	json_t *jroot = NULL;
+
+	if ( !reqs || n < 1 )
+		return JRPC_ERR_GENERIC;
+
+	for ( i = 0; i < n; i++ ) {
+		if ( !reqs[i].method )
+			return JRPC_ERR_GENERIC;
+	}
+
+	jroot = jrpc_batch_new (reqs, n, &reqs[0].conn);
+	if ( !jroot )
+		return JRPC_ERR_GENERIC;
+	sb = jrpc_call (&reqs[0].conn, reqs, n, jroot);
+	json_decref (jroot);
+
+	return sb;
+}
+
+/* envelope without an id, the server won't answer it */
+static json_t *jrpc_notification_new( jrpc_req_t *req )
+{
+	json_t *jroot = jrpc_request_new (req, NULL);
+
+	json_object_del (jroot, JRPC_KEY_ID);
+	return jroot;
+}
+
+ssize_t jrpc_notify( jrpc_req_t *req )
+{
+	if ( !req || !req->method )
+		return JRPC_ERR_GENERIC;
+
+	ssize_t sb = 0;
+	/* unframed peers can't tell back to back messages apart */
+	int pooled = (req->conn.flags & JRPC_CONN_FLAG_POOL) &&
+		     (req->conn.flags & JRPC_CONN_FLAG_FRAMED);
+	json_t *jroot = NULL;
+	ipsc_t *ipsc = NULL;
+
+	jroot = jrpc_notification_new (req);
+
+	if ( pooled )
+		ipsc = jrpc_pool_get( &req->conn );
+	else
+		ipsc = jrpc_conn_open( &req->conn );
+	if ( !ipsc ) {
+		json_decref (jroot);
+		return JRPC_ERR_GENERIC;
+	}
+
+	ipsc->cb_args = (void *)req;
+	sb = jrpc_send_json (ipsc, jroot) < 2 ? JRPC_ERR_SEND : JRPC_SUCCESS;
+	if ( pooled && jrpc_conn_stale( sb ) ) {
+		ipsc_close (ipsc);
+		ipsc = jrpc_conn_open( &req->conn );
+		if ( ipsc ) {
+			ipsc->cb_args = (void *)req;
+			sb = jrpc_send_json (ipsc, jroot) < 2 ?
+				JRPC_ERR_SEND : JRPC_SUCCESS;
+		}
+	}
 
-	/* joinable thread callback helper */
-	if ( jrpc->connreg )
-		jrpc->connreg( ipsc );
+	if ( pooled && ipsc && sb == JRPC_SUCCESS )
+		jrpc_pool_put( &req->conn, ipsc );
+	else
+		ipsc_close (ipsc);
+
+	json_decref (jroot);
+	return sb;
+}
+
+jrpc_client_t *jrpc_client_open( jrpc_conn_t *conn )
+{
+	if ( !conn )
+		return NULL;
+
+	jrpc_client_t *cli = (jrpc_client_t *)malloc( sizeof *cli );
+	if ( !cli )
+		return NULL;
 
-	epfd = ipsc_epoll_init (ipsc);
-	if ( epfd < 0 ) {
-		ipsc_close(ipsc);
-		syslog( LOG_WARNING, "jrpc_server(create): %m (%i)", epfd );
-		_dbg ("LIBJRPC", "jrpc_server(create): %m (%i)", epfd );
+	cli->conn = *conn;
+	cli->ipsc = jrpc_conn_open( &cli->conn );
+	if ( !cli->ipsc ) {
+		free( cli );
 		return NULL;
 	}
 
-	while (1) {
-		/* do we actually need to check for error here? */
-		ipsc_epoll_wait (ipsc, epfd, &jrpc_process);
-		usleep (jrpc->epsleep);
+	return cli;
+}
+
+static ssize_t jrpc_client_transact( jrpc_client_t *cli, jrpc_req_t *reqs,
+				     int n, json_t *jroot )
+{
+	ssize_t sb = JRPC_ERR_SEND;
+	int retried = 0;
+
+	reqs[0].conn = cli->conn;
+
+	while ( 1 ) {
+		if ( !cli->ipsc )
+			cli->ipsc = jrpc_conn_open( &cli->conn );
+		if ( !cli->ipsc ) {
+			sb = JRPC_ERR_GENERIC;
+			break;
+		}
+
+		sb = jrpc_transact (cli->ipsc, reqs, n, jroot);
+		if ( sb != JRPC_ERR_SEND && sb != JRPC_ERR_RECV )
+			break;
+
+		/* connection state is unknown now, start over next time */
+		ipsc_close( cli->ipsc );
+		cli->ipsc = NULL;
+		if ( !jrpc_conn_stale( sb ) || retried++ )
+			break;
 	}
 
-	/* should never get here */
-	ipsc_close (ipsc);
-	return NULL;
+	return sb;
 }
 
-ssize_t jrpc_request( jrpc_req_t *req )
+ssize_t jrpc_client_call( jrpc_client_t *cli, jrpc_req_t *req )
 {
-	if ( !req || !req->method )
+	if ( !cli || !req || !req->method )
 		return JRPC_ERR_GENERIC;
 
-	ssize_t sb = 0;
-	ssize_t rb = 0;
-	json_t *jp = NULL;;
-	json_t *jroot = NULL;;
-	ipsc_t *ipsc = NULL;
+	ssize_t sb;
+	json_t *jroot = jrpc_request_new (req, &cli->conn);
 
-	ipsc = ipsc_connect( req->conn.port );
-	if ( !ipsc )
-	{
-		sb = JRPC_ERR_GENERIC;
-		goto exit;
+	sb = jrpc_client_transact (cli, req, 1, jroot);
+	json_decref (jroot);
+
+	return sb;
+}
+
+ssize_t jrpc_client_batch( jrpc_client_t *cli, jrpc_req_t *reqs, int n )
+{
+	int i;
+	ssize_t sb;
+	json_t *jroot;
+
+	if ( !cli || !reqs || n < 1 )
+		return JRPC_ERR_GENERIC;
+
+	for ( i = 0; i < n; i++ ) {
+		if ( !reqs[i].method )
+			return JRPC_ERR_GENERIC;
 	}
 
-	jroot = json_object ();
+	jroot = jrpc_batch_new (reqs, n, &cli->conn);
+	if ( !jroot )
+		return JRPC_ERR_GENERIC;
+	sb = jrpc_client_transact (cli, reqs, n, jroot);
+	json_decref (jroot);
 
-#ifndef JRPC_LITE
-	jrpc_add_version (jroot, req->jid);
-#endif
+	return sb;
+}
 
-	json_object_set_new (jroot, JRPC_KEY_METHOD, json_string (req->method));
-	if (req->jparams)
-		json_object_set_new (jroot, JRPC_KEY_PARAMS, req->jparams);
+ssize_t jrpc_client_notify( jrpc_client_t *cli, jrpc_req_t *req )
+{
+	if ( !cli || !req || !req->method )
+		return JRPC_ERR_GENERIC;
 
-	/* send request */
-	ipsc->cb_args = (void *)req;
-	sb = jrpc_send_json (ipsc, jroot);
-	if ( sb < 2 ) {
+	ssize_t sb = JRPC_ERR_SEND;
+	int retried = 0;
+	json_t *jroot;
+
+	req->conn = cli->conn;
+
+	/*
+	 * unframed peers can't tell back to back messages apart, nothing
+	 * would come back in between: one connection each, as jrpc_notify()
+	 */
+	if ( !(cli->conn.flags & JRPC_CONN_FLAG_FRAMED) )
+		return jrpc_notify( req );
+
+	jroot = jrpc_notification_new (req);
+	while ( 1 ) {
+		if ( !cli->ipsc )
+			cli->ipsc = jrpc_conn_open( &cli->conn );
+		if ( !cli->ipsc ) {
+			sb = JRPC_ERR_GENERIC;
+			break;
+		}
+
+		cli->ipsc->cb_args = (void *)req;
+		if ( jrpc_send_json (cli->ipsc, jroot) >= 2 ) {
+			sb = JRPC_SUCCESS;
+			break;
+		}
 		sb = JRPC_ERR_SEND;
-		goto exit;
+
+		ipsc_close( cli->ipsc );
+		cli->ipsc = NULL;
+		if ( !jrpc_conn_stale( sb ) || retried++ )
+			break;
 	}
 
-	/* get reply */
-	rb = jrpc_recv_json (ipsc, &jp);
-	if ( rb < 2 ) {
-		syslog(LOG_WARNING, "jrpc_process(recv): %m (%li)", rb);
-//		_dbg ("LIBJRPC", "jrpc_process(recv): %m (%li)", rb);
-		sb = JRPC_ERR_RECV;
-		goto exit;
+	json_decref (jroot);
+	return sb;
+}
+
+void jrpc_client_close( jrpc_client_t *cli )
+{
+	if ( !cli )
+		return;
+
+	ipsc_close( cli->ipsc );
+	free( cli );
+}
+
+/* call sent on an async connection, waiting for its reply */
+typedef struct jrpc_pending_t {
+	jrpc_req_t *req;	/* NULL - free slot */
+	jrpc_async_cb_t cb;
+	void *arg;
+	uint64_t id;
+} jrpc_pending_t;
+
+struct jrpc_async_t {
+	jrpc_conn_t conn;
+	ipsc_t *ipsc;		/* NULL once the connection failed */
+	uint64_t next_id;
+	size_t npend;
+	size_t size;		/* pending slots, power of two */
+	jrpc_pending_t *pend;	/* indexed by id */
+	int parsing;		/* frames are being completed, don't recurse */
+	jrpc_runtime_t rt;	/* of the latest call */
+};
+
+static int jrpc_async_grow( jrpc_async_t *as )
+{
+	size_t i;
+	size_t size = as->size * 2;
+	jrpc_pending_t *pend;
+
+	pend = (jrpc_pending_t *)calloc( size, sizeof *pend );
+	if ( !pend )
+		return -1;
+
+	/* ids apart by less than the old size stay apart */
+	for ( i = 0; i < as->size; i++ ) {
+		if ( as->pend[i].req )
+			pend[as->pend[i].id & (size - 1)] = as->pend[i];
 	}
 
-	sb = JRPC_SUCCESS;
-	req->jres = json_copy (json_object_get (jp, JRPC_KEY_RESULT));
-	if (req->jres == NULL)
-	{
-		sb = JRPC_ERR_NORESULT;
+	free( as->pend );
+	as->pend = pend;
+	as->size = size;
+	return 0;
+}
 
-		req->jres = json_copy(json_object_get (jp, JRPC_KEY_ERROR));
-		if (req->jres == NULL)
-		{
-			sb = JRPC_ERR_USER;
+/* finish a call, its slot is free again before the callback runs */
+static void jrpc_async_finish( jrpc_async_t *as, jrpc_pending_t *p,
+			       json_t *jp, ssize_t status )
+{
+	jrpc_req_t *req = p->req;
+	jrpc_async_cb_t cb = p->cb;
+	void *arg = p->arg;
+
+	p->req = NULL;
+	as->npend--;
+
+	req->jres = NULL;
+	if ( jp )
+		jrpc_reply_result( req, jp );
+	else
+		req->status = status;
+
+	if ( cb )
+		cb( req, arg );
+}
+
+/* connection is gone, every call in flight completes with status */
+static void jrpc_async_fail( jrpc_async_t *as, ssize_t status )
+{
+	size_t i;
+
+	ipsc_close( as->ipsc );
+	as->ipsc = NULL;
+
+	for ( i = 0; i < as->size && as->npend; i++ ) {
+		if ( as->pend[i].req )
+			jrpc_async_finish( as, &as->pend[i], NULL, status );
+	}
+}
+
+static ssize_t jrpc_async_complete( jrpc_async_t *as, json_t *jp )
+{
+	size_t i;
+	ssize_t done = 0;
+	json_int_t id;
+	json_t *jid;
+	jrpc_pending_t *p;
+
+	if ( json_is_array( jp ) ) {
+		for ( i = 0; i < json_array_size( jp ); i++ )
+			done += jrpc_async_complete( as, json_array_get( jp, i ) );
+		return done;
+	}
+
+	jid = json_object_get( jp, JRPC_KEY_ID );
+	if ( !json_is_integer( jid ) ) {
+		syslog(LOG_WARNING, "jrpc_async: reply without a call id");
+		return 0;
+	}
+
+	id = json_integer_value( jid );
+	p = &as->pend[(uint64_t)id & (as->size - 1)];
+	if ( !p->req || p->id != (uint64_t)id ) {
+		syslog(LOG_WARNING, "jrpc_async: reply to unknown call %lli",
+		       (long long)id);
+		return 0;
+	}
+
+	jrpc_async_finish( as, p, jp, 0 );
+	return 1;
+}
+
+/* append whatever the socket holds to the connection buffer, never blocks */
+static ssize_t jrpc_async_fill( jrpc_async_t *as )
+{
+	ssize_t rb;
+	ipsc_t *ipsc = as->ipsc;
+
+	/* a packet has to fit whole, the kernel drops what is left over */
+	int pkt = ipsc->type == SOCK_SEQPACKET;
+	size_t room = pkt ? JRPC_DEFAULT_RCVBUF_DGRAM : 1;
+
+	while ( 1 ) {
+		if ( !ipsc_rbuf_reserve( ipsc, ipsc->rlen + room ) )
+			return -1;
+
+		rb = recv( ipsc->sd, ipsc->rbuf + ipsc->rlen,
+			   ipsc->rsize - ipsc->rlen,
+			   MSG_DONTWAIT | (pkt ? MSG_TRUNC : 0) );
+		if ( pkt && rb > 0 && (size_t)rb > ipsc->rsize - ipsc->rlen ) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		if ( rb > 0 ) {
+			ipsc->rlen += rb;
+			continue;
+		}
+		if ( rb == 0 ) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		if ( errno == EINTR )
+			continue;
+		if ( errno == EAGAIN || errno == EWOULDBLOCK )
+			return 0;
+		return -1;
+	}
+}
+
+/* complete every whole frame in the buffer, callbacks may send more calls */
+static ssize_t jrpc_async_frames( jrpc_async_t *as )
+{
+	size_t off = 0;
+	ssize_t len;
+	ssize_t done = 0;
+	int enc;
+	unsigned char *hdr;
+	const jrpc_codec_t *codec;
+	json_t *jp;
+
+	/* as->ipsc is re-read, callbacks may grow its buffer or drop it */
+	as->parsing = 1;
+	while ( as->ipsc && as->ipsc->rlen - off >= JRPC_FRAME_HDRLEN ) {
+		hdr = (unsigned char *)as->ipsc->rbuf + off;
+		len = jrpc_frame_unpack( hdr );
+		if ( len < 0 ) {
+			done = -1;
+			break;
 		}
+		if ( as->ipsc->rlen - off - JRPC_FRAME_HDRLEN < (size_t)len )
+			break;
+
+		enc = hdr[1] & JRPC_FRAME_ENC_MASK;
+		codec = jrpc_codec_find( enc );
+		if ( codec )
+			jp = codec->decode( (char *)hdr + JRPC_FRAME_HDRLEN, len );
+		else if ( !enc )
+			jp = json_loadb( (char *)hdr + JRPC_FRAME_HDRLEN, len,
+					 0, NULL );
+		else
+			jp = NULL;
+		off += JRPC_FRAME_HDRLEN + len;
+		if ( !jp ) {
+			syslog(LOG_WARNING, "jrpc_async: unparsable reply");
+			continue;
+		}
+		jrpc_codec_seen( as->ipsc, &as->rt, hdr[1] );
+
+		done += jrpc_async_complete( as, jp );
+		json_decref( jp );
 	}
+	as->parsing = 0;
 
-exit:
-	ipsc_close (ipsc);
-	json_decref (jp);
-	json_decref (jroot);
+	if ( as->ipsc && off ) {
+		memmove( as->ipsc->rbuf, as->ipsc->rbuf + off,
+			 as->ipsc->rlen - off );
+		as->ipsc->rlen -= off;
+		ipsc_rbuf_trim( as->ipsc, off );
+	}
+
+	return done;
+}
+
+/*
+ * write a whole message without blocking the peer: while the socket is
+ * full, read its replies so both sides keep moving
+ */
+static ssize_t jrpc_async_send( jrpc_async_t *as, struct iovec *iov, int n )
+{
+	ssize_t sb;
+	struct msghdr msg;
+	struct pollfd pfd;
+
+	memset( &msg, 0, sizeof msg );
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = n;
+
+	while ( msg.msg_iovlen ) {
+		sb = sendmsg( as->ipsc->sd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT );
+		if ( sb < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			if ( errno != EAGAIN && errno != EWOULDBLOCK )
+				return -1;
+
+			pfd.fd     = as->ipsc->sd;
+			pfd.events = POLLIN | POLLOUT;
+			if ( poll( &pfd, 1, as->conn.timeout ?
+				   as->conn.timeout : -1 ) == 0 ) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+			if ( (pfd.revents & POLLIN) && jrpc_async_fill( as ) )
+				return -1;
+			continue;
+		}
+
+		while ( msg.msg_iovlen && (size_t)sb >= msg.msg_iov->iov_len ) {
+			sb -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if ( msg.msg_iovlen ) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sb;
+			msg.msg_iov->iov_len -= sb;
+		}
+	}
+
+	return 0;
+}
+
+jrpc_async_t *jrpc_async_open( jrpc_conn_t *conn )
+{
+	jrpc_async_t *as;
+
+	if ( !conn )
+		return NULL;
+
+	as = (jrpc_async_t *)calloc( 1, sizeof *as );
+	if ( !as )
+		return NULL;
+
+	/* replies are matched by frame, the legacy stream can't pipeline */
+	as->conn = *conn;
+	as->conn.flags |= JRPC_CONN_FLAG_FRAMED;
+	as->conn.flags &= ~JRPC_CONN_FLAG_POOL;
+	/* the rings have no fd to poll for replies */
+	if ( as->conn.transport == JRPC_TRANSPORT_SHM )
+		as->conn.transport = JRPC_TRANSPORT_STREAM;
+	as->next_id = 1;
+	as->size = JRPC_ASYNC_SLOTS;
+	as->pend = (jrpc_pending_t *)calloc( as->size, sizeof *as->pend );
+	if ( !as->pend )
+		goto error;
+
+	as->ipsc = jrpc_conn_open( &as->conn );
+	if ( !as->ipsc )
+		goto error;
+
+	return as;
+
+error:
+	free( as->pend );
+	free( as );
+	return NULL;
+}
+
+ssize_t jrpc_async_call( jrpc_async_t *as, jrpc_req_t *req,
+			 jrpc_async_cb_t cb, void *arg )
+{
+	ssize_t sb = JRPC_SUCCESS;
+	uint64_t id;
+	ssize_t len;
+	struct iovec iov;
+	json_t *jroot;
+	jrpc_pending_t *p;
+
+	if ( !as || !req || !req->method )
+		return JRPC_ERR_GENERIC;
+	if ( !as->ipsc )
+		return JRPC_ERR_SEND;
+
+	id = as->next_id++;
+	while ( as->pend[id & (as->size - 1)].req ) {
+		if ( jrpc_async_grow( as ) )
+			return JRPC_ERR_GENERIC;
+	}
+
+	req->conn = as->conn;
+	as->rt = req->rt;
+	jroot = jrpc_request_new( req, &as->conn );
+	json_object_set_new( jroot, JRPC_KEY_ID, json_integer( id ) );
+	len = jrpc_wbuf_dump( as->ipsc, jroot, &as->rt );
+	json_decref( jroot );
+	if ( len < 0 )
+		return JRPC_ERR_GENERIC;
+
+	/* the reply may be read while this call is still being written */
+	p = &as->pend[id & (as->size - 1)];
+	p->req = req;
+	p->cb  = cb;
+	p->arg = arg;
+	p->id  = id;
+	as->npend++;
+
+	iov.iov_base = as->ipsc->wbuf;
+	iov.iov_len  = as->ipsc->wlen;
+
+	if ( jrpc_async_send( as, &iov, 1 ) ) {
+		syslog(LOG_WARNING, "jrpc_async_call(send): %m");
+		/* this call fails here, the rest through their callbacks */
+		p = &as->pend[id & (as->size - 1)];
+		if ( p->req == req && p->id == id ) {
+			p->req = NULL;
+			as->npend--;
+		}
+		/* from a callback, jrpc_async_dispatch() fails the rest */
+		if ( as->parsing ) {
+			ipsc_close( as->ipsc );
+			as->ipsc = NULL;
+		} else {
+			jrpc_async_fail( as, JRPC_ERR_SEND );
+		}
+		sb = JRPC_ERR_SEND;
+	} else {
+		as->ipsc->wlen = 0;
+		ipsc_wbuf_trim( as->ipsc, len );
+		/* replies read while waiting for room won't wake the poller */
+		if ( !as->parsing && as->ipsc->rlen &&
+		     jrpc_async_frames( as ) < 0 )
+			jrpc_async_fail( as, JRPC_ERR_RECV );
+	}
 
 	return sb;
 }
 
+int jrpc_async_fd( jrpc_async_t *as )
+{
+	if ( !as || !as->ipsc )
+		return -1;
+
+	return as->ipsc->sd;
+}
+
+size_t jrpc_async_pending( jrpc_async_t *as )
+{
+	return as ? as->npend : 0;
+}
+
+ssize_t jrpc_async_dispatch( jrpc_async_t *as )
+{
+	int rc;
+	ssize_t done;
+
+	if ( !as || as->parsing )
+		return JRPC_ERR_GENERIC;
+	if ( !as->ipsc )
+		return JRPC_ERR_RECV;
+
+	rc = jrpc_async_fill( as );
+	done = jrpc_async_frames( as );
+	if ( rc || done < 0 || !as->ipsc ) {
+		if ( as->ipsc )
+			syslog(LOG_WARNING, "jrpc_async_dispatch(recv): %m");
+		jrpc_async_fail( as, JRPC_ERR_RECV );
+		return JRPC_ERR_RECV;
+	}
+
+	return done;
+}
+
+ssize_t jrpc_async_wait( jrpc_async_t *as, int timeout )
+{
+	int rc;
+	ssize_t done = 0;
+	struct pollfd pfd;
+
+	if ( !as )
+		return JRPC_ERR_GENERIC;
+
+	while ( !done && as->npend ) {
+		if ( !as->ipsc )
+			return JRPC_ERR_RECV;
+
+		pfd.fd     = as->ipsc->sd;
+		pfd.events = POLLIN;
+		rc = poll( &pfd, 1, timeout );
+		if ( rc < 0 && errno == EINTR )
+			continue;
+		if ( rc < 0 )
+			return JRPC_ERR_RECV;
+		if ( rc == 0 )
+			return 0;
+
+		done = jrpc_async_dispatch( as );
+	}
+
+	return done;
+}
+
+void jrpc_async_close( jrpc_async_t *as )
+{
+	if ( !as )
+		return;
+
+	jrpc_async_fail( as, JRPC_ERR_RECV );
+	free( as->pend );
+	free( as );
+}
+
 ssize_t jrpc_send_reply ( ipsc_t *ipsc, json_t *jobj, json_t *jid, int type )
 {
 	if ( !ipsc || !jobj )
@@ -410,6 +4783,35 @@ ssize_t jrpc_send_reply ( ipsc_t *ipsc, json_t *jobj, json_t *jid, int type )
 	ssize_t sb = 0;
 	char msg_type[8]; /* either "error" or "result" */
 	json_t *jroot = NULL;
+	jrpc_centry_t *ce;
+
+	/* errors are counted even when nobody gets to see them */
+	if (type == JRPC_REPLY_TYPE_ERROR && jrpc_ctx && jrpc_ctx->ipsc == ipsc)
+	{
+		jrpc_ctx->error = 1;
+		jrpc_ctx->code  = json_integer_value (
+			json_object_get (jobj, JRPC_KEY_ERROR_CODE));
+	}
+
+	/* notification, don't even build the reply */
+	if (jrpc_ctx && jrpc_ctx->ipsc == ipsc && jrpc_ctx->discard)
+		return 1;
+
+	/* first result of a cacheable call, kept and sent from the cache */
+	if (type == JRPC_REPLY_TYPE_RESULT && jrpc_ctx &&
+	    jrpc_ctx->ipsc == ipsc && jrpc_ctx->ckey)
+	{
+		ce = jrpc_cache_put (jrpc_ctx->ckey, jobj);
+		free (jrpc_ctx->ckey);
+		jrpc_ctx->ckey = NULL;
+		if (ce && !jrpc_ctx->batch)
+		{
+			sb = jrpc_cache_send (ipsc, ce, jid);
+			jrpc_centry_unref (ce);
+			goto exit;
+		}
+		jrpc_centry_unref (ce);
+	}
 
 	switch (type)
 	{
@@ -436,8 +4838,24 @@ ssize_t jrpc_send_reply ( ipsc_t *ipsc, json_t *jobj, json_t *jid, int type )
 		goto exit;
 	}
 
+	/* part of a batch, queued looks like a successful send to handlers */
+	if (jrpc_ctx && jrpc_ctx->ipsc == ipsc && jrpc_ctx->batch)
+	{
+		sb = json_array_append (jrpc_ctx->batch, jroot) ?
+			JRPC_ERR_GENERIC : 1;
+		goto exit;
+	}
+
 	sb = jrpc_send_json (ipsc, jroot);
 
+	/* seqpacket can't carry it, let the caller know instead of hanging */
+	if (sb < 0 && errno == EMSGSIZE && type == JRPC_REPLY_TYPE_RESULT)
+	{
+		syslog (LOG_WARNING, "jrpc_send_reply: result too large");
+		sb = jrpc_error (ipsc, jid, JRPC_CODE_INTERNAL_ERROR,
+				 JRPC_ERR_REPLY_TOO_LARGE);
+	}
+
 exit:
 	json_decref (jroot);
 
@@ -446,12 +4864,16 @@ exit:
 
 ssize_t jrpc_error (ipsc_t *ipsc, json_t *jid, int code, const char *message )
 {
+	ssize_t sb;
 	json_t *err;
 	err = json_object ();
 
 	json_object_set_new (err, JRPC_KEY_ERROR_CODE, json_integer (code));
 	json_object_set_new (err, JRPC_KEY_ERROR_TEXT, json_string (message));
 
-	return jrpc_send_reply ( ipsc, err, jid, JRPC_REPLY_TYPE_ERROR );
+	sb = jrpc_send_reply ( ipsc, err, jid, JRPC_REPLY_TYPE_ERROR );
+	json_decref (err);
+
+	return sb;
 }
 
@@ -16,6 +16,7 @@
 #ifndef _JRPC_H_
 #define _JRPC_H_
 
+#include <stdint.h>
 #include <syslog.h>
 
 #include <jansson.h>
@@ -30,12 +31,17 @@
 #define JRPC_KEY_ERROR_TEXT		"message"
 #define JRPC_KEY_METHOD			"method"
 #define JRPC_KEY_PARAMS			"params"
+#define JRPC_KEY_TIMEOUT		"timeout"	/* ms the caller waits, optional */
 #define JRPC_ERR_PARSE_ERROR		"Parse error"
 #define JRPC_ERR_INVALID_REQUEST	"Invalid request"
 #define JRPC_ERR_METHOD_NOT_FOUND	"Method not found"
 #define JRPC_ERR_INVALID_PARAMS		"Invalid params"
 #define JRPC_ERR_INTERNAL_ERROR		"Internal error"
 #define JRPC_ERR_NOT_IMPLEMENTED	"Not implemented"
+#define JRPC_ERR_TOO_LARGE		"Request too large"
+#define JRPC_ERR_NO_MEMORY		"Out of memory"
+#define JRPC_ERR_REPLY_TOO_LARGE	"Reply too large"
+#define JRPC_ERR_BUSY			"Server busy"
 #define JRPC_CODE_PARSE_ERROR		-32700
 #define JRPC_CODE_INVALID_REQUEST	-32600
 #define JRPC_CODE_METHOD_NOT_FOUND	-32601
@@ -43,12 +49,84 @@
 #define JRPC_CODE_INTERNAL_ERROR	-32603
 /* -32000 to -32099 are reserved for implementation-defined server errors */
 #define JRPC_CODE_NOT_IMPLEMENTED	-32000
+#define JRPC_CODE_BUSY			-32001	/* over a jrpc_t limit, try later */
+#define JRPC_CODE_TOO_LARGE		-32002
 
 #define JRPC_DEFAULT_EPOLL_USLEEP	1000
 #define JRPC_DEFAULT_TIMEOUT		10000	// 10secs
 #define JRPC_DEFAULT_RCVBUF_STREAM	4096
-#define JRPC_DEFAULT_RCVBUF_DGRAM	65535
+#define JRPC_DEFAULT_RCVBUF_DGRAM	65535	/* largest seqpacket message */
+#define JRPC_DEFAULT_RCVBUF_MAX		(JRPC_FRAME_MAXLEN + 1)
+#define JRPC_DEFAULT_RCVMEM_MAX		(256 << 20)
+#define JRPC_DEFAULT_WQUEUE_HIGH	(1 << 20)
+#define JRPC_DEFAULT_WQUEUE_LOW		(256 << 10)
 #define JRPC_DEFAULT_MAXQUEUE		IPSC_MAX_QUEUE_DEFAULT
+#define JRPC_DEFAULT_LOOPS		1
+#define JRPC_MAX_LOOPS			64
+#define JRPC_DEFAULT_WORKERS		4
+#define JRPC_MAX_WORKERS		256
+#define JRPC_DEFAULT_CACHE_MAX		(4 << 20)
+
+/* method flags (jrpc_method_t.flags) */
+#define JRPC_METHOD_FLAG_WORKER		0x01	/* handlers may block, see jrpc_t.workers */
+
+/* connection flags (jrpc_conn_t.flags) */
+#define JRPC_CONN_FLAG_FRAMED		0x01	/* length-prefixed messages */
+#define JRPC_CONN_FLAG_POOL		0x02	/* jrpc_request() reuses connections */
+#define JRPC_CONN_FLAG_DEADLINE		0x04	/* requests tell the server the timeout */
+
+/*
+ * transports (jrpc_conn_t.transport), Unix sockets only but stream;
+ * seqpacket keeps message boundaries in the kernel, one recv - one
+ * message, but limits messages to JRPC_DEFAULT_RCVBUF_DGRAM bytes, both
+ * ends have to use it; shm is a client side choice, it connects to a
+ * stream server and moves the traffic over to shared memory rings (framed
+ * only, falls back to the socket if the server won't; not for async)
+ */
+#define JRPC_TRANSPORT_STREAM		0
+#define JRPC_TRANSPORT_SEQPACKET	1
+#define JRPC_TRANSPORT_SHM		2
+
+/* client connection pool */
+#define JRPC_POOL_BUCKETS		16
+#define JRPC_POOL_MAXIDLE		8	/* idle connections kept per port */
+#define JRPC_ASYNC_SLOTS		64	/* initial async calls in flight, grows */
+
+/*
+ * Framed wire format: every message is preceded by a fixed size header
+ *   [0]    JRPC_FRAME_MAGIC
+ *   [1]    flags: bits 0-3 payload encoding (JRPC_ENC_*),
+ *          bits 4-7 binary encodings the sender reads as well
+ *   [2..3] reserved (0)
+ *   [4..7] payload length, big endian
+ * The magic byte can never start a JSON text, so servers tell framed
+ * and legacy (timeout delimited) peers apart by the first byte received.
+ *
+ * A peer with rt.bin_ctx set advertises its encoding on every frame and
+ * switches to it once the other side advertised or used it too, so both
+ * start out in JSON and peers not knowing the flags stay there.
+ */
+#define JRPC_FRAME_MAGIC		0xfa
+#define JRPC_FRAME_HDRLEN		8
+#define JRPC_FRAME_MAXLEN		(16 << 20)
+#define JRPC_FRAME_ENC_MASK		0x0f
+#define JRPC_FRAME_ACCEPT(enc)		(0x10 << ((enc) - 1))
+
+/* server statistics (jrpc_t.stats), see jrpc_server_stats() */
+#define JRPC_STATS_ON			0x01	/* keep counters */
+#define JRPC_STATS_METHOD		0x02	/* and serve them as JRPC_STATS_NAME */
+#define JRPC_STATS_NAME			"rpc.stats"
+#define JRPC_STATS_CODES		8	/* error codes told apart per method */
+#define JRPC_STATS_BUCKETS		24	/* handler time: < 1us, then < 2^i us */
+
+/* payload encodings */
+#define JRPC_ENC_JSON			0
+#define JRPC_ENC_CBOR			1
+
+/* per-connection state kept in ipsc_t.flags */
+#define JRPC_FLAG_FRAMED		(IPSC_FLAG_USER << 0)
+#define JRPC_FLAG_PROBED		(IPSC_FLAG_USER << 1)
+#define JRPC_FLAG_BINARY		(IPSC_FLAG_USER << 2)	/* peer reads rt.bin_ctx */
 
 /* return codes */
 #define JRPC_SUCCESS			 0
@@ -72,6 +150,22 @@ enum {
 	JRPC_CB_OPT_PARAMS
 };
 
+/* declared parameter types (jrpc_param_t.type) */
+enum {
+	JRPC_PARAM_ANY,
+	JRPC_PARAM_INT,
+	JRPC_PARAM_REAL,	/* integers do as well */
+	JRPC_PARAM_BOOL,
+	JRPC_PARAM_STRING,
+	JRPC_PARAM_ARRAY,
+	JRPC_PARAM_OBJECT
+};
+
+/* jrpc_param_t.flags */
+#define JRPC_PARAM_FLAG_OPTIONAL	0x01	/* may be left out, or null */
+#define JRPC_PARAM_FLAG_BOUNDED		0x02	/* min, max apply */
+#define JRPC_PARAMS_MAX			32	/* per method */
+
 /* reply types */
 enum {
 	JRPC_REPLY_TYPE_ERROR,
@@ -81,37 +175,115 @@ enum {
 /* connection register callback, useful for joinable threads */
 typedef void (*jrpc_connreg_t) (void *ptr);
 
+/* work posted to a server loop */
+typedef void (*jrpc_work_t) (void *arg);
+
 /* method handler */
 typedef ssize_t (*jrpc_cb_t) (ipsc_t *ipsc, json_t *jparams, json_t *jid);
 
+/*
+ * One declared parameter, taken by name from params given as an object or
+ * by position from an array. Names the spec doesn't list, extra positions
+ * and values of the wrong type or out of bounds are refused with
+ * JRPC_CODE_INVALID_PARAMS before any handler runs. jrpc_method_t.params
+ * doesn't matter then.
+ */
+typedef struct jrpc_param_t {
+	const char *name;	/* NULL ends the list */
+	int type;		/* JRPC_PARAM_* */
+	int flags;		/* JRPC_PARAM_FLAG_* */
+	double min;		/* bounds of numbers, or of the length of */
+	double max;		/* strings, arrays and objects */
+} jrpc_param_t;
+
+#define JRPC_PARAMS_END		{ NULL, 0, 0, 0, 0 }
+
+/* value of a declared parameter, args[i] goes with spec[i] */
+typedef struct jrpc_arg_t {
+	int set;		/* 0 - optional and not given */
+	union {
+		json_int_t i;	/* JRPC_PARAM_INT, BOOL */
+		double d;	/* JRPC_PARAM_REAL */
+		const char *s;	/* JRPC_PARAM_STRING */
+	} v;
+	size_t len;		/* of strings, arrays and objects */
+	json_t *j;		/* the value itself, borrowed */
+} jrpc_arg_t;
+
+/* handler of a method with a spec, args are valid during the call */
+typedef ssize_t (*jrpc_args_cb_t) (ipsc_t *ipsc, const jrpc_arg_t *args,
+				   json_t *jid);
+
 /* method structure */
 typedef struct jrpc_method_t {
 	char *name;
 	int params;
 	jrpc_cb_t *handlers;
+	int flags;		/* JRPC_METHOD_FLAG_* */
+	int cache_ms;		/* results are reused this long, 0 - never */
+	const jrpc_param_t *spec;	/* checked before the handlers, NULL - not */
+	jrpc_args_cb_t args_handler;	/* runs instead of handlers, needs spec */
 } jrpc_method_t;
 
-/* TODO */
+/* reply a handler finishes later, see jrpc_reply_defer() */
+typedef struct jrpc_reply_handle_t jrpc_reply_handle_t;
+
+/* binary encoding of the json_t model, see jrpc_runtime_t.bin_ctx */
+typedef struct jrpc_codec_t {
+	int enc;		/* JRPC_ENC_*, goes into the frame header */
+	const char *name;
+	int (*encode)(json_t *jroot, json_dump_callback_t write, void *data);
+	json_t *(*decode)(const char *buf, size_t len);
+} jrpc_codec_t;
+
+extern const jrpc_codec_t jrpc_codec_cbor;
+
 typedef struct jrpc_runtime_t {
-	void *sign_ctx;
-	void *encr_ctx;
-	void *bin_ctx;
+	void *sign_ctx;		/* TODO */
+	void *encr_ctx;		/* TODO */
+	void *bin_ctx;		/* const jrpc_codec_t *, NULL - JSON only */
 } jrpc_runtime_t;
 
 typedef struct jrpc_conn_t {
 	int   port;
 	int   timeout;
 	int   flags;
+	int   transport;
+	const char *addr;	/* "tcp:host:port" etc, see ipsc_listen_addr();
+				   NULL - Unix socket for port */
+	int   sndbuf;		/* socket buffer sizes, 0 - system default */
+	int   rcvbuf;
 } jrpc_conn_t;
 
+/* server runtime state, private to jrpc.c */
+struct jrpc_srv_t;
+
 /* server parameters */
 typedef struct jrpc_t {
 	jrpc_conn_t conn;
 	int   maxqueue;
-	int   epsleep;
+	int   epsleep;		/* unused, the loops are purely event driven */
 	jrpc_method_t *methods;
 	jrpc_connreg_t connreg;
 	jrpc_runtime_t rt;
+	int   loops;		/* event loop threads sharing the listener */
+	struct jrpc_srv_t *srv;	/* set while jrpc_server() runs */
+	size_t rcvbuf_max;	/* receive buffer of one connection, 0 - no limit */
+	size_t rcvmem_max;	/* receive buffers of all connections, 0 - no limit */
+	size_t wqueue_high;	/* unsent replies that pause reading, 0 - never */
+	size_t wqueue_low;	/* and let it go on again */
+	int   stats;		/* JRPC_STATS_* */
+	int   workers;		/* threads for JRPC_METHOD_FLAG_WORKER, 0 - inline */
+	size_t cache_max;	/* bytes of cached results, 0 - no cache */
+	/*
+	 * admission control, 0 - no limit: connections past maxconn are
+	 * closed as they come in, requests past the others are answered
+	 * with JRPC_CODE_BUSY without being parsed
+	 */
+	int   maxconn;		/* clients at once */
+	int   maxinflight;	/* calls on the workers or deferred, not answered */
+	int   rate;		/* requests per second, per connection */
+	int   burst;		/* and how many may come at once, 0 - rate */
 } jrpc_t;
 
 /* client/request parameters */
@@ -122,16 +294,72 @@ typedef struct jrpc_req_t {
 	json_t *jid;
 	json_t *jres;
 	jrpc_runtime_t rt;
+	ssize_t status;		/* outcome of this call, as jrpc_request() returns */
 } jrpc_req_t;
 
+/* persistent client connection, one call at a time */
+typedef struct jrpc_client_t {
+	jrpc_conn_t conn;
+	ipsc_t *ipsc;
+} jrpc_client_t;
+
+/* async call completion, req->status and req->jres are set */
+typedef void (*jrpc_async_cb_t)(jrpc_req_t *req, void *arg);
+
+/*
+ * pipelined client connection, many calls in flight, replies in any order;
+ * not thread safe, use one handle per thread
+ */
+typedef struct jrpc_async_t jrpc_async_t;
+
+/* error replies carrying one code */
+typedef struct jrpc_stats_code_t {
+	int code;		/* 0 - all codes that didn't get a slot */
+	uint64_t count;
+} jrpc_stats_code_t;
+
+typedef struct jrpc_method_stats_t {
+	char *name;
+	uint64_t calls;
+	uint64_t hits;		/* calls answered from the result cache */
+	uint64_t errors;	/* calls answered with an error */
+	jrpc_stats_code_t codes[JRPC_STATS_CODES];
+	uint64_t bytes_in;	/* batch elements are only counted per server */
+	uint64_t bytes_out;
+	uint64_t time_ns;	/* spent in the handlers */
+	uint64_t hist[JRPC_STATS_BUCKETS];
+} jrpc_method_stats_t;
+
+/* counters only ever grow, rates are differences of two snapshots */
+typedef struct jrpc_stats_t {
+	uint64_t uptime_ms;
+	uint64_t conns;		/* open connections */
+	uint64_t accepts;	/* connections accepted so far */
+	uint64_t refused;	/* and closed at once, over jrpc_t.maxconn */
+	uint64_t wakeups;	/* epoll_wait() returns, all loops */
+	uint64_t requests;	/* messages received, a batch is one */
+	uint64_t parse_errors;
+	uint64_t unknown;	/* calls to methods that don't exist */
+	uint64_t busy;		/* requests turned down unparsed, over a limit */
+	uint64_t expired;	/* calls dropped, the caller had stopped waiting */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	size_t nmethods;
+	jrpc_method_stats_t *methods;
+} jrpc_stats_t;
+
 /* handlers caster */
 #define JRPC_CBS		(jrpc_cb_t [])
 /* methods array terminator */
-#define JRPC_METHODS_END	{ 0, 0, JRPC_CBS{0} }
+#define JRPC_METHODS_END	{ 0, 0, JRPC_CBS{0}, 0, 0, NULL, NULL }
 
 #define JRPC_DEFAULT_CONN {			\
-	.timeout  = JRPC_DEFAULT_TIMEOUT,	\
-	.flags    = 0,				\
+	.timeout   = JRPC_DEFAULT_TIMEOUT,	\
+	.flags     = 0,				\
+	.transport = JRPC_TRANSPORT_STREAM,	\
+	.addr      = NULL,			\
+	.sndbuf    = 0,				\
+	.rcvbuf    = 0,				\
 }
 
 /* server init macro */
@@ -140,7 +368,20 @@ typedef struct jrpc_req_t {
 	.maxqueue = JRPC_DEFAULT_MAXQUEUE,	\
 	.epsleep  = JRPC_DEFAULT_EPOLL_USLEEP,	\
 	.methods  = NULL,			\
-	.connreg  = NULL			\
+	.connreg  = NULL,			\
+	.loops    = JRPC_DEFAULT_LOOPS,		\
+	.srv      = NULL,			\
+	.rcvbuf_max = JRPC_DEFAULT_RCVBUF_MAX,	\
+	.rcvmem_max = JRPC_DEFAULT_RCVMEM_MAX,	\
+	.wqueue_high = JRPC_DEFAULT_WQUEUE_HIGH,	\
+	.wqueue_low = JRPC_DEFAULT_WQUEUE_LOW,	\
+	.stats    = JRPC_STATS_ON,		\
+	.workers  = JRPC_DEFAULT_WORKERS,	\
+	.cache_max = JRPC_DEFAULT_CACHE_MAX,	\
+	.maxconn  = 0,				\
+	.maxinflight = 0,			\
+	.rate     = 0,				\
+	.burst    = 0,				\
 }
 
 /* client init macro */
@@ -149,7 +390,8 @@ typedef struct jrpc_req_t {
 	.method  = NULL,				\
 	.jparams = NULL,				\
 	.jid     = NULL,				\
-	.jres    = NULL				\
+	.jres    = NULL,				\
+	.status  = 0				\
 }
 
 void jrpc_add_version( json_t *root, json_t *jid );
@@ -159,12 +401,107 @@ ssize_t jrpc_process( ipsc_t *ipsc );
 
 /* server thread */
 void *jrpc_server( void *args );
+/* ask all loops to exit, join the jrpc_server() thread to wait for them */
+int jrpc_server_stop( jrpc_t *jrpc );
+/* wake up all loops */
+int jrpc_server_wake( jrpc_t *jrpc );
+/* run fn(arg) on the given loop (modulo number of loops), -1 - it won't */
+int jrpc_server_post( jrpc_t *jrpc, int loop, jrpc_work_t fn, void *arg );
 
 /* client */
 ssize_t jrpc_request( jrpc_req_t *req );
+/*
+ * Send n calls as one JSON-RPC batch over reqs[0].conn. Each reqs[i] gets
+ * its own jres and status, calls without jid are numbered internally,
+ * above the largest integer jid given.
+ */
+ssize_t jrpc_request_batch( jrpc_req_t *reqs, int n );
+/* fire and forget, returns once the request is sent; req->jid is ignored */
+ssize_t jrpc_notify( jrpc_req_t *req );
+void jrpc_pool_flush( void );
+
+/*
+ * persistent client, req->conn is taken from the handle; without
+ * JRPC_CONN_FLAG_FRAMED notifications go over a connection of their own
+ */
+jrpc_client_t *jrpc_client_open( jrpc_conn_t *conn );
+ssize_t jrpc_client_call( jrpc_client_t *cli, jrpc_req_t *req );
+ssize_t jrpc_client_batch( jrpc_client_t *cli, jrpc_req_t *reqs, int n );
+ssize_t jrpc_client_notify( jrpc_client_t *cli, jrpc_req_t *req );
+void jrpc_client_close( jrpc_client_t *cli );
+
+/*
+ * async client: calls get ids of their own (req->jid is ignored) and
+ * complete through cb from jrpc_async_dispatch()/jrpc_async_wait(), or
+ * from a later jrpc_async_call() while the socket is full.  req has to
+ * stay around until then.  Once the connection fails every pending call
+ * completes with an error and the handle only remains to be closed.
+ */
+jrpc_async_t *jrpc_async_open( jrpc_conn_t *conn );
+ssize_t jrpc_async_call( jrpc_async_t *as, jrpc_req_t *req,
+			 jrpc_async_cb_t cb, void *arg );
+/* poll it for input, then call jrpc_async_dispatch() */
+int jrpc_async_fd( jrpc_async_t *as );
+size_t jrpc_async_pending( jrpc_async_t *as );
+/* completes calls whose replies arrived, returns how many or error */
+ssize_t jrpc_async_dispatch( jrpc_async_t *as );
+/* waits up to timeout ms (-1 forever) until at least one call completes */
+ssize_t jrpc_async_wait( jrpc_async_t *as, int timeout );
+/* pending calls complete with JRPC_ERR_RECV, don't use from a callback */
+void jrpc_async_close( jrpc_async_t *as );
+
+/*
+ * Method table. The server builds a hash index from jrpc_t.methods when
+ * it starts, methods can be added (or replaced) and removed while it runs.
+ * Names are copied and specs compiled then, handler arrays must stay
+ * valid. A bad spec fails the server start, or jrpc_method_add().
+ */
+int jrpc_method_find( jrpc_t *jrpc, const char *name, size_t len,
+		      jrpc_method_t *m );
+int jrpc_method_add( jrpc_t *jrpc, const jrpc_method_t *m );
+int jrpc_method_remove( jrpc_t *jrpc, const char *name );
+
+/*
+ * Result cache. Calls to methods with cache_ms set are looked up by name
+ * and params (key order doesn't matter) and a result still fresh is sent
+ * again without running the handlers, only the id is put in. Error
+ * replies, deferred ones and calls in a batch aren't cached, the least
+ * recently used results go once jrpc_t.cache_max is reached.
+ *
+ * Handlers changing what a cached method returns drop the stale results:
+ * those of method for jparams, all of method's if jparams is NULL, or
+ * everything if method is NULL too. Returns how many, -1 - no cache.
+ */
+int jrpc_cache_invalidate( jrpc_t *jrpc, const char *method, json_t *jparams );
+
+/*
+ * Snapshot of a running server's counters, summed over the loops without
+ * stopping them. Free with jrpc_stats_free().
+ */
+int jrpc_server_stats( jrpc_t *jrpc, jrpc_stats_t *st );
+void jrpc_stats_free( jrpc_stats_t *st );
+/* upper bound of the handler time percentile p (0-100), us */
+uint64_t jrpc_stats_percentile( const jrpc_method_stats_t *ms, double p );
+json_t *jrpc_stats_json( const jrpc_stats_t *st );
 
 /* to be used in method handlers */
 ssize_t jrpc_send_reply (ipsc_t *ipsc, json_t *jobj, json_t *jid, int type);
+/*
+ * ms until the caller of the request being served gives up, as sent with
+ * JRPC_CONN_FLAG_DEADLINE; 0 - too late already, -1 - no deadline
+ */
+long jrpc_time_left (void);
+/*
+ * Answer later: a handler takes the handle, returns 0 and hands it over to
+ * whatever finishes the job. jrpc_reply_complete() may be called from any
+ * thread, once; the loop serving the connection sends the reply, or drops
+ * it if the connection is gone by then. Complete every handle, jobj NULL
+ * if there is nothing to say: until then it counts against
+ * jrpc_t.maxinflight, or until its connection closes. NULL outside a
+ * handler and for calls inside a batch, those have to reply right away.
+ */
+jrpc_reply_handle_t *jrpc_reply_defer (ipsc_t *ipsc, json_t *jid);
+ssize_t jrpc_reply_complete (jrpc_reply_handle_t *h, json_t *jobj, int type);
 
 /* error helpers */
 ssize_t jrpc_error( ipsc_t *ipsc, json_t *jid, int code, const char *message );
@@ -0,0 +1,660 @@
+/**
+ * This file is part of libipsc library code.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See LICENCE.txt file for more details.
+ */
+
+/*
+ * Shared memory backend: a memfd holding two single producer / single
+ * consumer byte rings, one per direction, plus an eventfd per side to
+ * wake it up. The client sets everything up and hands the fds over the
+ * Unix socket it connected with; from then on the socket only tells
+ * whether the peer is still there. While both sides keep the rings busy
+ * no syscall is made, a side only gets its bell rung after saying it is
+ * going to sleep.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include "ipsc.h"
+
+#define IPSC_SHM_VERSION	1
+#define IPSC_SHM_HDRLEN		4096	/* header page, rings follow */
+#define IPSC_SHM_LINE		64
+#define IPSC_SHM_FDS		3	/* memfd, client bell, server bell */
+#define IPSC_SHM_FDS_MAX	16	/* room to see a client sending more */
+/* the server maps it only if the client can't change its size any more */
+#define IPSC_SHM_SEALS		(F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+/* one counter per cache line, the two sides don't fight over them */
+typedef struct ipsc_shm_line_t {
+	uint64_t v;
+	char pad[IPSC_SHM_LINE - sizeof(uint64_t)];
+} ipsc_shm_line_t;
+
+/* shared between the processes, 0 - client to server ring/side, 1 - back */
+typedef struct ipsc_shm_hdr_t {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;			/* bytes in each ring, power of 2 */
+	ipsc_shm_line_t head[2];	/* bytes ever written, by producer */
+	ipsc_shm_line_t tail[2];	/* bytes ever read, by consumer */
+	ipsc_shm_line_t waiting[2];	/* side is going to sleep, ring it */
+	ipsc_shm_line_t closed[2];	/* side has gone */
+} ipsc_shm_hdr_t;
+
+struct ipsc_shm_t {
+	ipsc_shm_hdr_t *hdr;
+	size_t maplen;
+	uint64_t size;
+	char *ring[2];
+	int side;			/* 0 - client, 1 - server */
+	int bell[2];			/* eventfds, bell[side] is ours */
+};
+
+static inline void ipsc_cpu_relax( void )
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__( "yield" );
+#endif
+}
+
+static uint64_t ipsc_now_ns( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* spinning on a single CPU only keeps the peer from running */
+static uint64_t ipsc_spin_ns( void )
+{
+	static int ncpu;
+
+	if ( !ncpu )
+		__atomic_store_n( &ncpu, (int)sysconf( _SC_NPROCESSORS_ONLN ),
+				  __ATOMIC_RELAXED );
+
+	return ncpu > 1 ? IPSC_SHM_SPIN_NS : 0;
+}
+
+static int ipsc_shm_bell( int fd )
+{
+	uint64_t one = 1;
+
+	if ( write( fd, &one, sizeof one ) != sizeof one && errno != EAGAIN )
+		return -1;
+
+	return 0;
+}
+
+static int ipsc_shm_gone( ipsc_shm_t *shm )
+{
+	return __atomic_load_n( &shm->hdr->closed[!shm->side].v,
+				__ATOMIC_ACQUIRE ) != 0;
+}
+
+/* counters the peer has messed up, don't trust anything it says further */
+static uint64_t ipsc_shm_broken( ipsc_shm_t *shm )
+{
+	__atomic_store_n( &shm->hdr->closed[!shm->side].v, 1, __ATOMIC_RELEASE );
+	return 0;
+}
+
+/* bytes waiting in our receive ring */
+static uint64_t ipsc_shm_avail( ipsc_shm_t *shm )
+{
+	int r = !shm->side;
+	uint64_t n = __atomic_load_n( &shm->hdr->head[r].v, __ATOMIC_ACQUIRE ) -
+		     shm->hdr->tail[r].v;
+
+	return n > shm->size ? ipsc_shm_broken( shm ) : n;
+}
+
+/* bytes free in our send ring */
+static uint64_t ipsc_shm_room( ipsc_shm_t *shm )
+{
+	int r = shm->side;
+	uint64_t n = shm->hdr->head[r].v -
+		     __atomic_load_n( &shm->hdr->tail[r].v, __ATOMIC_ACQUIRE );
+
+	return n > shm->size ? ipsc_shm_broken( shm ) : shm->size - n;
+}
+
+/* made progress the peer may be sleeping on, wake it if it said so */
+static void ipsc_shm_kick( ipsc_shm_t *shm )
+{
+	__atomic_thread_fence( __ATOMIC_SEQ_CST );
+	if ( !__atomic_load_n( &shm->hdr->waiting[!shm->side].v,
+			       __ATOMIC_RELAXED ) )
+		return;
+	if ( __atomic_exchange_n( &shm->hdr->waiting[!shm->side].v, 0,
+				  __ATOMIC_ACQ_REL ) )
+		ipsc_shm_bell( shm->bell[!shm->side] );
+}
+
+static int ipsc_shm_ready( ipsc_shm_t *shm, int want_room )
+{
+	if ( ipsc_shm_gone( shm ) )
+		return 1;
+
+	return want_room ? ipsc_shm_room( shm ) > 0 : ipsc_shm_avail( shm ) > 0;
+}
+
+/*
+ * Spin a little, then sleep on our bell until there is data (or room),
+ * the peer leaves or timeout msecs pass (< 0 - forever)
+ */
+static int ipsc_shm_wait( ipsc_t *ipsc, int want_room, int timeout )
+{
+	ipsc_shm_t *shm = ipsc->shm;
+	uint64_t cnt;
+	uint64_t until;
+	struct pollfd pfd[2];
+	int rc;
+
+	until = ipsc_now_ns() + ipsc_spin_ns();
+	do {
+		if ( ipsc_shm_ready( shm, want_room ) )
+			return 0;
+		ipsc_cpu_relax();
+	} while ( ipsc_now_ns() < until );
+
+	pfd[0].fd     = shm->bell[shm->side];
+	pfd[0].events = POLLIN;
+	pfd[1].fd     = ipsc->sd;
+	pfd[1].events = POLLIN;
+
+	while ( 1 ) {
+		__atomic_store_n( &shm->hdr->waiting[shm->side].v, 1,
+				  __ATOMIC_RELAXED );
+		__atomic_thread_fence( __ATOMIC_SEQ_CST );
+		if ( ipsc_shm_ready( shm, want_room ) ) {
+			__atomic_store_n( &shm->hdr->waiting[shm->side].v, 0,
+					  __ATOMIC_RELAXED );
+			return 0;
+		}
+
+		rc = poll( pfd, 2, timeout );
+		if ( rc < 0 && errno != EINTR )
+			return -1;
+		if ( rc == 0 ) {
+			__atomic_store_n( &shm->hdr->waiting[shm->side].v, 0,
+					  __ATOMIC_RELAXED );
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if ( pfd[0].revents & POLLIN ) {
+			while ( read( pfd[0].fd, &cnt, sizeof cnt ) == -1 &&
+				errno == EINTR )
+				;
+		}
+		/* nothing but a hang up ever comes on the socket */
+		if ( pfd[1].revents )
+			__atomic_store_n( &shm->hdr->closed[!shm->side].v, 1,
+					  __ATOMIC_RELEASE );
+	}
+}
+
+static void ipsc_shm_free( ipsc_shm_t *shm )
+{
+	if ( !shm )
+		return;
+
+	if ( shm->hdr )
+		munmap( shm->hdr, shm->maplen );
+	if ( shm->bell[0] >= 0 )
+		close( shm->bell[0] );
+	if ( shm->bell[1] >= 0 )
+		close( shm->bell[1] );
+	free( shm );
+}
+
+static ipsc_shm_t *ipsc_shm_map( int fd, size_t maplen, int side )
+{
+	ipsc_shm_t *shm = (ipsc_shm_t *)malloc( sizeof *shm );
+	if ( !shm )
+		return NULL;
+
+	shm->bell[0] = -1;
+	shm->bell[1] = -1;
+	shm->side    = side;
+	shm->maplen  = maplen;
+	shm->hdr     = (ipsc_shm_hdr_t *)mmap( NULL, maplen,
+					      PROT_READ | PROT_WRITE,
+					      MAP_SHARED, fd, 0 );
+	if ( shm->hdr == MAP_FAILED ) {
+		free( shm );
+		return NULL;
+	}
+
+	shm->size    = (maplen - IPSC_SHM_HDRLEN) / 2;
+	shm->ring[0] = (char *)shm->hdr + IPSC_SHM_HDRLEN;
+	shm->ring[1] = shm->ring[0] + shm->size;
+
+	return shm;
+}
+
+/*
+ * Client side: switch a freshly connected Unix stream socket over to
+ * shared memory rings of size bytes each (0 - IPSC_SHM_RING), waiting up
+ * to timeout msecs for the server to agree. On failure the socket is
+ * left in an unknown state, reconnect.
+ */
+int ipsc_shm_open( ipsc_t *ipsc, size_t size, unsigned int timeout )
+{
+#ifdef HAVE_MEMFD_CREATE
+	int fd = -1;
+	int fds[IPSC_SHM_FDS];
+	unsigned char c = IPSC_SHM_MAGIC;
+	ipsc_shm_t *shm = NULL;
+	struct iovec iov;
+	struct msghdr msg;
+	union {
+		char buf[CMSG_SPACE(sizeof fds)];
+		struct cmsghdr align;
+	} u;
+	struct cmsghdr *cmsg;
+	size_t ring = IPSC_BUF_MIN;
+
+	if ( ipsc->shm || ipsc->addr->sa_family != AF_LOCAL ||
+	     ipsc->type != SOCK_STREAM || size > IPSC_SHM_RING_MAX ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ( !size )
+		size = IPSC_SHM_RING;
+	while ( ring < size )
+		ring <<= 1;
+
+	fd = memfd_create( "ipsc", MFD_CLOEXEC | MFD_ALLOW_SEALING );
+	if ( fd == -1 )
+		return -1;
+	if ( ftruncate( fd, IPSC_SHM_HDRLEN + 2 * ring ) ||
+	     fcntl( fd, F_ADD_SEALS, IPSC_SHM_SEALS ) )
+		goto exit;
+
+	shm = ipsc_shm_map( fd, IPSC_SHM_HDRLEN + 2 * ring, 0 );
+	if ( !shm )
+		goto exit;
+
+	shm->hdr->magic   = IPSC_SHM_MAGIC;
+	shm->hdr->version = IPSC_SHM_VERSION;
+	shm->hdr->size    = ring;
+
+	shm->bell[0] = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	shm->bell[1] = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	if ( shm->bell[0] == -1 || shm->bell[1] == -1 )
+		goto exit;
+
+	fds[0] = fd;
+	fds[1] = shm->bell[0];
+	fds[2] = shm->bell[1];
+
+	iov.iov_base = &c;
+	iov.iov_len  = 1;
+	memset( &msg, 0, sizeof msg );
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = u.buf;
+	msg.msg_controllen = sizeof u.buf;
+	cmsg = CMSG_FIRSTHDR( &msg );
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN( sizeof fds );
+	memcpy( CMSG_DATA( cmsg ), fds, sizeof fds );
+
+	if ( sendmsg( ipsc->sd, &msg, MSG_NOSIGNAL ) != 1 )
+		goto exit;
+
+	/* an old server takes the magic for garbage and answers otherwise */
+	c = 0;
+	if ( ipsc_recvn( ipsc, &c, 1, timeout ) != 1 )
+		goto exit;
+	if ( c != IPSC_SHM_MAGIC ) {
+		errno = EPROTO;
+		goto exit;
+	}
+
+	close( fd );
+	ipsc->shm = shm;
+	return 0;
+
+exit:
+	if ( fd >= 0 )
+		close( fd );
+	ipsc_shm_free( shm );
+	return -1;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* an eventfd and nothing else, a pipe or socket there could block us */
+static int ipsc_shm_is_bell( int fd )
+{
+	char path[32];
+	char link[32];
+	ssize_t n;
+
+	snprintf( path, sizeof path, "/proc/self/fd/%d", fd );
+	n = readlink( path, link, sizeof link - 1 );
+	if ( n < 0 )
+		return 0;
+	link[n] = '\0';
+
+	return !strcmp( link, "anon_inode:[eventfd]" );
+}
+
+/*
+ * Server side: take the rings over from a client that sent IPSC_SHM_MAGIC
+ * and watch our bell in the epoll set the connection is in
+ */
+int ipsc_shm_accept( ipsc_t *ipsc )
+{
+	int i;
+	int k;
+	int n = 0;
+	int nfds = 0;
+	int fds[IPSC_SHM_FDS_MAX];
+	int seals;
+	unsigned char c = 0;
+	ipsc_shm_t *shm = NULL;
+	struct stat st;
+	struct iovec iov;
+	struct msghdr msg;
+	union {
+		char buf[CMSG_SPACE(sizeof fds)];
+		struct cmsghdr align;
+	} u;
+	struct cmsghdr *cmsg;
+	struct epoll_event ev;
+	ssize_t rb;
+
+	iov.iov_base = &c;
+	iov.iov_len  = 1;
+	memset( &msg, 0, sizeof msg );
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = u.buf;
+	msg.msg_controllen = sizeof u.buf;
+
+	do {
+		rb = recvmsg( ipsc->sd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC );
+	} while ( rb == -1 && errno == EINTR );
+	if ( rb != 1 )
+		return -1;
+
+	/* every fd that came is ours now, all of them get closed on failure */
+	for ( cmsg = CMSG_FIRSTHDR( &msg ); cmsg;
+	      cmsg = CMSG_NXTHDR( &msg, cmsg ) ) {
+		if ( cmsg->cmsg_level != SOL_SOCKET ||
+		     cmsg->cmsg_type != SCM_RIGHTS )
+			continue;
+		k = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if ( k > IPSC_SHM_FDS_MAX - nfds )
+			k = IPSC_SHM_FDS_MAX - nfds;
+		memcpy( fds + nfds, CMSG_DATA( cmsg ), k * sizeof(int) );
+		nfds += k;
+		n++;
+	}
+
+	errno = EPROTO;
+	if ( c != IPSC_SHM_MAGIC || n != 1 || nfds != IPSC_SHM_FDS ||
+	     (msg.msg_flags & MSG_CTRUNC) )
+		goto exit;
+
+	/* a client shrinking it later would get us killed by SIGBUS */
+	seals = fcntl( fds[0], F_GET_SEALS );
+	if ( seals == -1 || (seals & IPSC_SHM_SEALS) != IPSC_SHM_SEALS ||
+	     fstat( fds[0], &st ) ||
+	     st.st_size < IPSC_SHM_HDRLEN + 2 * IPSC_BUF_MIN ||
+	     st.st_size > IPSC_SHM_HDRLEN + 2 * IPSC_SHM_RING_MAX ||
+	     !ipsc_shm_is_bell( fds[1] ) || !ipsc_shm_is_bell( fds[2] ) ) {
+		errno = EPROTO;
+		goto exit;
+	}
+
+	shm = ipsc_shm_map( fds[0], st.st_size, 1 );
+	if ( !shm )
+		goto exit;
+	if ( shm->hdr->magic != IPSC_SHM_MAGIC ||
+	     shm->hdr->version != IPSC_SHM_VERSION ||
+	     shm->hdr->size != shm->size ||
+	     (shm->size & (shm->size - 1)) ) {
+		errno = EPROTO;
+		goto exit;
+	}
+
+	close( fds[0] );
+	shm->bell[0] = fds[1];
+	shm->bell[1] = fds[2];
+	nfds = 0;
+
+	if ( ipsc->epfd >= 0 ) {
+		ev.events   = EPOLLIN | EPOLLET;
+		ev.data.u64 = (uintptr_t)ipsc | IPSC_EV_SHM;
+		if ( epoll_ctl( ipsc->epfd, EPOLL_CTL_ADD, shm->bell[1], &ev ) )
+			goto exit;
+	}
+
+	c = IPSC_SHM_MAGIC;
+	if ( send( ipsc->sd, &c, 1, MSG_NOSIGNAL ) != 1 )
+		goto exit;
+
+	ipsc->shm = shm;
+	return 0;
+
+exit:
+	for ( i = 0; i < nfds; i++ )
+		close( fds[i] );
+	if ( shm && ipsc->epfd >= 0 && shm->bell[1] >= 0 )
+		epoll_ctl( ipsc->epfd, EPOLL_CTL_DEL, shm->bell[1], NULL );
+	ipsc_shm_free( shm );
+	return -1;
+}
+
+/*
+ * Copy out up to len bytes, waiting for at least min of them up to
+ * timeout msecs (< 0 - forever); peek leaves them in the ring. Returns
+ * fewer than min only once the peer has gone, -1 with EAGAIN when min is
+ * 0 and there is nothing.
+ */
+ssize_t ipsc_shm_read( ipsc_t *ipsc, void *buf, size_t len, size_t min,
+		       int timeout, int peek )
+{
+	ipsc_shm_t *shm = ipsc->shm;
+	int r = !shm->side;
+	size_t got = 0;
+	uint64_t n;
+	uint64_t avail;
+	uint64_t off;
+	uint64_t first;
+	uint64_t tail;
+
+	while ( got < len ) {
+		tail  = shm->hdr->tail[r].v + (peek ? got : 0);
+		avail = ipsc_shm_avail( shm );
+		/*
+		 * peeked bytes stay in the ring, fewer than that means the
+		 * peer broke the counters (avail is 0 then); copy nothing more
+		 */
+		if ( peek && avail < got ) {
+			ipsc_shm_broken( shm );
+			break;
+		}
+		n = avail - (peek ? got : 0);
+		if ( n > shm->size ) {
+			ipsc_shm_broken( shm );
+			break;
+		}
+		if ( n > len - got )
+			n = len - got;
+
+		if ( n ) {
+			off   = tail & (shm->size - 1);
+			first = shm->size - off < n ? shm->size - off : n;
+			memcpy( (char *)buf + got, shm->ring[r] + off, first );
+			memcpy( (char *)buf + got + first, shm->ring[r], n - first );
+			got += n;
+			if ( !peek ) {
+				__atomic_store_n( &shm->hdr->tail[r].v, tail + n,
+						  __ATOMIC_RELEASE );
+				ipsc_shm_kick( shm );
+			}
+			continue;
+		}
+
+		if ( got >= min && (got || min) )
+			break;
+		if ( ipsc_shm_gone( shm ) && !ipsc_shm_avail( shm ) )
+			break;
+		if ( !min ) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if ( peek )
+			break;
+		if ( ipsc_shm_wait( ipsc, 0, timeout ) )
+			return got ? (ssize_t)got : -1;
+	}
+
+	return got;
+}
+
+/* as much as there is room for, never waits; -1 - EPIPE, peer gone */
+ssize_t ipsc_shm_put( ipsc_t *ipsc, const void *buf, size_t len )
+{
+	ipsc_shm_t *shm = ipsc->shm;
+	int r = shm->side;
+	uint64_t n;
+	uint64_t off;
+	uint64_t first;
+	uint64_t head;
+
+	if ( ipsc_shm_gone( shm ) ) {
+		errno = EPIPE;
+		return -1;
+	}
+
+	head = shm->hdr->head[r].v;
+	n = ipsc_shm_room( shm );
+	if ( n > len )
+		n = len;
+	if ( !n )
+		return 0;
+
+	off   = head & (shm->size - 1);
+	first = shm->size - off < n ? shm->size - off : n;
+	memcpy( shm->ring[r] + off, buf, first );
+	memcpy( shm->ring[r], (const char *)buf + first, n - first );
+	__atomic_store_n( &shm->hdr->head[r].v, head + n, __ATOMIC_RELEASE );
+	ipsc_shm_kick( shm );
+
+	return n;
+}
+
+/* all of it or -1, EPIPE once the peer is gone */
+ssize_t ipsc_shm_write( ipsc_t *ipsc, const void *buf, size_t len )
+{
+	size_t put = 0;
+	ssize_t n;
+
+	while ( put < len ) {
+		n = ipsc_shm_put( ipsc, (const char *)buf + put, len - put );
+		if ( n < 0 )
+			return -1;
+		if ( !n && ipsc_shm_wait( ipsc, 1, -1 ) )
+			return -1;
+		put += n;
+	}
+
+	return put;
+}
+
+/*
+ * Output is queued, ask for the bell once the peer makes room; 1 - there
+ * is room already, go on writing
+ */
+int ipsc_shm_want_room( ipsc_t *ipsc )
+{
+	ipsc_shm_t *shm = ipsc->shm;
+
+	__atomic_store_n( &shm->hdr->waiting[shm->side].v, 1, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_SEQ_CST );
+	if ( !ipsc_shm_ready( shm, 1 ) )
+		return 0;
+
+	__atomic_store_n( &shm->hdr->waiting[shm->side].v, 0, __ATOMIC_RELAXED );
+	return 1;
+}
+
+/* 1 - data for the callback, 0 - nothing, -1 - nothing and peer gone */
+int ipsc_shm_pending( ipsc_t *ipsc )
+{
+	if ( ipsc_shm_avail( ipsc->shm ) )
+		return 1;
+
+	return ipsc_shm_gone( ipsc->shm ) ? -1 : 0;
+}
+
+/*
+ * Event loop is about to go back to epoll: ask for the bell, unless more
+ * arrived meanwhile (returns 1 then)
+ */
+int ipsc_shm_sleep( ipsc_t *ipsc )
+{
+	ipsc_shm_t *shm = ipsc->shm;
+
+	__atomic_store_n( &shm->hdr->waiting[shm->side].v, 1, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_SEQ_CST );
+	if ( !ipsc_shm_ready( shm, 0 ) )
+		return 0;
+
+	__atomic_store_n( &shm->hdr->waiting[shm->side].v, 0, __ATOMIC_RELAXED );
+	return 1;
+}
+
+void ipsc_shm_close( ipsc_t *ipsc )
+{
+	ipsc_shm_t *shm = ipsc->shm;
+
+	if ( !shm )
+		return;
+
+	__atomic_store_n( &shm->hdr->closed[shm->side].v, 1, __ATOMIC_RELEASE );
+	ipsc_shm_bell( shm->bell[!shm->side] );
+
+	/* the client may hold the same eventfd, closing won't unregister it */
+	if ( ipsc->epfd >= 0 && shm->side )
+		epoll_ctl( ipsc->epfd, EPOLL_CTL_DEL, shm->bell[1], NULL );
+
+	ipsc_shm_free( shm );
+	ipsc->shm = NULL;
+}
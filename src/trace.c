@@ -0,0 +1,163 @@
+/**
+ * This file is part of libjrpc library code.
+ *
+ * Copyright (C) 2014 Roman Yeryomin <roman@advem.lv>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See LICENCE.txt file for more details.
+ */
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+int jrpc_trace_level = JRPC_TRACE_DEFAULT_LEVEL;
+static unsigned int jrpc_trace_sample = 1;
+static __thread unsigned int jrpc_trace_tick;
+
+/*
+ * Writers claim a position with one atomic add and publish the record by
+ * storing its position + 1 into seq, so they never wait for each other
+ * or for the reader. Draining is rare and takes a lock.
+ */
+static jrpc_trace_rec_t jrpc_trace_ring[JRPC_TRACE_SLOTS];
+static uint64_t jrpc_trace_head;
+static uint64_t jrpc_trace_tail;
+static uint64_t jrpc_trace_missed;
+static pthread_mutex_t jrpc_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *jrpc_trace_names[] = {
+	"off", "err", "warn", "info", "msg", "debug"
+};
+
+void jrpc_trace_set_level( int level )
+{
+	if ( level < JRPC_TRACE_OFF )
+		level = JRPC_TRACE_OFF;
+	if ( level > JRPC_TRACE_DEBUG )
+		level = JRPC_TRACE_DEBUG;
+
+	__atomic_store_n( &jrpc_trace_level, level, __ATOMIC_RELAXED );
+}
+
+void jrpc_trace_set_sample( unsigned int n )
+{
+	__atomic_store_n( &jrpc_trace_sample, n ? n : 1, __ATOMIC_RELAXED );
+}
+
+void jrpc_trace_write( int level, const char *fmt, ... )
+{
+	unsigned int sample;
+	uint64_t pos;
+	jrpc_trace_rec_t *rec;
+	struct timespec ts;
+	va_list ap;
+	int len;
+
+	/* per-thread counter, sampling must not bounce a shared line */
+	sample = __atomic_load_n( &jrpc_trace_sample, __ATOMIC_RELAXED );
+	if ( level >= JRPC_TRACE_MSG && sample > 1 &&
+	     ++jrpc_trace_tick % sample )
+		return;
+
+	clock_gettime( CLOCK_REALTIME, &ts );
+
+	pos = __atomic_fetch_add( &jrpc_trace_head, 1, __ATOMIC_RELAXED );
+	rec = &jrpc_trace_ring[pos & (JRPC_TRACE_SLOTS - 1)];
+
+	__atomic_store_n( &rec->seq, 0, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+
+	rec->ns    = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->level = level;
+
+	va_start( ap, fmt );
+	len = vsnprintf( rec->text, sizeof rec->text, fmt, ap );
+	va_end( ap );
+
+	if ( len < 0 )
+		len = 0;
+	if ( len >= (int)sizeof rec->text )
+		len = sizeof rec->text - 1;
+	rec->len = len;
+
+	__atomic_store_n( &rec->seq, pos + 1, __ATOMIC_RELEASE );
+}
+
+size_t jrpc_trace_drain( jrpc_trace_cb_t cb, void *arg )
+{
+	size_t n = 0;
+	uint64_t head;
+	uint64_t seq;
+	jrpc_trace_rec_t *rec;
+	jrpc_trace_rec_t copy;
+
+	pthread_mutex_lock( &jrpc_trace_lock );
+
+	head = __atomic_load_n( &jrpc_trace_head, __ATOMIC_ACQUIRE );
+	if ( head - jrpc_trace_tail > JRPC_TRACE_SLOTS ) {
+		jrpc_trace_missed += head - jrpc_trace_tail - JRPC_TRACE_SLOTS;
+		jrpc_trace_tail = head - JRPC_TRACE_SLOTS;
+	}
+
+	for ( ; jrpc_trace_tail < head; jrpc_trace_tail++ ) {
+		rec = &jrpc_trace_ring[jrpc_trace_tail & (JRPC_TRACE_SLOTS - 1)];
+
+		seq = __atomic_load_n( &rec->seq, __ATOMIC_ACQUIRE );
+		/* claimed but not written yet, pick it up next time */
+		if ( seq < jrpc_trace_tail + 1 )
+			break;
+
+		memcpy( &copy, rec, sizeof copy );
+		__atomic_thread_fence( __ATOMIC_ACQUIRE );
+
+		/* overwritten by a writer that lapped us */
+		if ( seq != jrpc_trace_tail + 1 ||
+		     __atomic_load_n( &rec->seq, __ATOMIC_RELAXED ) != seq ) {
+			jrpc_trace_missed++;
+			continue;
+		}
+
+		copy.seq = seq;
+		if ( cb )
+			cb( &copy, arg );
+		n++;
+	}
+
+	pthread_mutex_unlock( &jrpc_trace_lock );
+	return n;
+}
+
+static void jrpc_trace_fprint( const jrpc_trace_rec_t *rec, void *arg )
+{
+	fprintf( (FILE *)arg, "%llu.%06llu %-5s %.*s\n",
+		 (unsigned long long)(rec->ns / 1000000000ULL),
+		 (unsigned long long)(rec->ns % 1000000000ULL / 1000),
+		 rec->level <= JRPC_TRACE_DEBUG ?
+		 jrpc_trace_names[rec->level] : "?", rec->len, rec->text );
+}
+
+size_t jrpc_trace_print( FILE *f )
+{
+	return jrpc_trace_drain( jrpc_trace_fprint, f );
+}
+
+uint64_t jrpc_trace_lost( void )
+{
+	uint64_t lost;
+
+	pthread_mutex_lock( &jrpc_trace_lock );
+	lost = jrpc_trace_missed;
+	pthread_mutex_unlock( &jrpc_trace_lock );
+
+	return lost;
+}
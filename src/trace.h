@@ -0,0 +1,74 @@
+/**
+ * This file is part of libjrpc library code.
+ *
+ * Copyright (C) 2014 Roman Yeryomin <roman@advem.lv>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See LICENCE.txt file for more details.
+ */
+#ifndef _LIBJRPC_TRACE_H_
+#define _LIBJRPC_TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* trace levels, each includes the ones before it */
+enum {
+	JRPC_TRACE_OFF,
+	JRPC_TRACE_ERR,
+	JRPC_TRACE_WARN,
+	JRPC_TRACE_INFO,
+	JRPC_TRACE_MSG,		/* every message sent and received, sampled */
+	JRPC_TRACE_DEBUG
+};
+
+#define JRPC_TRACE_DEFAULT_LEVEL	JRPC_TRACE_WARN
+#define JRPC_TRACE_SLOTS		1024	/* power of two */
+#define JRPC_TRACE_TEXT			200	/* longer records are cut */
+
+typedef struct jrpc_trace_rec_t {
+	uint64_t seq;		/* position in the trace, 0 - being written */
+	uint64_t ns;		/* CLOCK_REALTIME */
+	int level;
+	int len;		/* of text, without the terminating NUL */
+	char text[JRPC_TRACE_TEXT];
+} jrpc_trace_rec_t;
+
+typedef void (*jrpc_trace_cb_t)(const jrpc_trace_rec_t *rec, void *arg);
+
+/* read directly by jrpc_trace(), change through the setters */
+extern int jrpc_trace_level;
+
+/*
+ * A disabled trace point costs one load and compare, the arguments are
+ * not evaluated and nothing is formatted.
+ */
+#define jrpc_trace(level, fmt, args...) \
+	do { \
+		if (__builtin_expect (jrpc_trace_level >= (level), 0)) \
+			jrpc_trace_write ((level), fmt, ## args); \
+	} while (0)
+
+void jrpc_trace_set_level( int level );
+/* keep one in n JRPC_TRACE_MSG and finer records, 0 and 1 keep all */
+void jrpc_trace_set_sample( unsigned int n );
+void jrpc_trace_write( int level, const char *fmt, ... )
+	__attribute__ ((format (printf, 2, 3)));
+/*
+ * hand every record written since the last drain to cb, oldest first;
+ * returns how many, records overwritten before they were drained are
+ * counted by jrpc_trace_lost()
+ */
+size_t jrpc_trace_drain( jrpc_trace_cb_t cb, void *arg );
+size_t jrpc_trace_print( FILE *f );
+uint64_t jrpc_trace_lost( void );
+
+#endif /* _LIBJRPC_TRACE_H_ */
@@ -0,0 +1,189 @@
+/**
+ * This file is part of libjrpc library code.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See LICENCE.txt file for more details.
+ */
+
+/*
+ * Requests over jrpc_t.rate are turned down unparsed, the id picked out
+ * of the raw text: each busy reply has to carry the id of its own
+ * request and nothing that only looks like one.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+
+#define TEST_PORT	0xbe11
+
+static ssize_t echo( ipsc_t *ipsc, json_t *jparams, json_t *jid )
+{
+	return jrpc_send_reply( ipsc, jparams ? jparams : json_null(), jid,
+				JRPC_REPLY_TYPE_RESULT );
+}
+
+static jrpc_cb_t handlers[] = { echo, NULL };
+static jrpc_method_t methods[] = {
+	{ "echo", JRPC_CB_HAS_PARAMS, handlers, 0, 0, NULL, NULL },
+	JRPC_METHODS_END
+};
+
+static jrpc_t jrpc = JRPC_SERVER_DEFAULT;
+
+typedef struct test_case_t {
+	const char *req;
+	const char *id;		/* JSON of the id the reply has */
+} test_case_t;
+
+static const test_case_t cases[] = {
+	{ "{\"jsonrpc\":\"2.0\",\"method\":\"echo\",\"params\":[],\"id\":2}",
+	  "2" },
+	{ " \n{\"id\":\"a\\\"b\\\\\",\"method\":\"echo\"}", "\"a\\\"b\\\\\"" },
+	{ "{\"method\":\"echo\",\"params\":{\"x\":\"\\\"id\\\":9\"},\"id\":3}",
+	  "3" },
+	{ "{\"method\":\"echo\",\"params\":{\"id\":9},\"id\":4}", "4" },
+	{ "{\"params\":[{\"id\":7},[\"id\"]],\"id\":5,\"method\":\"echo\"}",
+	  "5" },
+	{ "{\"method\":\"id\",\"idx\":1,\"x\":\"id\",\"id\":6}", "6" },
+	{ "{\"method\":\"echo\",\"id\" : -1.5e3 }", "-1.5e3" },
+	{ "{\"method\":\"echo\",\"id\":null}", "null" },
+	{ "{\"id\":1,\"method\":\"echo\",\"id\":\"\\u00e9\\n\"}",
+	  "\"\\u00e9\\n\"" },
+	/* not worth looking into, or not valid JSON as it is, id null */
+	{ "{\"method\":\"echo\",\"id\":{\"a\":1}}", "null" },
+	{ "[{\"method\":\"echo\",\"id\":7}]", "null" },
+	{ "{\"method\":\"echo\",\"id\":foo}", "null" },
+	{ "{\"method\":\"echo\",\"id\":true}", "null" },
+	{ "{\"method\":\"echo\",\"id\":01}", "null" },
+	{ "{\"method\":\"echo\",\"id\":1.}", "null" },
+	{ "{\"method\":\"echo\",\"id\":1e+}", "null" },
+	{ "{\"method\":\"echo\",\"id\":\"\\x\"}", "null" },
+	{ "{\"method\":\"echo\",\"id\":\"\\u12\"}", "null" },
+	{ "{\"method\":\"echo\",\"id\":\"a\tb\"}", "null" },
+	/* escaped keys, any of them may be the id */
+	{ "{\"\\u0069d\":8,\"method\":\"echo\"}", "null" },
+	{ "{\"id\":8,\"x\\\",\\\"id\":1,\"method\":\"echo\"}", "null" },
+	{ NULL, NULL }
+};
+
+static void test_busy( void )
+{
+	ipsc_t *pair[2];
+	json_t *replies[2];
+	json_t *jerr;
+	json_t *jid;
+	int i;
+	int n;
+
+	CHECK( !test_pair( &jrpc, pair, 0 ) );
+
+	/* the first one is let through */
+	test_feed( pair, cases[0].req, strlen( cases[0].req ), 64 );
+	n = test_replies( pair[0], replies, 2 );
+	CHECK( n == 1 && !json_object_get( replies[0], "error" ) );
+	while ( n )
+		json_decref( replies[--n] );
+
+	for ( i = 0; cases[i].req; i++ ) {
+		test_feed( pair, cases[i].req, strlen( cases[i].req ), 64 );
+		n = test_replies( pair[0], replies, 2 );
+		CHECK( n == 1 );
+		if ( n != 1 ) {
+			printf( "  case %i: %i replies\n", i, n );
+			while ( n )
+				json_decref( replies[--n] );
+			continue;
+		}
+
+		jerr = json_object_get( replies[0], "error" );
+		CHECK( json_integer_value( json_object_get( jerr, "code" ) ) ==
+		       JRPC_CODE_BUSY );
+		jid = json_loads( cases[i].id, JSON_DECODE_ANY, NULL );
+		CHECK( json_equal( json_object_get( replies[0], "id" ), jid ) );
+		if ( !json_equal( json_object_get( replies[0], "id" ), jid ) )
+			printf( "  case %i: id not %s\n", i, cases[i].id );
+		json_decref( jid );
+		json_decref( replies[0] );
+	}
+
+	test_pair_close( pair );
+}
+
+static void test_long_id( void )
+{
+	ipsc_t *pair[2];
+	json_t *replies[2];
+	char req[512];
+	int n;
+
+	CHECK( !test_pair( &jrpc, pair, 0 ) );
+	test_feed( pair, cases[0].req, strlen( cases[0].req ), 64 );
+	test_replies( pair[0], replies, 0 );
+
+	/* too long to copy over */
+	n = sprintf( req, "{\"method\":\"echo\",\"id\":\"" );
+	memset( req + n, 'x', 200 );
+	strcpy( req + n + 200, "\"}" );
+	test_feed( pair, req, strlen( req ), 64 );
+	n = test_replies( pair[0], replies, 2 );
+	CHECK( n == 1 && json_is_null( json_object_get( replies[0], "id" ) ) );
+	while ( n )
+		json_decref( replies[--n] );
+
+	test_pair_close( pair );
+}
+
+static void test_notification( void )
+{
+	ipsc_t *pair[2];
+	json_t *replies[4];
+	const char *reqs =
+		"{\"method\":\"echo\",\"id\":1}"
+		"{\"method\":\"echo\",\"params\":{\"id\":2}}"
+		"{\"method\":\"echo\",\"params\":[\"id\"]}"
+		"{\"method\":\"echo\",\"id\":3}";
+	char ids[64];
+	int n;
+
+	CHECK( !test_pair( &jrpc, pair, 0 ) );
+
+	/* turned down too, but nothing goes back for them */
+	test_feed( pair, reqs, strlen( reqs ), strlen( reqs ) );
+	n = test_replies( pair[0], replies, 4 );
+	CHECK( !strcmp( test_ids( replies, n, ids, sizeof ids ), "1,3" ) );
+	while ( n )
+		json_decref( replies[--n] );
+
+	test_pair_close( pair );
+}
+
+int main( void )
+{
+	pthread_t tid;
+
+	jrpc.conn.port = TEST_PORT;
+	jrpc.methods = methods;
+	jrpc.rate = 1;
+	jrpc.burst = 1;
+	if ( test_server_start( &jrpc, &tid ) ) {
+		perror( "jrpc_server" );
+		return 99;
+	}
+
+	test_busy();
+	test_long_id();
+	test_notification();
+
+	test_server_stop( &jrpc, tid );
+	return test_done( "admit" );
+}
@@ -0,0 +1,283 @@
+/**
+ * This file is part of libjrpc library code.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See LICENCE.txt file for more details.
+ */
+
+/*
+ * The striped result cache: hits skip the handler, keys don't depend on
+ * the order of params, results expire, go when invalidated or evicted,
+ * and with threads calling and invalidating at once nobody gets a
+ * result for other params or one older than the last invalidation.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define TEST_PORT	0xbe12
+#define TEST_PORT_SMALL	0xbe13
+#define TEST_THREADS	4
+#define TEST_CALLS	2000
+#define TEST_KEYS	64
+
+static int runs;	/* handler calls */
+static int version;	/* what the handler's results depend on */
+static int done;	/* version invalidated for */
+
+/* {"a":n,"b":m} -> {"sum":n+m,"v":version} */
+static ssize_t sum( ipsc_t *ipsc, json_t *jparams, json_t *jid )
+{
+	json_t *jres;
+	ssize_t sb;
+
+	__atomic_add_fetch( &runs, 1, __ATOMIC_RELAXED );
+	jres = json_object();
+	json_object_set_new( jres, "sum", json_integer(
+		json_integer_value( json_object_get( jparams, "a" ) ) +
+		json_integer_value( json_object_get( jparams, "b" ) ) ) );
+	json_object_set_new( jres, "v", json_integer(
+		__atomic_load_n( &version, __ATOMIC_ACQUIRE ) ) );
+	sb = jrpc_send_reply( ipsc, jres, jid, JRPC_REPLY_TYPE_RESULT );
+	json_decref( jres );
+	return sb;
+}
+
+static jrpc_cb_t handlers[] = { sum, NULL };
+static jrpc_method_t methods[] = {
+	{ "sum", JRPC_CB_HAS_PARAMS, handlers, 0, 60000, NULL, NULL },
+	{ "other", JRPC_CB_HAS_PARAMS, handlers, 0, 60000, NULL, NULL },
+	{ "brief", JRPC_CB_HAS_PARAMS, handlers, 0, 50, NULL, NULL },
+	JRPC_METHODS_END
+};
+
+static jrpc_t jrpc = JRPC_SERVER_DEFAULT;
+static jrpc_t small = JRPC_SERVER_DEFAULT;
+
+static json_t *params( int a, int b )
+{
+	json_t *jparams = json_object();
+
+	json_object_set_new( jparams, "a", json_integer( a ) );
+	json_object_set_new( jparams, "b", json_integer( b ) );
+	return jparams;
+}
+
+/* the sum, -1 on no or a bad reply; *v gets the version */
+static int call( ipsc_t *pair[2], const char *method, json_t *jparams,
+		 int *v )
+{
+	json_t *jp = test_call( pair, method, jparams, 1 );
+	json_t *jres = json_object_get( jp, "result" );
+	int ret = -1;
+
+	if ( json_is_object( jres ) ) {
+		ret = (int)json_integer_value( json_object_get( jres, "sum" ) );
+		if ( v )
+			*v = (int)json_integer_value( json_object_get( jres,
+								       "v" ) );
+	}
+
+	json_decref( jp );
+	return ret;
+}
+
+/* a call with fresh params, the cache may keep them */
+static int call_new( ipsc_t *pair[2], const char *method, int a, int b )
+{
+	json_t *jparams = params( a, b );
+	int ret = call( pair, method, jparams, NULL );
+
+	json_decref( jparams );
+	return ret;
+}
+
+static void test_hits( void )
+{
+	ipsc_t *pair[2];
+	json_t *jab = json_loads( "{\"a\":1,\"b\":2}", 0, NULL );
+	json_t *jba = json_loads( "{\"b\":2,\"a\":1}", 0, NULL );
+	int n;
+
+	CHECK( !test_pair( &jrpc, pair, 1 ) );
+
+	runs = 0;
+	CHECK( call( pair, "sum", jab, NULL ) == 3 );
+	CHECK( call( pair, "sum", jab, NULL ) == 3 );
+	CHECK( runs == 1 );
+
+	/* same params, other order */
+	CHECK( call( pair, "sum", jba, NULL ) == 3 );
+	CHECK( runs == 1 );
+
+	/* other params or method, other results */
+	CHECK( call_new( pair, "sum", 2, 1 ) == 3 );
+	CHECK( call_new( pair, "sum", 1, 3 ) == 4 );
+	CHECK( call_new( pair, "other", 1, 2 ) == 3 );
+	CHECK( runs == 4 );
+	CHECK( call_new( pair, "sum", 1, 3 ) == 4 );
+	CHECK( call( pair, "sum", jab, NULL ) == 3 );
+	CHECK( runs == 4 );
+
+	/* one of them, then all of sum's, then everything */
+	n = jrpc_cache_invalidate( &jrpc, "sum", jba );
+	CHECK( n == 1 );
+	CHECK( call( pair, "sum", jab, NULL ) == 3 && runs == 5 );
+	CHECK( call_new( pair, "sum", 1, 3 ) == 4 && runs == 5 );
+
+	n = jrpc_cache_invalidate( &jrpc, "sum", NULL );
+	CHECK( n == 3 );
+	CHECK( call_new( pair, "other", 1, 2 ) == 3 && runs == 5 );
+	CHECK( call_new( pair, "sum", 1, 3 ) == 4 && runs == 6 );
+
+	n = jrpc_cache_invalidate( &jrpc, NULL, NULL );
+	CHECK( n == 2 );
+	CHECK( call_new( pair, "other", 1, 2 ) == 3 && runs == 7 );
+	CHECK( jrpc_cache_invalidate( &jrpc, "sum", jab ) == 0 );
+
+	test_pair_close( pair );
+	json_decref( jab );
+	json_decref( jba );
+}
+
+static void test_expiry( void )
+{
+	ipsc_t *pair[2];
+
+	CHECK( !test_pair( &jrpc, pair, 1 ) );
+
+	runs = 0;
+	CHECK( call_new( pair, "brief", 5, 5 ) == 10 );
+	CHECK( call_new( pair, "brief", 5, 5 ) == 10 );
+	CHECK( runs == 1 );
+	usleep( 80000 );
+	CHECK( call_new( pair, "brief", 5, 5 ) == 10 );
+	CHECK( runs == 2 );
+
+	test_pair_close( pair );
+}
+
+static void test_eviction( void )
+{
+	ipsc_t *pair[2];
+	int i;
+	int bad = 0;
+
+	CHECK( !test_pair( &small, pair, 1 ) );
+
+	/* far more than fits, what's left still has to be right */
+	runs = 0;
+	for ( i = 0; i < 1000; i++ )
+		bad += call_new( pair, "sum", i, 1 ) != i + 1;
+	CHECK( runs == 1000 );
+	/* the latest first, before the misses push them out */
+	for ( i = 999; i >= 0; i-- )
+		bad += call_new( pair, "sum", i, 1 ) != i + 1;
+	CHECK( !bad );
+	CHECK( runs > 1500 && runs < 2000 );
+
+	test_pair_close( pair );
+}
+
+static void *caller( void *arg )
+{
+	ipsc_t *pair[2];
+	json_t *jparams[TEST_KEYS];
+	unsigned seed = (unsigned)(size_t)arg;
+	int *bad = (int *)arg;
+	int i;
+	int k;
+	int v;
+	int since;
+
+	*bad = 0;
+	if ( test_pair( &jrpc, pair, 1 ) ) {
+		*bad = -1;
+		return NULL;
+	}
+	for ( k = 0; k < TEST_KEYS; k++ )
+		jparams[k] = params( k, 1000 );
+
+	for ( i = 0; i < TEST_CALLS; i++ ) {
+		k = rand_r( &seed ) % TEST_KEYS;
+		since = __atomic_load_n( &done, __ATOMIC_ACQUIRE );
+		if ( call( pair, k & 1 ? "sum" : "other", jparams[k], &v ) !=
+		     k + 1000 || v < since )
+			++*bad;
+	}
+
+	for ( k = 0; k < TEST_KEYS; k++ )
+		json_decref( jparams[k] );
+	test_pair_close( pair );
+	return NULL;
+}
+
+static void test_threads( void )
+{
+	pthread_t tid[TEST_THREADS];
+	int bad[TEST_THREADS];
+	json_t *jparams = params( 2, 1000 );
+	int i;
+
+	for ( i = 0; i < TEST_THREADS; i++ )
+		CHECK( !pthread_create( &tid[i], NULL, caller, &bad[i] ) );
+
+	/* change what results depend on, then drop the ones seen so far */
+	for ( i = 1; i <= 300; i++ ) {
+		__atomic_store_n( &version, i, __ATOMIC_RELEASE );
+		if ( i % 3 == 0 )
+			jrpc_cache_invalidate( &jrpc, NULL, NULL );
+		else if ( i % 3 == 1 ) {
+			jrpc_cache_invalidate( &jrpc, "sum", NULL );
+			jrpc_cache_invalidate( &jrpc, "other", NULL );
+		} else {
+			jrpc_cache_invalidate( &jrpc, NULL, NULL );
+			jrpc_cache_invalidate( &jrpc, "other", jparams );
+		}
+		__atomic_store_n( &done, i, __ATOMIC_RELEASE );
+		usleep( 100 );
+	}
+
+	for ( i = 0; i < TEST_THREADS; i++ ) {
+		pthread_join( tid[i], NULL );
+		CHECK( bad[i] == 0 );
+	}
+	json_decref( jparams );
+}
+
+int main( void )
+{
+	pthread_t tid;
+	pthread_t tid_small;
+
+	jrpc.conn.port = TEST_PORT;
+	jrpc.methods = methods;
+	small.conn.port = TEST_PORT_SMALL;
+	small.methods = methods;
+	small.cache_max = 16 * 1024;
+	if ( test_server_start( &jrpc, &tid ) ||
+	     test_server_start( &small, &tid_small ) ) {
+		perror( "jrpc_server" );
+		return 99;
+	}
+
+	test_hits();
+	test_expiry();
+	test_eviction();
+	test_threads();
+
+	test_server_stop( &small, tid_small );
+	test_server_stop( &jrpc, tid );
+	return test_done( "cache" );
+}
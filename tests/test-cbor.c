@@ -0,0 +1,181 @@
+/**
+ * This file is part of libjrpc library code.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See LICENCE.txt file for more details.
+ */
+
+/*
+ * jrpc_codec_cbor on its own: what it writes comes back the same, known
+ * encodings decode right, and cut short, unterminated, malformed or
+ * nested too deep input is NULL without reading past the end.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+
+#define TEST_DEEP	100000
+
+typedef struct test_buf_t {
+	char data[4096];
+	size_t len;
+} test_buf_t;
+
+static int put( const char *buf, size_t size, void *data )
+{
+	test_buf_t *b = (test_buf_t *)data;
+
+	if ( size > sizeof b->data - b->len )
+		return -1;
+	memcpy( b->data + b->len, buf, size );
+	b->len += size;
+	return 0;
+}
+
+/* decoded from exactly len bytes, a copy so ASan sees any overread */
+static json_t *decode( const char *buf, size_t len )
+{
+	char *copy = (char *)malloc( len ? len : 1 );
+	json_t *j;
+
+	memcpy( copy, buf, len );
+	j = jrpc_codec_cbor.decode( copy, len );
+	free( copy );
+	return j;
+}
+
+#define DECODE( lit )	decode( lit, sizeof lit - 1 )
+
+static void test_roundtrip( void )
+{
+	const char *docs[] = {
+		"{\"jsonrpc\":\"2.0\",\"method\":\"m\",\"params\":[1,-1,"
+		"23,24,255,256,65536,-4294967297,9223372036854775807,"
+		"-9223372036854775808],\"id\":7}",
+		"[0.5,-2.25,1e300,true,false,null,\"\",\"\\u00e9\\u4e2d\"]",
+		"{\"a\":{\"b\":{\"c\":[[],{},[[[]]]]}}}",
+		NULL
+	};
+	test_buf_t b;
+	json_t *j;
+	json_t *k;
+	int i;
+
+	for ( i = 0; docs[i]; i++ ) {
+		j = json_loads( docs[i], 0, NULL );
+		b.len = 0;
+		CHECK( j && !jrpc_codec_cbor.encode( j, put, &b ) );
+		k = decode( b.data, b.len );
+		CHECK( k && json_equal( j, k ) );
+		json_decref( j );
+		json_decref( k );
+	}
+}
+
+static void test_vectors( void )
+{
+	json_t *j;
+
+	j = DECODE( "\x9f\x01\x02\xff" );
+	CHECK( json_is_array( j ) && json_array_size( j ) == 2 &&
+	       json_integer_value( json_array_get( j, 1 ) ) == 2 );
+	json_decref( j );
+
+	j = DECODE( "\xbf\x61\x61\x01\xff" );
+	CHECK( json_is_object( j ) &&
+	       json_integer_value( json_object_get( j, "a" ) ) == 1 );
+	json_decref( j );
+
+	/* tags are skipped, half floats widened */
+	j = DECODE( "\xc1\x9f\xf9\x3e\x00\x80\xff" );
+	CHECK( json_is_array( j ) &&
+	       json_real_value( json_array_get( j, 0 ) ) == 1.5 &&
+	       json_array_size( json_array_get( j, 1 ) ) == 0 );
+	json_decref( j );
+}
+
+static void test_unterminated( void )
+{
+	/* indefinite length items that never see their break */
+	CHECK( !DECODE( "\x9f\x01\x02" ) );
+	CHECK( !DECODE( "\x9f" ) );
+	CHECK( !DECODE( "\xbf\x61\x61\x01" ) );
+	CHECK( !DECODE( "\xbf\x61\x61" ) );
+	CHECK( !DECODE( "\x9f\x9f\xff" ) );
+	CHECK( !DECODE( "\x82\x9f\x01\xff" ) );
+}
+
+static void test_truncated( void )
+{
+	CHECK( !decode( "", 0 ) );
+	CHECK( !DECODE( "\x19\x01" ) );
+	CHECK( !DECODE( "\xfb\x00\x00\x00" ) );
+	CHECK( !DECODE( "\x65" "a" ) );
+	CHECK( !DECODE( "\x83\x01\x02" ) );
+	CHECK( !DECODE( "\xa1\x61\x61" ) );
+	/* lengths no buffer could hold */
+	CHECK( !DECODE( "\x7b\xff\xff\xff\xff\xff\xff\xff\xff" "a" ) );
+	CHECK( !DECODE( "\x9b\x7f\xff\xff\xff\xff\xff\xff\xff\x01" ) );
+	CHECK( !DECODE( "\xbb\x7f\xff\xff\xff\xff\xff\xff\xff\x01" ) );
+}
+
+static void test_malformed( void )
+{
+	CHECK( !DECODE( "\x1c" ) );		/* reserved additional info */
+	CHECK( !DECODE( "\xff" ) );		/* break with nothing open */
+	CHECK( !DECODE( "\x81\xff" ) );
+	CHECK( !DECODE( "\x1f" ) );		/* indefinite integer */
+	CHECK( !DECODE( "\xdf\x00" ) );		/* indefinite tag */
+	CHECK( !DECODE( "\x7f\x61" "a" "\xff" ) );	/* chunked text */
+	CHECK( !DECODE( "\x5f\x41" "a" "\xff" ) );	/* chunked bytes */
+	CHECK( !DECODE( "\x41" "a" ) );		/* bytes, JSON has none */
+	CHECK( !DECODE( "\x62\xc3\x28" ) );	/* not UTF-8 */
+	CHECK( !DECODE( "\xa1\x01\x02" ) );	/* key not a string */
+	CHECK( !DECODE( "\xbf\x01\x02\xff" ) );
+	CHECK( !DECODE( "\x01\x02" ) );		/* more after the item */
+	CHECK( !DECODE( "\x9f\xff\xff" ) );
+}
+
+static void test_deep( void )
+{
+	char *buf = (char *)malloc( TEST_DEEP + 1 );
+	json_t *j;
+
+	memset( buf, 0x81, TEST_DEEP );
+	buf[TEST_DEEP] = 0;
+	CHECK( !jrpc_codec_cbor.decode( buf, TEST_DEEP + 1 ) );
+
+	memset( buf, 0x9f, TEST_DEEP );
+	CHECK( !jrpc_codec_cbor.decode( buf, TEST_DEEP ) );
+
+	/* a depth it does take */
+	memset( buf, 0x81, 100 );
+	buf[100] = 0;
+	j = jrpc_codec_cbor.decode( buf, 101 );
+	CHECK( json_is_array( j ) );
+	json_decref( j );
+
+	free( buf );
+}
+
+int main( void )
+{
+	test_roundtrip();
+	test_vectors();
+	test_unterminated();
+	test_truncated();
+	test_malformed();
+	test_deep();
+
+	return test_done( "cbor" );
+}
@@ -0,0 +1,281 @@
+/**
+ * This file is part of libjrpc library code.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See LICENCE.txt file for more details.
+ */
+
+/*
+ * Legacy unframed requests split at every byte, pipelined back to back,
+ * cut short, malformed and nested deep, and framed ones split the same
+ * way, all through the server's incremental reader.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "test.h"
+
+#define TEST_PORT	0xbe10
+#define TEST_DEEP	100000	/* brackets, way past what jansson parses */
+
+static ssize_t echo( ipsc_t *ipsc, json_t *jparams, json_t *jid )
+{
+	return jrpc_send_reply( ipsc, jparams ? jparams : json_null(), jid,
+				JRPC_REPLY_TYPE_RESULT );
+}
+
+static jrpc_cb_t handlers[] = { echo, NULL };
+static jrpc_method_t methods[] = {
+	{ "echo", JRPC_CB_HAS_PARAMS, handlers, 0, 0, NULL, NULL },
+	JRPC_METHODS_END
+};
+
+static jrpc_t jrpc = JRPC_SERVER_DEFAULT;
+
+#define REQ( params, id ) \
+	"{\"jsonrpc\":\"2.0\",\"method\":\"echo\",\"params\":" params \
+	",\"id\":" id "}"
+
+/* ids of the replies that came back, "" if none */
+static const char *ids( ipsc_t *pair[2] )
+{
+	static char buf[256];
+	json_t *replies[16];
+	int i;
+	int n = test_replies( pair[0], replies, 16 );
+
+	test_ids( replies, n, buf, sizeof buf );
+	for ( i = 0; i < n; i++ )
+		json_decref( replies[i] );
+	return buf;
+}
+
+/* the one reply there is, NULL if there are none or more */
+static json_t *reply( ipsc_t *pair[2] )
+{
+	json_t *replies[2];
+	int n = test_replies( pair[0], replies, 2 );
+
+	if ( n == 1 )
+		return replies[0];
+	while ( n )
+		json_decref( replies[--n] );
+	return NULL;
+}
+
+static int error_code( json_t *jp )
+{
+	json_t *jerr = json_object_get( jp, "error" );
+
+	return (int)json_integer_value( json_object_get( jerr, "code" ) );
+}
+
+static void test_split( void )
+{
+	ipsc_t *pair[2];
+	const char *req = REQ( "[\"a}]\\\"{\",{\"b\":[1,{}]}]", "1" );
+	json_t *jp;
+	size_t i;
+
+	CHECK( !test_pair( &jrpc, pair, 0 ) );
+
+	/* nothing goes back before the last byte */
+	for ( i = 0; i < strlen( req ) - 1; i++ )
+		test_feed( pair, req + i, 1, 1 );
+	CHECK( !strcmp( ids( pair ), "" ) );
+
+	test_feed( pair, req + i, 1, 1 );
+	jp = reply( pair );
+	CHECK( jp && json_integer_value( json_object_get( jp, "id" ) ) == 1 );
+	CHECK( jp && !strcmp( json_string_value( json_array_get(
+			json_object_get( jp, "result" ), 0 ) ), "a}]\"{" ) );
+	json_decref( jp );
+
+	test_pair_close( pair );
+}
+
+static void test_pipelined( void )
+{
+	ipsc_t *pair[2];
+	const char *reqs = REQ( "[1]", "1" ) "\n " REQ( "[\"}\"]", "2" )
+			   "\r\n" REQ( "{\"x\":{\"y\":[]}}", "\"three\"" );
+
+	CHECK( !test_pair( &jrpc, pair, 0 ) );
+
+	/* all of them in one go */
+	test_feed( pair, reqs, strlen( reqs ), strlen( reqs ) );
+	CHECK( !strcmp( ids( pair ), "1,2,\"three\"" ) );
+
+	/* and cut anywhere, the boundaries landing mid message */
+	test_feed( pair, reqs, strlen( reqs ), 7 );
+	CHECK( !strcmp( ids( pair ), "1,2,\"three\"" ) );
+
+	/* one whole and the next one half way, then the rest */
+	test_feed( pair, reqs, strlen( REQ( "[1]", "1" ) ) + 10,
+		   strlen( reqs ) );
+	CHECK( !strcmp( ids( pair ), "1" ) );
+	test_feed( pair, reqs + strlen( REQ( "[1]", "1" ) ) + 10,
+		   strlen( reqs ) - strlen( REQ( "[1]", "1" ) ) - 10,
+		   strlen( reqs ) );
+	CHECK( !strcmp( ids( pair ), "2,\"three\"" ) );
+
+	test_pair_close( pair );
+}
+
+static void test_malformed( void )
+{
+	ipsc_t *pair[2];
+	json_t *jp;
+	const char *bad[] = {
+		REQ( "[1,]", "3" ),	/* balanced, but not JSON */
+		"hello\n",		/* not even a value */
+		"]",			/* closes nothing */
+		NULL
+	};
+	int i;
+
+	CHECK( !test_pair( &jrpc, pair, 0 ) );
+
+	/* each gets a parse error, and the connection goes on */
+	for ( i = 0; bad[i]; i++ ) {
+		test_feed( pair, bad[i], strlen( bad[i] ), strlen( bad[i] ) );
+		jp = reply( pair );
+		CHECK( error_code( jp ) == JRPC_CODE_PARSE_ERROR );
+		json_decref( jp );
+
+		test_feed( pair, REQ( "[4]", "4" ), strlen( REQ( "[4]", "4" ) ),
+			   5 );
+		CHECK( !strcmp( ids( pair ), "4" ) );
+	}
+
+	test_pair_close( pair );
+}
+
+static void test_deep( void )
+{
+	ipsc_t *pair[2];
+	char *req = (char *)malloc( 2 * TEST_DEEP + 128 );
+	size_t len;
+	json_t *jp;
+
+	len = sprintf( req, "{\"jsonrpc\":\"2.0\",\"method\":\"echo\","
+		       "\"id\":5,\"params\":" );
+	memset( req + len, '[', TEST_DEEP );
+	memset( req + len + TEST_DEEP, ']', TEST_DEEP );
+	len += 2 * TEST_DEEP;
+	req[len++] = '}';
+
+	CHECK( !test_pair( &jrpc, pair, 0 ) );
+
+	/* found whole by the bracket count, turned down by the parser */
+	test_feed( pair, req, len, 4096 );
+	jp = reply( pair );
+	CHECK( jp && json_object_get( jp, "error" ) );
+	json_decref( jp );
+
+	test_feed( pair, REQ( "[6]", "6" ), strlen( REQ( "[6]", "6" ) ), 64 );
+	CHECK( !strcmp( ids( pair ), "6" ) );
+
+	test_pair_close( pair );
+	free( req );
+}
+
+static void test_truncated( void )
+{
+	ipsc_t *pair[2];
+	const char *req = REQ( "[7]", "7" );
+
+	CHECK( !test_pair( &jrpc, pair, 0 ) );
+
+	/* the peer goes away half way, nothing to answer */
+	send( pair[0]->sd, req, strlen( req ) / 2, 0 );
+	CHECK( jrpc_process( pair[1] ) == 0 );
+	shutdown( pair[0]->sd, SHUT_WR );
+	CHECK( jrpc_process( pair[1] ) < 0 );
+	CHECK( !strcmp( ids( pair ), "" ) );
+
+	test_pair_close( pair );
+}
+
+static void test_framed( void )
+{
+	ipsc_t *pair[2];
+	const char *reqs[] = { REQ( "[8]", "8" ), REQ( "[\"]\"]", "9" ) };
+	unsigned char buf[512];
+	unsigned char *p;
+	json_t *jp;
+	size_t len = 0;
+	size_t n;
+	ssize_t rb;
+	int i;
+	int step;
+	int id;
+
+	for ( i = 0; i < 2; i++ ) {
+		n = strlen( reqs[i] );
+		memset( buf + len, 0, JRPC_FRAME_HDRLEN );
+		buf[len] = JRPC_FRAME_MAGIC;
+		buf[len + 6] = n >> 8;
+		buf[len + 7] = n & 0xff;
+		memcpy( buf + len + JRPC_FRAME_HDRLEN, reqs[i], n );
+		len += JRPC_FRAME_HDRLEN + n;
+	}
+
+	/* the header cut as well, replies come back framed, in order */
+	for ( step = 1; step <= 9; step += 4 ) {
+		CHECK( !test_pair( &jrpc, pair, 1 ) );
+		test_feed( pair, (const char *)buf, len, step );
+
+		rb = recv( pair[0]->sd, buf + len, sizeof buf - len,
+			   MSG_DONTWAIT );
+		p = buf + len;
+		for ( id = 8; rb >= JRPC_FRAME_HDRLEN && p[0] == JRPC_FRAME_MAGIC;
+		      id++ ) {
+			n = ((size_t)p[6] << 8) | p[7];
+			if ( n > (size_t)(rb - JRPC_FRAME_HDRLEN) )
+				break;
+			jp = json_loadb( (const char *)p + JRPC_FRAME_HDRLEN, n, 0,
+					 NULL );
+			CHECK( json_integer_value( json_object_get( jp, "id" ) ) ==
+			       id );
+			json_decref( jp );
+			p += JRPC_FRAME_HDRLEN + n;
+			rb -= JRPC_FRAME_HDRLEN + n;
+		}
+		CHECK( id == 10 && rb == 0 );
+
+		test_pair_close( pair );
+	}
+}
+
+int main( void )
+{
+	pthread_t tid;
+
+	jrpc.conn.port = TEST_PORT;
+	jrpc.methods = methods;
+	if ( test_server_start( &jrpc, &tid ) ) {
+		perror( "jrpc_server" );
+		return 99;
+	}
+
+	test_split();
+	test_pipelined();
+	test_malformed();
+	test_deep();
+	test_truncated();
+	test_framed();
+
+	test_server_stop( &jrpc, tid );
+	return test_done( "stream" );
+}
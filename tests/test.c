@@ -0,0 +1,169 @@
+/**
+ * This file is part of libjrpc library code.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See LICENCE.txt file for more details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "test.h"
+#include "trace.h"
+
+int test_failures;
+
+/* client side of the pairs, what jrpc_send_json() looks at */
+static jrpc_req_t test_creq = JRPC_CLIENT_DEFAULT;
+
+void test_check( int ok, const char *what, const char *file, int line )
+{
+	if ( ok )
+		return;
+
+	test_failures++;
+	printf( "FAIL %s:%i: %s\n", file, line, what );
+	fflush( stdout );
+}
+
+int test_done( const char *name )
+{
+	printf( "%s: %s\n", name, test_failures ? "FAIL" : "ok" );
+	return test_failures ? 1 : 0;
+}
+
+int test_server_start( jrpc_t *jrpc, pthread_t *tid )
+{
+	jrpc_trace_set_level( JRPC_TRACE_OFF );
+
+	if ( pthread_create( tid, NULL, jrpc_server, jrpc ) )
+		return -1;
+	while ( jrpc_server_wake( jrpc ) )
+		usleep( 1000 );
+
+	return 0;
+}
+
+void test_server_stop( jrpc_t *jrpc, pthread_t tid )
+{
+	jrpc_server_stop( jrpc );
+	pthread_join( tid, NULL );
+}
+
+int test_pair( jrpc_t *jrpc, ipsc_t *pair[2], int framed )
+{
+	if ( ipsc_pair( pair ) )
+		return -1;
+
+	pair[0]->cb_args = &test_creq;
+	if ( framed )
+		pair[0]->flags |= JRPC_FLAG_FRAMED | JRPC_FLAG_PROBED;
+	pair[1]->cb_args = jrpc;
+	pair[1]->flags |= IPSC_FLAG_SERVER;
+
+	return 0;
+}
+
+void test_pair_close( ipsc_t *pair[2] )
+{
+	ipsc_close( pair[0] );
+	ipsc_close( pair[1] );
+}
+
+void test_feed( ipsc_t *pair[2], const char *buf, size_t len, size_t n )
+{
+	size_t off;
+
+	for ( off = 0; off < len; off += n ) {
+		if ( n > len - off )
+			n = len - off;
+		if ( send( pair[0]->sd, buf + off, n, 0 ) != (ssize_t)n )
+			CHECK( !"send" );
+		jrpc_process( pair[1] );
+	}
+}
+
+int test_replies( ipsc_t *cli, json_t **replies, int max )
+{
+	static char buf[1 << 16];
+	ssize_t len;
+	size_t i;
+	size_t start = 0;
+	int depth = 0;
+	int str = 0;
+	int n = 0;
+
+	len = recv( cli->sd, buf, sizeof buf, MSG_DONTWAIT );
+	if ( len <= 0 )
+		return 0;
+
+	/* the server writes compact objects, one after another */
+	for ( i = 0; i < (size_t)len && n < max; i++ ) {
+		if ( str ) {
+			if ( buf[i] == '\\' )
+				i++;
+			else if ( buf[i] == '"' )
+				str = 0;
+			continue;
+		}
+		if ( buf[i] == '"' )
+			str = 1;
+		else if ( buf[i] == '{' && !depth++ )
+			start = i;
+		else if ( buf[i] == '}' && !--depth )
+			replies[n++] = json_loadb( buf + start, i + 1 - start,
+						   0, NULL );
+	}
+
+	return n;
+}
+
+char *test_ids( json_t **replies, int n, char *ids, size_t size )
+{
+	int i;
+	size_t len = 0;
+	char *s;
+
+	ids[0] = '\0';
+	for ( i = 0; i < n; i++ ) {
+		s = json_dumps( json_object_get( replies[i], "id" ),
+				JSON_COMPACT | JSON_ENCODE_ANY );
+		len += snprintf( ids + len, len < size ? size - len : 0,
+				 "%s%s", i ? "," : "", s ? s : "-" );
+		free( s );
+	}
+
+	return ids;
+}
+
+json_t *test_call( ipsc_t *pair[2], const char *method, json_t *jparams,
+		   int id )
+{
+	json_t *jroot = json_object();
+	json_t *jp = NULL;
+
+	json_object_set_new( jroot, "jsonrpc", json_string( "2.0" ) );
+	json_object_set_new( jroot, "method", json_string( method ) );
+	if ( jparams )
+		json_object_set( jroot, "params", jparams );
+	json_object_set_new( jroot, "id", json_integer( id ) );
+
+	if ( jrpc_send_json( pair[0], jroot ) > 0 ) {
+		jrpc_process( pair[1] );
+		if ( jrpc_recv_json( pair[0], &jp ) < 0 )
+			jp = NULL;
+	}
+
+	json_decref( jroot );
+	return jp;
+}
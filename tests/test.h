@@ -0,0 +1,61 @@
+/**
+ * This file is part of libjrpc library code.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See LICENCE.txt file for more details.
+ */
+
+#ifndef _LIBJRPC_TEST_H_
+#define _LIBJRPC_TEST_H_
+
+#include <pthread.h>
+
+#include <jansson.h>
+
+#include "ipsc.h"
+#include "jrpc.h"
+
+/* count it and say where, the test goes on */
+#define CHECK( cond ) \
+	test_check( !!(cond), #cond, __FILE__, __LINE__ )
+
+extern int test_failures;
+
+void test_check( int ok, const char *what, const char *file, int line );
+/* 0 - all checks passed, for main() to return */
+int test_done( const char *name );
+
+/*
+ * jrpc runs a server left idle on its port, just for its method index,
+ * cache and limits; requests are served by jrpc_process() on the server
+ * end of a socketpair, by the test itself
+ */
+int test_server_start( jrpc_t *jrpc, pthread_t *tid );
+void test_server_stop( jrpc_t *jrpc, pthread_t tid );
+
+/* pair[0] the client end, framed if asked, pair[1] served for jrpc */
+int test_pair( jrpc_t *jrpc, ipsc_t *pair[2], int framed );
+void test_pair_close( ipsc_t *pair[2] );
+
+/* raw bytes to the server end, n at a time, jrpc_process() after each */
+void test_feed( ipsc_t *pair[2], const char *buf, size_t len, size_t n );
+
+/*
+ * unframed replies that came back so far, one after another; the ids of
+ * those found go to ids, compact and comma separated. Returns how many.
+ */
+int test_replies( ipsc_t *cli, json_t **replies, int max );
+char *test_ids( json_t **replies, int n, char *ids, size_t size );
+
+/* a call over a framed pair, the reply or NULL */
+json_t *test_call( ipsc_t *pair[2], const char *method, json_t *jparams,
+		   int id );
+
+#endif /* _LIBJRPC_TEST_H_ */